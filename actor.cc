@@ -68,7 +68,7 @@ Actor::Actor(const int id, const Animation &anim, Seriko *parent)
 
 void Actor::activate(From from) {
     if (anim_.pattern.size() == 0) {
-        Logger::log("0-sized pattern");
+        Logger::warn("0-sized pattern");
         return;
     }
     if (anim_.interval.contains(Interval::Bind) && !parent_->isBinding(id_)) {
@@ -25,6 +25,10 @@ class Actor {
         }
         void inactivate();
         const Pattern &currentPattern() const;
+        // 次のパターンに進むまでの時間(ms)
+        int remaining() const {
+            return wait_;
+        }
         void update(int elapsed);
         const std::unordered_set<Interval> &interval() const {
             return anim_.interval;
@@ -0,0 +1,248 @@
+#include "animation_source.h"
+
+#include <cstring>
+#include <fstream>
+
+#include "logger.h"
+
+namespace {
+    class Reader {
+        private:
+            std::ifstream ifs_;
+        public:
+            Reader(const std::filesystem::path &path) : ifs_(path, std::ios::binary) {}
+            bool good() const {
+                return ifs_.good();
+            }
+            bool read(unsigned char *buf, size_t n) {
+                ifs_.read(reinterpret_cast<char *>(buf), n);
+                return ifs_.gcount() == static_cast<std::streamsize>(n);
+            }
+            int byte() {
+                unsigned char c;
+                if (!read(&c, 1)) {
+                    return -1;
+                }
+                return c;
+            }
+            bool skip(size_t n) {
+                ifs_.seekg(n, std::ios::cur);
+                return ifs_.good();
+            }
+    };
+
+    int be32(const unsigned char *p) {
+        return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+    }
+
+    int be16(const unsigned char *p) {
+        return (p[0] << 8) | p[1];
+    }
+
+    // GIFのデータサブブロックを読み飛ばす
+    bool skipSubBlocks(Reader &r) {
+        while (true) {
+            int n = r.byte();
+            if (n < 0) {
+                return false;
+            }
+            if (n == 0) {
+                return true;
+            }
+            if (!r.skip(n)) {
+                return false;
+            }
+        }
+    }
+
+    std::optional<std::vector<int>> readGIFDelays(Reader &r) {
+        unsigned char header[13];
+        if (!r.read(header, sizeof(header)) || std::memcmp(header, "GIF8", 4) != 0) {
+            return std::nullopt;
+        }
+        if (header[10] & 0x80) {
+            r.skip(3 * (1 << ((header[10] & 0x07) + 1)));
+        }
+        std::vector<int> delays;
+        int delay = 0;
+        while (true) {
+            int b = r.byte();
+            if (b < 0 || b == 0x3b) {
+                break;
+            }
+            if (b == 0x21) {
+                int label = r.byte();
+                if (label == 0xf9) {
+                    // Graphic Control Extension
+                    unsigned char gce[5];
+                    if (!r.read(gce, sizeof(gce)) || gce[0] < 4) {
+                        break;
+                    }
+                    delay = (gce[2] | (gce[3] << 8)) * 10;
+                    r.skip(gce[0] - 4);
+                }
+                if (label < 0 || !skipSubBlocks(r)) {
+                    break;
+                }
+            }
+            else if (b == 0x2c) {
+                unsigned char desc[9];
+                if (!r.read(desc, sizeof(desc))) {
+                    break;
+                }
+                if (desc[8] & 0x80) {
+                    r.skip(3 * (1 << ((desc[8] & 0x07) + 1)));
+                }
+                // LZWの最小コードサイズ
+                if (!r.skip(1) || !skipSubBlocks(r)) {
+                    break;
+                }
+                delays.push_back(delay);
+                delay = 0;
+            }
+            else {
+                break;
+            }
+        }
+        if (delays.empty()) {
+            return std::nullopt;
+        }
+        return delays;
+    }
+
+    std::optional<std::vector<int>> readPNGDelays(Reader &r) {
+        const unsigned char signature[8] = {0x89, 'P', 'N', 'G', 0x0d, 0x0a, 0x1a, 0x0a};
+        unsigned char header[8];
+        if (!r.read(header, sizeof(header)) || std::memcmp(header, signature, sizeof(signature)) != 0) {
+            return std::nullopt;
+        }
+        std::vector<int> delays;
+        while (true) {
+            unsigned char chunk[8];
+            if (!r.read(chunk, sizeof(chunk))) {
+                break;
+            }
+            int length = be32(chunk);
+            if (length < 0) {
+                break;
+            }
+            if (std::memcmp(chunk + 4, "IEND", 4) == 0) {
+                break;
+            }
+            if (std::memcmp(chunk + 4, "fcTL", 4) == 0 && length >= 26) {
+                unsigned char fctl[26];
+                if (!r.read(fctl, sizeof(fctl))) {
+                    break;
+                }
+                int num = be16(fctl + 20);
+                int den = be16(fctl + 22);
+                // 分母が0なら1/100秒単位
+                delays.push_back(num * 1000 / ((den == 0) ? (100) : (den)));
+                length -= 26;
+            }
+            // データとCRC
+            if (!r.skip(length + 4)) {
+                break;
+            }
+        }
+        // APNGでなければ1枚だけ
+        if (delays.empty()) {
+            delays.push_back(0);
+        }
+        return delays;
+    }
+}
+
+AnimationSource::AnimationSource(const std::filesystem::path &path) : path_(path), next_(0) {
+#if defined(USE_ANIMATION_DECODER)
+    decoder_ = IMG_CreateAnimationDecoder(path_.string().c_str());
+    if (decoder_ == nullptr) {
+        Logger::warn("failed to create animation decoder: ", path_);
+    }
+#else
+    animation_ = IMG_LoadAnimation(path_.string().c_str());
+    if (animation_ == nullptr) {
+        Logger::warn("failed to load animation: ", path_);
+    }
+#endif // USE_ANIMATION_DECODER
+}
+
+AnimationSource::~AnimationSource() {
+#if defined(USE_ANIMATION_DECODER)
+    if (decoder_ != nullptr) {
+        IMG_CloseAnimationDecoder(decoder_);
+    }
+#else
+    if (animation_ != nullptr) {
+        IMG_FreeAnimation(animation_);
+    }
+#endif // USE_ANIMATION_DECODER
+}
+
+bool AnimationSource::decode(int index, int count, const std::function<void(int, SDL_Surface *)> &f) {
+#if defined(USE_ANIMATION_DECODER)
+    if (decoder_ == nullptr) {
+        return false;
+    }
+    // フレームは前のフレームに重ねて作られるので先頭からやり直す
+    if (index < next_) {
+        if (!IMG_ResetAnimationDecoder(decoder_)) {
+            return false;
+        }
+        next_ = 0;
+    }
+    bool decoded = false;
+    while (next_ < index + count) {
+        SDL_Surface *frame = nullptr;
+        Uint64 duration;
+        if (!IMG_GetAnimationDecoderFrame(decoder_, &frame, &duration) || frame == nullptr) {
+            break;
+        }
+        if (next_ >= index) {
+            f(next_, frame);
+            decoded = true;
+        }
+        SDL_DestroySurface(frame);
+        next_++;
+    }
+    return decoded;
+#else
+    if (animation_ == nullptr) {
+        return false;
+    }
+    bool decoded = false;
+    for (int i = index; i < index + count && i < animation_->count; i++) {
+        f(i, animation_->frames[i]);
+        decoded = true;
+    }
+    return decoded;
+#endif // USE_ANIMATION_DECODER
+}
+
+std::optional<std::vector<int>> AnimationSource::readDelays(const std::filesystem::path &path) {
+    {
+        Reader r(path);
+        if (!r.good()) {
+            return std::nullopt;
+        }
+        auto delays = readGIFDelays(r);
+        if (delays) {
+            return delays;
+        }
+    }
+    {
+        Reader r(path);
+        auto delays = readPNGDelays(r);
+        if (delays) {
+            return delays;
+        }
+    }
+    // それ以外の形式はSDL_imageに任せる
+    IMG_Animation *anim = IMG_LoadAnimation(path.string().c_str());
+    if (anim == nullptr) {
+        return std::nullopt;
+    }
+    std::vector<int> delays(anim->delays, anim->delays + anim->count);
+    IMG_FreeAnimation(anim);
+    return delays;
+}
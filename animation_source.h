@@ -0,0 +1,40 @@
+#ifndef ANIMATION_SOURCE_H_
+#define ANIMATION_SOURCE_H_
+
+#include <filesystem>
+#include <functional>
+#include <optional>
+#include <vector>
+
+#include <SDL3/SDL_surface.h>
+#include <SDL3_image/SDL_image.h>
+
+#if SDL_IMAGE_VERSION_ATLEAST(3, 4, 0)
+#define USE_ANIMATION_DECODER
+#endif
+
+// アニメーション画像(APNG/GIF)からフレームを必要な分だけ取り出す
+class AnimationSource {
+    private:
+        std::filesystem::path path_;
+#if defined(USE_ANIMATION_DECODER)
+        IMG_AnimationDecoder *decoder_;
+#else
+        // 逐次デコードできないので全体を1度だけ読んで持っておく
+        IMG_Animation *animation_;
+#endif // USE_ANIMATION_DECODER
+        // 次にデコーダが返すフレーム
+        int next_;
+
+    public:
+        AnimationSource(const std::filesystem::path &path);
+        ~AnimationSource();
+        // index番目からcount枚をデコードしてfに渡す
+        // surfaceはfから戻った後に破棄される
+        bool decode(int index, int count, const std::function<void(int, SDL_Surface *)> &f);
+
+        // 画素をデコードせずに各フレームの表示時間(ms)を読む
+        static std::optional<std::vector<int>> readDelays(const std::filesystem::path &path);
+};
+
+#endif // ANIMATION_SOURCE_H_
@@ -1,5 +1,6 @@
 #include "ao.h"
 
+#include <chrono>
 #include <cstdint>
 #include <filesystem>
 #include <fstream>
@@ -12,32 +13,29 @@
 #if defined(_WIN32) || defined(WIN32)
 #include <fcntl.h>
 #include <io.h>
-#include <ws2tcpip.h>
-#include <afunix.h>
+#include <winsock2.h>
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 #undef max
 #undef min
-#else
-#include <sys/socket.h>
-#include <sys/un.h>
-#include <unistd.h>
 #endif // WIN32
 
 #include "sorakado.h"
+#include "clock.h"
+#include "cpu_compositor.h"
+#include "gpu_compositor.h"
+#include "ipc.h"
 #include "logger.h"
+#include "metrics.h"
 #include "misc.h"
 #include "sstp.h"
+#include "trace.h"
 #include "util.h"
 #include "window.h"
 
 namespace {
-#ifndef IS_WINDOWS
-    inline int closesocket(int fd) {
-        return close(fd);
-    }
-    const auto SD_SEND = SHUT_WR;
-#endif
+    // 受信スレッドからメインループに渡して未処理のsorakadoの要求
+    metrics::Gauge &queue_depth = metrics::gauge("ao.queue_depth");
 }
 
 Ao::~Ao() {
@@ -45,9 +43,17 @@ Ao::~Ao() {
         std::unique_lock<std::mutex> lock(mutex_);
         alive_ = false;
     }
-    th_send_->join();
+    // 応答待ちの要求は捨てる
+    coalescer_.reset();
+    client_.reset();
     th_recv_->join();
     characters_.clear();
+    reporter_.reset();
+#if defined(USE_TRACE)
+    if (getenv("AO_TRACE")) {
+        trace::dump(getenv("AO_TRACE"));
+    }
+#endif // USE_TRACE
 #ifdef IS_WINDOWS
     WSACleanup();
 #endif // Windows
@@ -61,22 +67,72 @@ bool Ao::init() {
     _setmode(_fileno(stdout), _O_BINARY);
 #endif // Windows
 
+#if defined(USE_TRACE)
+    if (getenv("AO_TRACE")) {
+        trace::start();
+    }
+#endif // USE_TRACE
+
+    if (getenv("AO_METRICS_INTERVAL")) {
+        int interval = 0;
+        util::to_x(getenv("AO_METRICS_INTERVAL"), interval);
+        if (interval > 0) {
+            std::filesystem::path path;
+            if (getenv("AO_METRICS_FILE")) {
+                path = getenv("AO_METRICS_FILE");
+            }
+            reporter_ = std::make_unique<metrics::Reporter>(std::chrono::seconds(interval), path);
+        }
+    }
+
+    wake_event_ = SDL_RegisterEvents(1);
+
+    {
+        int max_in_flight = 4, timeout = 5000;
+        if (getenv("AO_SSTP_MAX_IN_FLIGHT")) {
+            util::to_x(getenv("AO_SSTP_MAX_IN_FLIGHT"), max_in_flight);
+        }
+        if (getenv("AO_SSTP_TIMEOUT")) {
+            util::to_x(getenv("AO_SSTP_TIMEOUT"), timeout);
+        }
+        client_ = std::make_unique<SSTPClient>(max_in_flight, timeout);
+    }
+    {
+        int rate = 60;
+        if (getenv("AO_SSTP_EVENT_RATE")) {
+            util::to_x(getenv("AO_SSTP_EVENT_RATE"), rate);
+        }
+        coalescer_ = std::make_unique<EventCoalescer>([this](std::vector<Request> list, std::function<void()> done) {
+            sendChain(std::make_shared<std::vector<Request>>(std::move(list)), 0, std::move(done));
+        }, rate);
+    }
+
     th_recv_ = std::make_unique<std::thread>([&]() {
-        uint32_t len;
+        // 標準入力と標準出力
+        FramedReader reader(0);
+        FramedWriter writer(1);
+        // 受け取った要求を時刻と共に1行ずつ記録する(bench/replay.exeで再生できる)
+        std::ofstream record;
+        if (getenv("AO_RECORD_TRACE")) {
+            record.open(getenv("AO_RECORD_TRACE"));
+        }
+        Json::StreamWriterBuilder builder;
+        builder["indentation"] = "";
+        auto begin = Clock::now();
         while (true) {
-            std::cin.read(reinterpret_cast<char *>(&len), sizeof(uint32_t));
-            if (std::cin.eof() || len == 0) {
+            auto request = reader.next();
+            if (!request) {
                 break;
             }
-            char *buffer = new char[len];
-            std::cin.read(buffer, len);
-            std::string request(buffer, len);
-            delete[] buffer;
-            if (std::cin.gcount() < len) {
-                break;
+            TRACE_ZONE("Ao::receive");
+            if (record.is_open()) {
+                Json::Value line;
+                line["t"] = std::chrono::duration<double, std::milli>(Clock::now() - begin).count();
+                line["request"] = std::string(request.value());
+                record << Json::writeString(builder, line) << std::endl;
             }
-            auto req = sorakado::Request::parse(request);
-            Logger::log(request);
+            auto req = sorakado::Request::parse(request.value());
+            Logger::log(request.value());
             auto event = req().value();
 
             sorakado::Response res {204, "No Content"};
@@ -107,6 +163,11 @@ bool Ao::init() {
                 bool playing = isPlayingAnimation(side, id);
                 res() = static_cast<int>(playing);
             }
+            else if (event == "GetMetrics") {
+                // 値はアトミックなのでメインループを待たずに返す
+                res = {200, "OK"};
+                res() = Json::writeString(builder, metrics::snapshot());
+            }
             else {
                 std::vector<std::string> args;
                 args.push_back(event);
@@ -118,23 +179,29 @@ bool Ao::init() {
                         break;
                     }
                 }
-                std::unique_lock<std::mutex> lock(mutex_);
-                queue_.push(args);
+                {
+                    std::unique_lock<std::mutex> lock(mutex_);
+                    queue_.push(args);
+                    queue_depth.set(queue_.size());
+                }
+                wake();
             }
 
             res["Charset"] = "UTF-8";
 
             std::string response = res;
             Logger::log(response);
-            len = response.size();
-            std::cout.write(reinterpret_cast<char *>(&len), sizeof(uint32_t));
-            std::cout.write(response.c_str(), len);
+            writer.write(response);
+            // 続けて届いているものがあれば応答はまとめて返す
+            if (!reader.ready()) {
+                writer.flush();
+            }
         }
+        writer.flush();
         {
             std::unique_lock<std::mutex> lock(mutex_);
             loaded_ = true;
             alive_ = false;
-            event_queue_.push({{"", "", {}}});
         }
         cond_.notify_one();
     });
@@ -215,28 +282,37 @@ bool Ao::init() {
     std::filesystem::path exe_dir = exe_path;
     exe_dir = exe_dir.parent_path();
     bool use_self_alpha = (getInfo("seriko.use_self_alpha", false) == "1");
-    cache_ = std::make_unique<ImageCache>(exe_dir, use_self_alpha);
-
-    th_send_ = std::make_unique<std::thread>([&]() {
-        while (true) {
-            std::vector<Request> list;
-            {
-                std::unique_lock<std::mutex> lock(mutex_);
-                cond_.wait(lock, [this] { return !event_queue_.empty(); });
-                if (!alive_) {
-                    break;
-                }
-                list = event_queue_.front();
-                event_queue_.pop();
-            }
-            for (auto &request : list) {
-                auto res = sstp::Response::parse(sendDirectSSTP(request.method, request.command, request.args));
-                if (res.getStatusCode() != 204) {
-                    break;
-                }
+    bool serve_nearest = (getenv("AO_ENABLE_NEAREST_SCALE") != nullptr);
+    bool gpu_scaling = (getenv("AO_ENABLE_GPU_SCALING") != nullptr);
+    ResampleFilter filter = ResampleFilter::Auto;
+    if (getenv("AO_RESAMPLE_FILTER")) {
+        filter = resampler::toFilter(getenv("AO_RESAMPLE_FILTER"));
+    }
+    cache_ = std::make_unique<ImageCache>(exe_dir, use_self_alpha, serve_nearest, gpu_scaling, filter);
+    cache_->setListener([this]() {
+        wake();
+    });
+    std::unique_ptr<Compositor> compositor;
+    if (getenv("AO_COMPOSITOR")) {
+        std::string name = getenv("AO_COMPOSITOR");
+        if (name == "gpu") {
+            compositor = GPUCompositor::create(exe_dir);
+        }
+        if (!compositor) {
+            // GPUが使えなければCPUで合成する
+            if (name != "cpu") {
+                Logger::warn("compositor not available:", name);
             }
+            compositor = std::make_unique<CPUCompositor>();
         }
+    }
+    worker_ = std::make_unique<RenderWorker>(cache_, std::move(compositor));
+    worker_->setListener([this]() {
+        wake();
     });
+    if (!getenv("AO_DISABLE_PREFETCH")) {
+        prefetcher_ = std::make_unique<Prefetcher>(cache_);
+    }
 
 #if !defined(DEBUG)
     surfaces_ = std::make_unique<Surfaces>(ao_dir_);
@@ -307,6 +383,10 @@ void Ao::setSurface(int side, int id) {
         return;
     }
     characters_.at(side)->setSurface(id);
+    if (prefetcher_) {
+        // 画像を集めるのは(遅延モードでの解析を含めて)Prefetcherのスレッドで行う
+        prefetcher_->prefetch(side, characters_.at(side)->surfaces(), id, prefetcher_->observe(side, id));
+    }
 }
 
 void Ao::startAnimation(int side, int id) {
@@ -337,14 +417,28 @@ void Ao::clearCache() {
     }
 }
 
+void Ao::wake() {
+    if (wake_event_ == 0) {
+        return;
+    }
+    SDL_Event event;
+    SDL_zero(event);
+    event.type = wake_event_;
+    SDL_PushEvent(&event);
+}
+
 void Ao::run() {
     SDL_Event event;
-    while ((redrawn_) ? (SDL_PollEvent(&event)) : (SDL_WaitEventTimeout(&event, 10))) {
+    bool has_event = scheduler_.wait(event);
+    while (has_event) {
+        // 何かあれば次のフレームで描画し直す
+        scheduler_.request();
         switch (event.type) {
             case SDL_EVENT_QUIT:
                 alive_ = false;
                 return;
             case SDL_EVENT_DISPLAY_ADDED:
+                scheduler_.updateRefreshRate();
                 if (util::isWayland() && getenv("NINIX_ENABLE_MULTI_MONITOR")) {
                     for (auto &[_, v] : characters_) {
                         v->create(event.display.displayID);
@@ -352,6 +446,7 @@ void Ao::run() {
                 }
                 break;
             case SDL_EVENT_DISPLAY_REMOVED:
+                scheduler_.updateRefreshRate();
                 if (util::isWayland() && getenv("NINIX_ENABLE_MULTI_MONITOR")) {
                     for (auto &[_, v] : characters_) {
                         v->destroy(event.display.displayID);
@@ -409,6 +504,7 @@ void Ao::run() {
             default:
                 break;
         }
+        has_event = SDL_PollEvent(&event);
     }
     if (util::isX11() && menu_ && !menu_->focused()) {
         menu_->kill();
@@ -423,6 +519,7 @@ void Ao::run() {
             queue.push(queue_.front());
             queue_.pop();
         }
+        queue_depth.set(0);
     }
     bool changed = false;
     while (!queue.empty()) {
@@ -462,7 +559,7 @@ void Ao::run() {
                         continue;
                     }
                     scale_ = scale;
-                    clearCache();
+                    // 倍率毎にキャッシュしているので破棄はしない
                     cache_->setScale(scale);
                     changed = true;
                 }
@@ -510,19 +607,46 @@ void Ao::run() {
                 bind(side, id, args[4], flag);
             } while (false);
         }
+#if defined(USE_TRACE)
+        else if (args[0] == "DumpTrace") {
+            // 引数が無ければAO_TRACEに書き出す
+            if (args.size() >= 2) {
+                trace::dump(args[1]);
+            }
+            else if (getenv("AO_TRACE")) {
+                trace::dump(getenv("AO_TRACE"));
+            }
+        }
+#endif // USE_TRACE
         else if (args[0] == "OnScriptBegin") {
             raise();
         }
         else if (args[0] == "OnScriptEnd") {
         }
     }
+    // 倍率の変更は次に描画するフレームまで持ち越す
+    changed_ = changed_ || changed;
+    if (changed_) {
+        scheduler_.request();
+    }
+    // 描画はリフレッシュ毎に1回にまとめる
+    if (!scheduler_.due()) {
+        return;
+    }
+    changed = changed_;
+    changed_ = false;
     std::vector<int> keys;
     for (auto &[k, _] : characters_) {
         keys.push_back(k);
     }
     std::sort(keys.begin(), keys.end());
     for (auto k : keys) {
-        characters_.at(k)->draw(cache_, changed);
+        if (prefetcher_) {
+            if (auto list = prefetcher_->resolved(k)) {
+                characters_.at(k)->prefetch(std::move(list.value()));
+            }
+        }
+        characters_.at(k)->draw(cache_, worker_, changed);
     }
     if (menu_) {
         menu_->draw();
@@ -534,6 +658,16 @@ void Ao::run() {
     if (menu_) {
         redrawn_ = menu_->swapBuffers() || redrawn_;
     }
+    scheduler_.presented();
+    std::optional<int> deadline;
+    for (auto k : keys) {
+        auto d = characters_.at(k)->nextDeadline();
+        if (d && (!deadline || d.value() < deadline.value())) {
+            deadline = d;
+        }
+    }
+    // 拡大中の画像が揃った時はImageCacheから起こされる
+    scheduler_.setDeadline(deadline);
 }
 
 void Ao::raise() {
@@ -707,14 +841,10 @@ std::optional<Offset> Ao::getCharacterOffset(int side) {
     return ret;
 }
 
-std::string Ao::sendDirectSSTP(std::string method, std::string command, std::vector<std::string> args) {
+std::string Ao::makeRequest(const std::string &method, const std::string &command, const std::vector<std::string> &args) {
     sstp::Request req {method};
-    sstp::Response res {500, "Internal Server Error"};
     req["Charset"] = "UTF-8";
     req["Ao"] = uuid_;
-    if (path_.empty()) {
-        return res;
-    }
     req["Sender"] = "AYU_PoC";
     req["Option"] = "nodescript";
     if (req.getCommand() == "EXECUTE") {
@@ -726,50 +856,46 @@ std::string Ao::sendDirectSSTP(std::string method, std::string command, std::vec
     for (int i = 0; i < args.size(); i++) {
         req(i) = args[i];
     }
-    sockaddr_un addr;
-    if (path_.length() >= sizeof(addr.sun_path)) {
-        return res;
-    }
-    int soc = socket(AF_UNIX, SOCK_STREAM, 0);
-    if (soc == -1) {
+    return req;
+}
+
+std::string Ao::sendDirectSSTP(std::string method, std::string command, std::vector<std::string> args) {
+    TRACE_ZONE("Ao::sendDirectSSTP");
+    sstp::Response res {500, "Internal Server Error"};
+    if (path_.empty()) {
         return res;
     }
-    memset(&addr, 0, sizeof(sockaddr_un));
-    addr.sun_family = AF_UNIX;
-    // null-terminatedも書き込ませる
-    strncpy(addr.sun_path, path_.c_str(), path_.length() + 1);
-    if (connect(soc, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) == -1) {
+    auto data = client_->sendSync(path_, makeRequest(method, command, args));
+    if (!data) {
         return res;
     }
-    std::string request = req;
-    if (send(soc, request.c_str(), request.size(), 0) != request.size()) {
-        closesocket(soc);
-        return res;
+    return data.value();
+}
+
+void Ao::sendChain(std::shared_ptr<std::vector<Request>> list, size_t index, std::function<void()> done) {
+    if (index >= list->size() || path_.empty()) {
+        done();
+        return;
     }
-    shutdown(soc, SD_SEND);
-    char buffer[BUFFER_SIZE] = {};
-    std::string data;
-    while (true) {
-        int ret = recv(soc, buffer, BUFFER_SIZE, 0);
-        if (ret == -1) {
-            closesocket(soc);
-            return res;
-        }
-        if (ret == 0) {
-            closesocket(soc);
-            break;
+    auto &request = list->at(index);
+    client_->send(path_, makeRequest(request.method, request.command, request.args), [this, list, index, done](std::optional<std::string> data) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        // 終了処理中はcoalescer_が先に破棄されるのでdoneは呼ばない
+        if (!alive_) {
+            return;
         }
-        data.append(buffer, ret);
-    }
-    return data;
+        // 前の要求が処理されなければ続きは送らない
+        if (!data || sstp::Response::parse(data.value()).getStatusCode() != 204 || index + 1 >= list->size()) {
+            done();
+            return;
+        }
+        // ~Aoはalive_を下ろしてからclient_を破棄するので、鍵を持ったまま送る
+        sendChain(list, index + 1, done);
+    });
 }
 
 void Ao::enqueueDirectSSTP(std::vector<Request> list) {
-    {
-        std::unique_lock<std::mutex> lock(mutex_);
-        event_queue_.push(list);
-    }
-    cond_.notify_one();
+    coalescer_->push(std::move(list));
 }
 
 void Ao::reserveMenuParent(int side, int x, int y, int w, int h) {
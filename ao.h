@@ -4,6 +4,7 @@
 #include <condition_variable>
 #include <cstdlib>
 #include <filesystem>
+#include <functional>
 #include <iostream>
 #include <memory>
 #include <mutex>
@@ -18,10 +19,16 @@
 #include <json/json.h>
 
 #include "character.h"
+#include "event_coalescer.h"
 #include "font.h"
+#include "frame_scheduler.h"
 #include "image_cache.h"
 #include "menu.h"
+#include "metrics.h"
 #include "misc.h"
+#include "prefetcher.h"
+#include "render_worker.h"
+#include "sstp_client.h"
 #include "surfaces.h"
 #include "util.h"
 #include "window.h"
@@ -38,27 +45,41 @@ class Ao {
         std::mutex mutex_;
         std::condition_variable cond_;
         std::queue<std::vector<std::string>> queue_;
-        std::queue<std::vector<Request>> event_queue_;
         std::unique_ptr<std::thread> th_recv_;
-        std::unique_ptr<std::thread> th_send_;
+        std::unique_ptr<SSTPClient> client_;
+        std::unique_ptr<EventCoalescer> coalescer_;
         std::filesystem::path ao_dir_;
         std::unordered_map<std::string, std::string> info_;
         std::unordered_map<int, std::unordered_map<std::string, int>> bind_id_;
         std::unordered_map<int, std::unique_ptr<Character>> characters_;
         std::unique_ptr<Surfaces> surfaces_;
         std::unique_ptr<ImageCache> cache_;
+        std::unique_ptr<RenderWorker> worker_;
+        std::unique_ptr<Prefetcher> prefetcher_;
         std::string path_;
         std::string uuid_;
         bool alive_;
         int scale_;
         bool loaded_;
         bool redrawn_;
+        bool changed_;
         std::unique_ptr<Menu> menu_;
         MenuInitInfo menu_init_info_;
         std::unique_ptr<WrapFont> font_;
+        FrameScheduler scheduler_;
+        // AO_METRICS_INTERVALが指定された時だけ作る
+        std::unique_ptr<metrics::Reporter> reporter_;
+        // 他のスレッドからメインループを起こすイベント
+        Uint32 wake_event_;
+
+        void wake();
+        std::string makeRequest(const std::string &method, const std::string &command, const std::vector<std::string> &args);
+        // listの要求を順に送り、204以外が返ったらそこで止める
+        // 最後まで送るか止めた時にdoneを呼ぶ
+        void sendChain(std::shared_ptr<std::vector<Request>> list, size_t index, std::function<void()> done);
 
     public:
-        Ao() : alive_(true), scale_(100), loaded_(false), redrawn_(false) {
+        Ao() : alive_(true), scale_(100), loaded_(false), redrawn_(false), changed_(false), wake_event_(0) {
             init();
 #if defined(DEBUG)
             ao_dir_ = "./shell/master";
@@ -77,6 +98,11 @@ class Ao {
 
         std::optional<Offset> getCharacterOffset(int side);
 
+        // 合成器が結果を置くデバイス(無ければnullptr)
+        SDL_GPUDevice *gpuDevice() {
+            return (worker_) ? (worker_->device()) : (nullptr);
+        }
+
         void show(int side);
 
         void hide(int side);
@@ -110,6 +136,10 @@ class Ao {
         int scale() const {
             return scale_;
         }
+
+        const FrameScheduler &scheduler() const {
+            return scheduler_;
+        }
 };
 
 #endif // GL_AYU_H_
@@ -0,0 +1,173 @@
+// GPUCompositor(shader/compositor.comp)の結果をCPUCompositorと比べる
+// 乱数で作ったLayerListを両方で合成し、色とアルファの差をJSONで出力する
+// 画面は出さない(VK_DRIVER_FILESでlavapipeを指定すればGPUが無くても動く)
+// 差が許容値を超えたものがあれば1を返す
+//
+// usage: compositor_check.exe [shader_dir] [cases] [seed]
+
+#include <algorithm>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <SDL3/SDL.h>
+#include <json/json.h>
+
+#include "cpu_compositor.h"
+#include "gpu_compositor.h"
+#include "layer.h"
+
+namespace {
+    // 8bitに丸める時の誤差
+    const int kTolerance = 2;
+    const int kImages = 4;
+    const int kMaxSize = 160;
+
+    struct Image {
+        ImagePath path;
+        ImageInfo info;
+    };
+
+    ImageInfo randomImage(std::mt19937 &rng, int scale) {
+        int w = std::uniform_int_distribution<int>(1, 96)(rng);
+        int h = std::uniform_int_distribution<int>(1, 96)(rng);
+        std::vector<unsigned char> data(w * h * 4);
+        std::uniform_int_distribution<int> byte(0, 255);
+        for (int i = 0; i < w * h; i++) {
+            // 透明な部分も混ぜる
+            int a = (byte(rng) < 64) ? (0) : (byte(rng));
+            for (int c = 0; c < 3; c++) {
+                data[4 * i + c] = (a == 0) ? (0) : (byte(rng) % (a + 1));
+            }
+            data[4 * i + 3] = a;
+        }
+        return ImageInfo(std::move(data), w, h, true, scale);
+    }
+
+    BlendOp randomBlend(std::mt19937 &rng) {
+        return static_cast<BlendOp>(std::uniform_int_distribution<int>(0, static_cast<int>(BlendOp::Reduce))(rng));
+    }
+
+    void appendLayers(std::mt19937 &rng, std::vector<Image> &images, LayerList &list, int depth) {
+        int count = std::uniform_int_distribution<int>(1, 6)(rng);
+        std::uniform_int_distribution<int> x(-16, list.width), y(-16, list.height);
+        for (int i = 0; i < count; i++) {
+            if (depth + 1 < layer::kMaxDepth && std::uniform_int_distribution<int>(0, 4)(rng) == 0) {
+                int gx = x(rng), gy = y(rng);
+                int gw = std::uniform_int_distribution<int>(1, kMaxSize)(rng);
+                int gh = std::uniform_int_distribution<int>(1, kMaxSize)(rng);
+                list.layers.push_back({LayerOp::Push, BlendOp::Over, gx, gy, gw, gh, std::nullopt, {}});
+                appendLayers(rng, images, list, depth + 1);
+                list.layers.push_back({LayerOp::Pop, randomBlend(rng), gx, gy, gw, gh, std::nullopt, {}});
+                continue;
+            }
+            auto &image = images[std::uniform_int_distribution<int>(0, images.size() - 1)(rng)];
+            list.layers.push_back({LayerOp::Draw, randomBlend(rng), x(rng), y(rng), image.info.width(), image.info.height(), image.info, image.path});
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    std::filesystem::path shader_dir = (argc > 1) ? (argv[1]) : (".");
+    int cases = (argc > 2) ? (std::atoi(argv[2])) : (200);
+    unsigned int seed = (argc > 3) ? (std::atoi(argv[3])) : (1);
+    if (cases < 1) {
+        std::cerr << "usage: compositor_check.exe [shader_dir] [cases] [seed]" << std::endl;
+        return 1;
+    }
+    SDL_SetHint(SDL_HINT_VIDEO_DRIVER, "dummy");
+    if (!SDL_Init(SDL_INIT_VIDEO)) {
+        std::cerr << "SDL_Init: " << SDL_GetError() << std::endl;
+        return 1;
+    }
+    auto gpu = GPUCompositor::create(shader_dir);
+    if (!gpu) {
+        std::cerr << "gpu compositor not available" << std::endl;
+        SDL_Quit();
+        return 1;
+    }
+    CPUCompositor cpu;
+
+    std::mt19937 rng(seed);
+    // 同じ画像を倍率違いで持つものも混ぜる
+    std::vector<Image> images;
+    for (int i = 0; i < kImages; i++) {
+        for (int scale : {100, 200}) {
+            images.push_back({{"image" + std::to_string(i) + ".png", std::nullopt}, randomImage(rng, scale)});
+        }
+    }
+
+    int max_diff = 0, max_alpha_diff = 0, mismatches = 0, replaced = 0;
+    Json::Value failures = Json::arrayValue;
+    for (int n = 0; n < cases; n++) {
+        if (n > 0 && n % 8 == 0) {
+            // 同じ名前の画像の中身が変わった場合(GPUに置いた古いものを使わないこと)
+            auto &image = images[std::uniform_int_distribution<int>(0, images.size() - 1)(rng)];
+            image.info = randomImage(rng, image.info.scale());
+            replaced++;
+        }
+        LayerList list;
+        list.width = std::uniform_int_distribution<int>(1, kMaxSize)(rng);
+        list.height = std::uniform_int_distribution<int>(1, kMaxSize)(rng);
+        list.upconverted = true;
+        appendLayers(rng, images, list, 0);
+
+        auto expected = cpu.composite(list);
+        auto actual = gpu->composite(list);
+        if (!expected.surface || !actual.surface || !actual.texture) {
+            std::cerr << "composite failed: " << SDL_GetError() << std::endl;
+            return 1;
+        }
+        auto pixels = gpu->download(actual.texture.get(), list.width, list.height);
+        if (!pixels) {
+            std::cerr << "download failed: " << SDL_GetError() << std::endl;
+            return 1;
+        }
+        int diff = 0, alpha_diff = 0;
+        auto *e = expected.surface->surface();
+        auto *p = pixels->surface();
+        auto *a = actual.surface->surface();
+        for (int y = 0; y < list.height; y++) {
+            auto *er = static_cast<unsigned char *>(e->pixels) + y * e->pitch;
+            auto *pr = static_cast<unsigned char *>(p->pixels) + y * p->pitch;
+            auto *ar = static_cast<unsigned char *>(a->pixels) + y * a->pitch;
+            for (int x = 0; x < 4 * list.width; x++) {
+                diff = std::max(diff, std::abs(er[x] - pr[x]));
+            }
+            for (int x = 0; x < list.width; x++) {
+                alpha_diff = std::max(alpha_diff, std::abs(er[4 * x + 3] - ar[4 * x + 3]));
+            }
+        }
+        max_diff = std::max(max_diff, diff);
+        max_alpha_diff = std::max(max_alpha_diff, alpha_diff);
+        if (diff > kTolerance || alpha_diff > kTolerance) {
+            mismatches++;
+            Json::Value f;
+            f["case"] = n;
+            f["layers"] = static_cast<Json::UInt64>(list.layers.size());
+            f["diff"] = diff;
+            f["alpha_diff"] = alpha_diff;
+            failures.append(f);
+        }
+    }
+    gpu.reset();
+    SDL_Quit();
+
+    Json::Value root;
+    root["cases"] = cases;
+    root["seed"] = seed;
+    root["replaced_images"] = replaced;
+    root["tolerance"] = kTolerance;
+    root["max_diff"] = max_diff;
+    root["max_alpha_diff"] = max_alpha_diff;
+    root["mismatches"] = mismatches;
+    root["failures"] = failures;
+    Json::StreamWriterBuilder builder;
+    builder["indentation"] = "    ";
+    std::cout << Json::writeString(builder, root) << std::endl;
+    return (mismatches > 0) ? (1) : (0);
+}
@@ -0,0 +1,332 @@
+// 記録したsorakadoの要求(AO_RECORD_TRACE)をAoに流し込んで再生する
+// 標準入出力をパイプに差し替え、SSTPサーバの代わりを立ててninixなしで動かす
+// 画面はSDLのdummyドライバで出さず、時計は記録の時刻に合わせて進める偽のものを使うので
+// 何度流しても同じ順番で処理される
+// 要求毎の応答と描画までの時間、描画1回にかかった時間、メインループが起きた回数をJSONで出力する
+//
+// usage: replay.exe trace [shell_dir] [tail(ms)]
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <SDL3/SDL.h>
+#include <SDL3_ttf/SDL_ttf.h>
+#include <json/json.h>
+#include <unistd.h>
+
+#include "ao.h"
+#include "bench/stand_in_server.h"
+#include "clock.h"
+#include "ipc.h"
+#include "sorakado.h"
+#include "util.h"
+
+namespace {
+    // 応答がこれより遅ければAoが止まったとみなす
+    const int kResponseTimeout = 5000;
+
+    struct Message {
+        double t;
+        std::string command;
+        std::string request;
+        std::chrono::steady_clock::time_point sent;
+        std::optional<double> response_ms;
+        std::optional<double> frame_ms;
+    };
+
+    // 応答を受け取った時刻を順に覚えておく
+    class ResponseReader {
+        private:
+            std::mutex mutex_;
+            std::condition_variable cond_;
+            std::vector<std::chrono::steady_clock::time_point> received_;
+            std::thread th_;
+
+        public:
+            ResponseReader(int fd) {
+                th_ = std::thread([this, fd]() {
+                    FramedReader reader(fd);
+                    while (reader.next()) {
+                        std::unique_lock<std::mutex> lock(mutex_);
+                        received_.push_back(std::chrono::steady_clock::now());
+                        cond_.notify_one();
+                    }
+                });
+            }
+            ~ResponseReader() {
+                th_.join();
+            }
+            std::optional<std::chrono::steady_clock::time_point> wait(size_t index) {
+                std::unique_lock<std::mutex> lock(mutex_);
+                if (!cond_.wait_for(lock, std::chrono::milliseconds(kResponseTimeout), [&]() { return received_.size() > index; })) {
+                    return std::nullopt;
+                }
+                return received_[index];
+            }
+    };
+
+    double elapsed(std::chrono::steady_clock::time_point begin, std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now()) {
+        return std::chrono::duration<double, std::milli>(end - begin).count();
+    }
+
+    Json::Value summarize(std::vector<double> list) {
+        Json::Value v;
+        v["count"] = static_cast<Json::UInt64>(list.size());
+        if (list.empty()) {
+            return v;
+        }
+        std::sort(list.begin(), list.end());
+        double sum = 0;
+        for (auto ms : list) {
+            sum += ms;
+        }
+        auto percentile = [&](double p) {
+            return list[std::min(list.size() - 1, static_cast<size_t>(p * list.size()))];
+        };
+        v["mean_ms"] = sum / list.size();
+        v["p50_ms"] = percentile(0.50);
+        v["p95_ms"] = percentile(0.95);
+        v["p99_ms"] = percentile(0.99);
+        v["max_ms"] = list.back();
+        return v;
+    }
+
+    bool load(const std::string &path, std::vector<Message> &list) {
+        std::ifstream ifs(path);
+        if (!ifs) {
+            return false;
+        }
+        std::string line;
+        while (std::getline(ifs, line)) {
+            if (line.empty()) {
+                continue;
+            }
+            Json::Reader reader;
+            Json::Value value;
+            if (!reader.parse(line, value) || !value["request"].isString()) {
+                std::cerr << "invalid line: " << line << std::endl;
+                return false;
+            }
+            Message m = {};
+            m.t = value["t"].asDouble();
+            m.request = value["request"].asString();
+            auto req = sorakado::Request::parse(m.request);
+            m.command = req().value_or("");
+            list.push_back(std::move(m));
+        }
+        return !list.empty();
+    }
+
+    // 記録した時の環境に依存する引数を差し替える
+    void rewrite(Message &m, const std::optional<std::string> &shell_dir, const std::string &endpoint) {
+        auto req = sorakado::Request::parse(m.request);
+        if (m.command == "Initialize" && shell_dir) {
+            req(0) = shell_dir.value();
+        }
+        else if (m.command == "Endpoint") {
+            req(0) = endpoint;
+        }
+        else {
+            return;
+        }
+        m.request = req;
+    }
+
+    // 受信スレッドで処理されてメインループを起こさないもの
+    bool handledInReceiver(const std::string &command) {
+        return command == "Initialize" || command == "Endpoint" || command == "IsPlayingAnimation" || command == "GetMetrics";
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        std::cerr << "usage: replay.exe trace [shell_dir] [tail(ms)]" << std::endl;
+        return 1;
+    }
+    std::optional<std::string> shell_dir;
+    if (argc > 2 && argv[2][0] != '\0') {
+        shell_dir = argv[2];
+    }
+    int tail = (argc > 3) ? (std::atoi(argv[3])) : (1000);
+    std::vector<Message> messages;
+    if (!load(argv[1], messages)) {
+        std::cerr << "failed to load trace: " << argv[1] << std::endl;
+        return 1;
+    }
+    size_t endpoint = 0;
+    while (endpoint < messages.size() && messages[endpoint].command != "Endpoint") {
+        endpoint++;
+    }
+    if (endpoint == messages.size()) {
+        std::cerr << "trace has no Endpoint" << std::endl;
+        return 1;
+    }
+
+    std::string path = (std::filesystem::temp_directory_path() / ("replay." + std::to_string(getpid()))).string();
+    StandInServer server(path, 0);
+    for (auto &m : messages) {
+        rewrite(m, shell_dir, server.path());
+    }
+
+    // Aoは標準入出力でやり取りするので、差し替える前の標準出力に結果を書く
+    int report = dup(1);
+    int in[2], out[2];
+    if (pipe(in) == -1 || pipe(out) == -1) {
+        perror("pipe");
+        return 1;
+    }
+    dup2(in[0], 0);
+    dup2(out[1], 1);
+    close(in[0]);
+    close(out[1]);
+
+    SDL_SetHint(SDL_HINT_VIDEO_DRIVER, "dummy");
+    if (!SDL_Init(SDL_INIT_VIDEO)) {
+        std::cerr << "SDL_Init: " << SDL_GetError() << std::endl;
+        return 1;
+    }
+    if (!TTF_Init()) {
+        return 1;
+    }
+    Clock::useFake();
+    util::seedRandom(0);
+
+    Json::Value root;
+    std::vector<double> frame_times;
+    uint64_t frames = 0, wakeups = 0;
+    auto wall = std::chrono::steady_clock::now();
+    auto start = Clock::now();
+    {
+        ResponseReader responses(out[0]);
+        FramedWriter writer(in[1]);
+        auto send = [&](size_t i) {
+            messages[i].sent = std::chrono::steady_clock::now();
+            writer.write(messages[i].request);
+            writer.flush();
+        };
+        auto receive = [&](size_t i) {
+            auto at = responses.wait(i);
+            if (!at) {
+                return false;
+            }
+            messages[i].response_ms = elapsed(messages[i].sent, at.value());
+            return true;
+        };
+
+        // Endpointが届くまでAoのコンストラクタは戻らない
+        for (size_t i = 0; i <= endpoint; i++) {
+            send(i);
+        }
+        auto ao = std::make_unique<Ao>();
+        for (size_t i = 0; i <= endpoint; i++) {
+            receive(i);
+        }
+
+        std::vector<size_t> waiting;
+        auto step = [&]() {
+            auto before = ao->scheduler().frames();
+            auto begin = std::chrono::steady_clock::now();
+            ao->run();
+            auto end = std::chrono::steady_clock::now();
+            if (ao->scheduler().frames() == before) {
+                return;
+            }
+            frame_times.push_back(elapsed(begin, end));
+            for (auto i : waiting) {
+                messages[i].frame_ms = elapsed(messages[i].sent, end);
+            }
+            waiting.clear();
+        };
+        auto t0 = messages.front().t;
+        auto at = [&](double t) {
+            return start + std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::duration<double, std::milli>(t - t0));
+        };
+        for (size_t i = endpoint + 1; i < messages.size() && *ao; i++) {
+            // 記録の時刻まではアニメーションと描画を進める
+            Clock::setLimit(at(messages[i].t));
+            while (*ao && Clock::now() < at(messages[i].t)) {
+                step();
+            }
+            send(i);
+            if (!receive(i)) {
+                std::cerr << "no response: " << messages[i].command << std::endl;
+                break;
+            }
+            if (!handledInReceiver(messages[i].command)) {
+                waiting.push_back(i);
+            }
+        }
+        Clock::setLimit(at(messages.back().t + tail));
+        while (*ao && Clock::now() < at(messages.back().t + tail)) {
+            step();
+        }
+        frames = ao->scheduler().frames();
+        wakeups = ao->scheduler().wakeups();
+
+        // 標準入力を閉じるとAoの受信スレッドが終わる
+        writer.flush();
+        close(in[1]);
+        ao.reset();
+        // 応答のパイプを閉じて読み込み側も終わらせる
+        dup2(report, 1);
+    }
+    double duration = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+    root["wall_ms"] = elapsed(wall);
+    root["duration_ms"] = duration;
+    root["frames"] = static_cast<Json::UInt64>(frames);
+    root["wakeups"] = static_cast<Json::UInt64>(wakeups);
+    root["wakeups_per_sec"] = (duration > 0) ? (wakeups * 1000.0 / duration) : (0.0);
+    root["sstp_requests"] = server.requests();
+    root["frame_time"] = summarize(frame_times);
+
+    std::vector<double> response, frame;
+    std::unordered_map<std::string, std::pair<std::vector<double>, std::vector<double>>> by_command;
+    for (size_t i = 0; i < messages.size(); i++) {
+        auto &m = messages[i];
+        Json::Value v;
+        v["index"] = static_cast<Json::UInt64>(i);
+        v["command"] = m.command;
+        v["t"] = m.t;
+        if (m.response_ms) {
+            v["response_ms"] = m.response_ms.value();
+            response.push_back(m.response_ms.value());
+            by_command[m.command].first.push_back(m.response_ms.value());
+        }
+        if (m.frame_ms) {
+            v["frame_ms"] = m.frame_ms.value();
+            frame.push_back(m.frame_ms.value());
+            by_command[m.command].second.push_back(m.frame_ms.value());
+        }
+        root["messages"].append(v);
+    }
+    root["response"] = summarize(response);
+    root["until_frame"] = summarize(frame);
+    for (auto &[k, v] : by_command) {
+        root["by_command"][k]["response"] = summarize(v.first);
+        root["by_command"][k]["until_frame"] = summarize(v.second);
+    }
+
+    TTF_Quit();
+    SDL_Quit();
+
+    Json::StreamWriterBuilder builder;
+    builder["indentation"] = "    ";
+    FILE *fp = fdopen(report, "w");
+    std::fputs((Json::writeString(builder, root) + "\n").c_str(), fp);
+    std::fclose(fp);
+    return 0;
+}
@@ -0,0 +1,268 @@
+// サーフェスまわりの処理時間の計測
+// 一時ディレクトリにsurfaceN.pngとsurfaces.txtで合成したシェルを作り、
+// 解析、画像の読み込みと拡縮、合成、SERIKOの更新、当たり判定にかかる時間をJSONで出力する
+// 画面は出さない(SDLのdummyドライバとソフトウェアレンダラを使う)
+//
+// usage: shell_bench.exe [surfaces] [image_size] [animations] [patterns] [collisions] [frames]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <SDL3/SDL.h>
+#include <SDL3_image/SDL_image.h>
+#include <json/json.h>
+#include <unistd.h>
+
+#include "element.h"
+#include "image_cache.h"
+#include "seriko.h"
+#include "surfaces.h"
+#include "texture.h"
+
+namespace {
+    // アニメーションで重ねる部品はこのIDから置く
+    const int kPartOffset = 10000;
+
+    struct Params {
+        int surfaces;
+        int image_size;
+        int animations;
+        int patterns;
+        int collisions;
+        int frames;
+    };
+
+    double elapsed(std::chrono::steady_clock::time_point begin) {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+    }
+
+    Json::Value result(double ms, int count) {
+        Json::Value v;
+        v["total_ms"] = ms;
+        v["count"] = count;
+        v["per_op_us"] = (count > 0) ? (ms * 1000.0 / count) : (0.0);
+        return v;
+    }
+
+    bool savePNG(const std::filesystem::path &path, int w, int h, Uint8 r, Uint8 g, Uint8 b) {
+        SDL_Surface *surface = SDL_CreateSurface(w, h, SDL_PIXELFORMAT_RGBA32);
+        if (surface == nullptr) {
+            return false;
+        }
+        auto *details = SDL_GetPixelFormatDetails(surface->format);
+        SDL_FillSurfaceRect(surface, nullptr, SDL_MapRGBA(details, nullptr, r, g, b, 255));
+        // 全面が同じ色だと圧縮が効きすぎるので帯を入れる
+        for (int y = 0; y < h; y += 8) {
+            SDL_Rect rect = {0, y, w, 4};
+            SDL_FillSurfaceRect(surface, &rect, SDL_MapRGBA(details, nullptr, b, r, g, (y * 7) & 0xff));
+        }
+        bool ok = IMG_SavePNG(surface, path.string().c_str());
+        SDL_DestroySurface(surface);
+        return ok;
+    }
+
+    bool generate(const std::filesystem::path &dir, const Params &params) {
+        int part_size = std::max(1, params.image_size / 4);
+        for (int i = 0; i < params.surfaces; i++) {
+            if (!savePNG(dir / ("surface" + std::to_string(i) + ".png"), params.image_size, params.image_size, i * 37, i * 59, i * 83)) {
+                return false;
+            }
+        }
+        for (int i = 0; i < params.patterns; i++) {
+            if (!savePNG(dir / ("part" + std::to_string(i) + ".png"), part_size, part_size, i * 91, i * 17, i * 43)) {
+                return false;
+            }
+        }
+        std::ofstream ofs(dir / "surfaces.txt");
+        ofs << "charset,UTF-8\n\ndescript\n{\nversion,1\n}\n\n";
+        for (int i = 0; i < params.patterns; i++) {
+            ofs << "surface" << kPartOffset + i << "\n{\n";
+            ofs << "element0,base,part" << i << ".png,0,0\n";
+            ofs << "}\n\n";
+        }
+        int s = params.image_size;
+        for (int i = 0; i < params.surfaces; i++) {
+            ofs << "surface" << i << "\n{\n";
+            for (int a = 0; a < params.animations; a++) {
+                ofs << "animation" << a << ".interval," << ((a == 0) ? ("always") : ("sometimes")) << "\n";
+                for (int p = 0; p < params.patterns; p++) {
+                    ofs << "animation" << a << ".pattern" << p << ",overlay," << kPartOffset + p << ",50," << (a * part_size) % s << "," << (p * part_size) % s << "\n";
+                }
+            }
+            // 矩形、楕円、多角形を順に並べる
+            for (int c = 0; c < params.collisions; c++) {
+                int x = (c * 13) % s;
+                int y = (c * 29) % s;
+                int w = std::max(2, s / 4);
+                switch (c % 3) {
+                    case 0:
+                        ofs << "collision" << c << "," << x << "," << y << "," << x + w << "," << y + w << ",Head\n";
+                        break;
+                    case 1:
+                        ofs << "collisionex" << c << ",Face,ellipse," << x << "," << y << "," << x + w << "," << y + w << "\n";
+                        break;
+                    default:
+                        ofs << "collisionex" << c << ",Bust,polygon," << x << "," << y << "," << x + w << "," << y << "," << x + w / 2 << "," << y + w << "," << x << "," << y + w / 2 << "\n";
+                        break;
+                }
+            }
+            ofs << "}\n\n";
+        }
+        return ofs.good();
+    }
+}
+
+int main(int argc, char **argv) {
+    Params params = {
+        .surfaces = (argc > 1) ? (std::atoi(argv[1])) : (50),
+        .image_size = (argc > 2) ? (std::atoi(argv[2])) : (512),
+        .animations = (argc > 3) ? (std::atoi(argv[3])) : (4),
+        .patterns = (argc > 4) ? (std::atoi(argv[4])) : (8),
+        .collisions = (argc > 5) ? (std::atoi(argv[5])) : (12),
+        .frames = (argc > 6) ? (std::atoi(argv[6])) : (1000),
+    };
+    if (params.surfaces < 1 || params.image_size < 1 || params.frames < 1) {
+        std::cerr << "usage: shell_bench.exe [surfaces] [image_size] [animations] [patterns] [collisions] [frames]" << std::endl;
+        return 1;
+    }
+    SDL_SetHint(SDL_HINT_VIDEO_DRIVER, "dummy");
+    if (!SDL_Init(SDL_INIT_VIDEO)) {
+        std::cerr << "SDL_Init: " << SDL_GetError() << std::endl;
+        return 1;
+    }
+    std::filesystem::path dir = std::filesystem::temp_directory_path() / ("shell_bench." + std::to_string(getpid()));
+    std::filesystem::create_directories(dir);
+
+    Json::Value root;
+    root["shell"]["surfaces"] = params.surfaces;
+    root["shell"]["image_size"] = params.image_size;
+    root["shell"]["animations"] = params.animations;
+    root["shell"]["patterns"] = params.patterns;
+    root["shell"]["collisions"] = params.collisions;
+    root["shell"]["frames"] = params.frames;
+
+    auto begin = std::chrono::steady_clock::now();
+    if (!generate(dir, params)) {
+        std::cerr << "failed to generate shell: " << SDL_GetError() << std::endl;
+        std::filesystem::remove_all(dir);
+        SDL_Quit();
+        return 1;
+    }
+    root["generate_ms"] = elapsed(begin);
+
+    // キャッシュがあると解析を測れない
+    setenv("AO_DISABLE_SHELL_CACHE", "1", 1);
+    unsetenv("AO_LAZY_SURFACES");
+    std::unique_ptr<Seriko> seriko;
+    {
+        begin = std::chrono::steady_clock::now();
+        Surfaces surfaces(dir);
+        root["parse"]["eager"] = result(elapsed(begin), 1);
+        seriko = surfaces.getSeriko();
+    }
+    {
+        setenv("AO_LAZY_SURFACES", "1", 1);
+        begin = std::chrono::steady_clock::now();
+        Surfaces surfaces(dir);
+        root["parse"]["lazy"] = result(elapsed(begin), 1);
+        unsetenv("AO_LAZY_SURFACES");
+        // 遅延モードでは初めて使う時に残りの解析を行う
+        auto lazy = surfaces.getSeriko();
+        begin = std::chrono::steady_clock::now();
+        for (int i = 0; i < params.surfaces; i++) {
+            lazy->get(i);
+        }
+        root["parse"]["lazy_resolve"] = result(elapsed(begin), params.surfaces);
+    }
+
+    std::vector<ImagePath> images;
+    for (int i = 0; i < params.surfaces; i++) {
+        Seriko::images(*seriko->surfaces(), i, true, images);
+    }
+    auto cache = std::make_unique<ImageCache>(dir, false, false, false, ResampleFilter::Auto);
+    begin = std::chrono::steady_clock::now();
+    for (auto &p : images) {
+        cache->get(p.path, p.index);
+    }
+    // ImageCache::loadは外から呼べないので等倍のgetで読み込みと前処理を測る
+    root["image"]["load"] = result(elapsed(begin), images.size());
+    cache->setScale(150);
+    begin = std::chrono::steady_clock::now();
+    for (auto &p : images) {
+        cache->get(p.path, p.index);
+    }
+    root["image"]["scale"] = result(elapsed(begin), images.size());
+
+    std::vector<ElementWithChildren> elements;
+    for (int i = 0; i < params.surfaces; i++) {
+        elements.push_back(seriko->get(i));
+    }
+    begin = std::chrono::steady_clock::now();
+    for (auto &e : elements) {
+        e.getSurface(cache, 150);
+    }
+    root["compose"]["surface"] = result(elapsed(begin), elements.size());
+    SDL_Surface *target = SDL_CreateSurface(params.image_size * 2, params.image_size * 2, SDL_PIXELFORMAT_RGBA32);
+    SDL_Renderer *renderer = (target) ? (SDL_CreateSoftwareRenderer(target)) : (nullptr);
+    if (renderer != nullptr) {
+        auto texture_cache = std::make_unique<TextureCache>();
+        begin = std::chrono::steady_clock::now();
+        for (auto &e : elements) {
+            e.getTexture(renderer, texture_cache, cache, 150);
+        }
+        root["compose"]["texture"] = result(elapsed(begin), elements.size());
+        texture_cache.reset();
+        SDL_DestroyRenderer(renderer);
+    }
+    else {
+        std::cerr << "SDL_CreateSoftwareRenderer: " << SDL_GetError() << std::endl;
+    }
+    if (target != nullptr) {
+        SDL_DestroySurface(target);
+    }
+
+    // 表示中のサーフェスでアニメーションを進める
+    seriko->get(0);
+    begin = std::chrono::steady_clock::now();
+    for (int i = 0; i < params.frames; i++) {
+        seriko->get(0);
+    }
+    root["seriko"]["get"] = result(elapsed(begin), params.frames);
+
+    std::mt19937 engine(0);
+    std::uniform_int_distribution<int> dist(0, params.image_size - 1);
+    int hits = 0;
+    begin = std::chrono::steady_clock::now();
+    for (int i = 0; i < params.frames; i++) {
+        int x = dist(engine);
+        int y = dist(engine);
+        for (auto &info : seriko->getCollision(0)) {
+            for (auto &c : info.list) {
+                if (c.contains(x, y)) {
+                    hits++;
+                    break;
+                }
+            }
+        }
+    }
+    root["collision"]["hit_test"] = result(elapsed(begin), params.frames);
+    root["collision"]["hits"] = hits;
+
+    seriko.reset();
+    cache.reset();
+    std::filesystem::remove_all(dir);
+    SDL_Quit();
+
+    Json::StreamWriterBuilder builder;
+    builder["indentation"] = "    ";
+    std::cout << Json::writeString(builder, root) << std::endl;
+    return 0;
+}
@@ -0,0 +1,70 @@
+// SSTPClientの逐次送信と非同期送信の比較
+// ベースウェアの代わりに応答までdelayミリ秒かかるSSTPサーバを立てて計測する
+//
+// usage: sstp_bench.exe [requests] [delay(ms)] [max_in_flight]
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <unistd.h>
+
+#include "bench/stand_in_server.h"
+#include "sstp_client.h"
+
+namespace {
+    const char kRequest[] = "NOTIFY SSTP/1.4\r\nCharset: UTF-8\r\nSender: AYU_PoC\r\nEvent: OnMouseMove\r\nOption: nodescript\r\n\r\n";
+
+    double elapsed(std::chrono::steady_clock::time_point begin) {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+    }
+}
+
+int main(int argc, char **argv) {
+    int requests = (argc > 1) ? (std::atoi(argv[1])) : (200);
+    int delay = (argc > 2) ? (std::atoi(argv[2])) : (2);
+    int max_in_flight = (argc > 3) ? (std::atoi(argv[3])) : (4);
+    std::string path = (std::filesystem::temp_directory_path() / ("sstp_bench." + std::to_string(getpid()))).string();
+    StandInServer server(path, delay);
+    SSTPClient client(max_in_flight, 5000);
+
+    auto begin = std::chrono::steady_clock::now();
+    int ok = 0;
+    for (int i = 0; i < requests; i++) {
+        if (client.sendSync(path, kRequest)) {
+            ok++;
+        }
+    }
+    double serial = elapsed(begin);
+    std::cout << "serial: " << requests << " requests, " << ok << " ok, " << serial << " ms, " << requests * 1000.0 / serial << " req/s" << std::endl;
+
+    std::mutex mutex;
+    std::condition_variable cond;
+    int done = 0;
+    ok = 0;
+    begin = std::chrono::steady_clock::now();
+    for (int i = 0; i < requests; i++) {
+        client.send(path, kRequest, [&](std::optional<std::string> res) {
+            std::unique_lock<std::mutex> lock(mutex);
+            done++;
+            if (res) {
+                ok++;
+            }
+            cond.notify_one();
+        });
+    }
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        cond.wait(lock, [&]() { return done == requests; });
+    }
+    double async = elapsed(begin);
+    std::cout << "async(" << max_in_flight << " in flight): " << requests << " requests, " << ok << " ok, " << async << " ms, " << requests * 1000.0 / async << " req/s" << std::endl;
+    return 0;
+}
@@ -0,0 +1,74 @@
+#ifndef BENCH_STAND_IN_SERVER_H_
+#define BENCH_STAND_IN_SERVER_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// ベースウェアの代わりに、どの要求にもdelayミリ秒後に204を返すSSTPサーバ
+class StandInServer {
+    private:
+        static constexpr char kResponse[] = "SSTP/1.4 204 No Content\r\nCharset: UTF-8\r\n\r\n";
+
+        std::string path_;
+        int fd_;
+        int delay_;
+        std::atomic<bool> alive_;
+        std::atomic<int> requests_;
+        std::thread th_;
+
+        void serve(int fd) {
+            char buffer[4096];
+            while (recv(fd, buffer, sizeof(buffer), 0) > 0) {}
+            requests_++;
+            std::this_thread::sleep_for(std::chrono::milliseconds(delay_));
+            send(fd, kResponse, sizeof(kResponse) - 1, MSG_NOSIGNAL);
+            close(fd);
+        }
+
+    public:
+        StandInServer(const std::string &path, int delay) : path_(path), fd_(-1), delay_(delay), alive_(true), requests_(0) {
+            unlink(path_.c_str());
+            fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+            sockaddr_un addr = {};
+            addr.sun_family = AF_UNIX;
+            path_.copy(addr.sun_path, sizeof(addr.sun_path) - 1);
+            if (bind(fd_, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) == -1 || listen(fd_, 128) == -1) {
+                perror("stand-in server");
+                std::exit(1);
+            }
+            th_ = std::thread([this]() {
+                while (alive_) {
+                    int fd = accept(fd_, nullptr, nullptr);
+                    if (fd == -1) {
+                        break;
+                    }
+                    // ベースウェアと同様に接続毎に並行して処理する
+                    std::thread(&StandInServer::serve, this, fd).detach();
+                }
+            });
+        }
+        ~StandInServer() {
+            alive_ = false;
+            shutdown(fd_, SHUT_RDWR);
+            close(fd_);
+            th_.join();
+            unlink(path_.c_str());
+        }
+        const std::string &path() const {
+            return path_;
+        }
+        // 受け付けた要求の数
+        int requests() const {
+            return requests_;
+        }
+};
+
+#endif // BENCH_STAND_IN_SERVER_H_
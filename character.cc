@@ -1,17 +1,24 @@
 #include "character.h"
 
 #include <cassert>
+#include <cmath>
 
 #include "sstp.h"
+#include "trace.h"
 #include "util.h"
 
+namespace {
+    // 1フレームで先に作っておくテクスチャの数
+    const int kPrefetchPerFrame = 2;
+}
+
 Character::Character(Ao *parent, int side, const std::string &name, std::unique_ptr<Seriko> seriko)
     : parent_(parent), side_(side), name_(name),
     seriko_(std::move(seriko)),
     rect_({0, 0, 0, 0}), balloon_offset_({0, 0}),
     balloon_direction_(false), id_(-1), once_(true),
     reset_balloon_position_(false), current_cursor_type_(CursorType::Default),
-    position_changed_(false), upconverted_(false) {
+    upconverted_(false) {
     seriko_->setParent(this);
 }
 
@@ -43,28 +50,61 @@ void dump(const ElementWithChildren &e, std::string indent = "") {
 }
 
 
-void Character::draw(std::unique_ptr<ImageCache> &cache, bool changed) {
+void Character::draw(std::unique_ptr<ImageCache> &cache, std::unique_ptr<RenderWorker> &worker, bool changed) {
+    TRACE_ZONE("Character::draw");
     auto element = seriko_->get(id_);
-    if (changed) {
-        upconverted_ = false;
-        requestAdjust();
+    if (!requested_ || !(requested_ == element) || changed) {
+        // 合成は描画スレッドで行い、出来上がるまでは前の画像を表示し続ける
+        requested_ = element;
+        worker->submit({side_, element, scale(), changed});
+    }
+    auto result = worker->take(side_);
+    if (result) {
+        if (result->changed) {
+            upconverted_ = false;
+            requestAdjust();
+        }
+        prev_ = std::move(result->element);
+        current_surface_ = std::move(result->surface);
+        current_shape_ = std::move(result->shape);
+        current_texture_ = std::move(result->texture);
     }
-    if (!prev_ || !(prev_ == element) || position_changed_ || changed || !current_surface_) {
-        prev_ = element;
-        current_surface_ = element.getSurface(cache, scale());
+    if (!prev_) {
+        return;
     }
-    position_changed_ = false;
-    bool upconverted = true;
+    bool redraw = (result && result->changed);
     for (auto &[_, v] : windows_) {
         if (util::isWayland()) {
-            v->draw(cache, {rect_.x, rect_.y}, current_surface_, element, changed);
+            v->draw(cache, {rect_.x, rect_.y}, current_surface_, current_shape_, current_texture_, prev_.value(), redraw, worker->composited());
         }
         else {
-            v->draw(cache, {0, 0}, current_surface_, element, changed);
+            v->draw(cache, {0, 0}, current_surface_, current_shape_, current_texture_, prev_.value(), redraw, worker->composited());
+        }
+    }
+    // 合成済みの画像を表示する場合はテクスチャを使わない
+    if (worker->composited()) {
+        prefetch_.clear();
+        return;
+    }
+    // 1フレームで作るテクスチャの数を抑えて、裏で読み込みが終わったものから作る
+    int count = 0;
+    for (auto it = prefetch_.begin(); it != prefetch_.end() && count < kPrefetchPerFrame;) {
+        if (!cache->contains(it->path, it->index)) {
+            it++;
+            continue;
+        }
+        for (auto &[_, v] : windows_) {
+            v->prefetch(cache, *it);
         }
+        it = prefetch_.erase(it);
+        count++;
     }
 }
 
+std::optional<int> Character::nextDeadline() {
+    return seriko_->nextDeadline();
+}
+
 bool Character::swapBuffers() {
     bool redrawn = false;
     for (auto &[_, v] : windows_) {
@@ -93,6 +133,14 @@ void Character::setSurface(int id) {
     }
 }
 
+std::shared_ptr<SurfaceTable> Character::surfaces() const {
+    return seriko_->surfaces();
+}
+
+void Character::prefetch(std::vector<ImagePath> list) {
+    prefetch_.assign(std::make_move_iterator(list.begin()), std::make_move_iterator(list.end()));
+}
+
 void Character::requestAdjust() {
     SDL_DisplayID key = 0;
     if (util::isWayland()) {
@@ -166,7 +214,6 @@ Offset Character::getBalloonOffset() {
 
 void Character::resetDrag() {
     drag_ = std::nullopt;
-    position_changed_ = true;
 
     auto f = [](const std::string &v) {
         if (v == "top") {
@@ -242,9 +289,12 @@ std::optional<Offset> Character::getCharacterOffset(int side) {
     return parent_->getCharacterOffset(side);
 }
 
+SDL_GPUDevice *Character::gpuDevice() {
+    return parent_->gpuDevice();
+}
+
 void Character::setOffset(int x, int y) {
     if (x != rect_.x || y != rect_.y) {
-        position_changed_ = true;
         for (auto &[_, v] : windows_) {
             v->position(x, y);
         }
@@ -332,103 +382,8 @@ std::string Character::getHitBoxName(int x, int y) {
     auto list = seriko_->getCollision(id_);
     for (auto &info : list) {
         for (auto &c : info.list) {
-            if (c.type == CollisionType::Rect) {
-                if (c.point.size() != 4) {
-                    Logger::log("invalid collision type: rect");
-                    continue;
-                }
-                int x1 = c.point[0];
-                int y1 = c.point[1];
-                int x2 = c.point[2];
-                int y2 = c.point[3];
-                if (x1 <= x && x2 >= x && y1 <= y && y2 >= y) {
-                    return c.id;
-                }
-            }
-            else if (c.type == CollisionType::Ellipse) {
-                if (c.point.size() != 4) {
-                    Logger::log("invalid collision type: ellipse");
-                    continue;
-                }
-                int x1 = c.point[0];
-                int y1 = c.point[1];
-                int x2 = c.point[2];
-                int y2 = c.point[3];
-                double xr = std::abs(x1 - x2);
-                double xo = (x1 + x2) / 2.0 - x;
-                double yr = std::abs(y1 - y2);
-                double yo = (y1 + y2) / 2.0 - y;
-                assert(xr);
-                assert(yr);
-                if (xo * xo / xr * xr + yo * yo / yr * yr) {
-                    return c.id;
-                }
-            }
-            else if (c.type == CollisionType::Circle) {
-                if (c.point.size() != 3) {
-                    Logger::log("invalid collision type: circle");
-                    continue;
-                }
-                int cx = c.point[0] - x;
-                int cy = c.point[1] - y;
-                int cr = c.point[2];
-                if (cx * cx + cy * cy <= cr * cr) {
-                    return c.id;
-                }
-            }
-            else if (c.type == CollisionType::Polygon) {
-                if (c.point.size() % 2 == 1 && c.point.size() >= 6) {
-                    Logger::log("invalid collision type: polygon");
-                    continue;
-                }
-                c.point.push_back(c.point[0]);
-                c.point.push_back(c.point[1]);
-                int count = 0;
-                while (c.point.size() >= 4) {
-                    double x1 = c.point[0];
-                    double y1 = c.point[1];
-                    double x2 = c.point[2];
-                    double y2 = c.point[3];
-                    c.point.erase(c.point.begin());
-                    c.point.erase(c.point.begin());
-                    if (y1 == y2) {
-                        continue;
-                    }
-                    if (y1 > y2) {
-                        if (y == y1) {
-                            continue;
-                        }
-                        else if (y == y2 && x <= x2) {
-                            count++;
-                            continue;
-                        }
-                    }
-                    else {
-                        if (y == y1 && x < x1) {
-                            count++;
-                            continue;
-                        }
-                        else if (y == y2) {
-                            continue;
-                        }
-                    }
-                    if (y < y1 && y < y2) {
-                        continue;
-                    }
-                    else if (y > y1 && y > y2) {
-                        continue;
-                    }
-                    double intersection_x = x1 + (y - y1) * (x2 - x1) / (y2 - y1);
-                    if (intersection_x > x) {
-                        count++;
-                    }
-                }
-                if (count % 2 == 1) {
-                    return c.id;
-                }
-            }
-            else if (c.type == CollisionType::Region) {
-                // TODO stub
+            if (c.contains(x, y)) {
+                return c.id;
             }
         }
     }
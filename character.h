@@ -1,6 +1,7 @@
 #ifndef CHARACTER_H_
 #define CHARACTER_H_
 
+#include <deque>
 #include <memory>
 #include <optional>
 #include <vector>
@@ -11,6 +12,7 @@
 #include "element.h"
 #include "image_cache.h"
 #include "misc.h"
+#include "render_worker.h"
 #include "seriko.h"
 #include "window.h"
 
@@ -33,16 +35,23 @@ class Character {
         bool reset_balloon_position_;
         CursorType current_cursor_type_;
         std::mutex mutex_;
+        // 描画スレッドに最後に渡したもの
+        std::optional<ElementWithChildren> requested_;
+        // 表示しているもの
         std::optional<ElementWithChildren> prev_;
-        bool position_changed_;
         bool upconverted_;
         std::unique_ptr<WrapSurface> current_surface_;
+        std::unique_ptr<WrapSurface> current_shape_;
+        std::shared_ptr<SDL_GPUTexture> current_texture_;
+        // テクスチャを先に作っておく画像
+        std::deque<ImagePath> prefetch_;
     public:
         Character(Ao *parent, int side, const std::string &name, std::unique_ptr<Seriko> seriko);
         ~Character();
         void create(SDL_DisplayID display_id);
         void destroy(SDL_DisplayID display_id);
-        void draw(std::unique_ptr<ImageCache> &cache, bool changed);
+        void draw(std::unique_ptr<ImageCache> &cache, std::unique_ptr<RenderWorker> &worker, bool changed);
+        std::optional<int> nextDeadline();
         bool swapBuffers();
         int side() const {
             return side_;
@@ -53,6 +62,8 @@ class Character {
         void show(bool force = false);
         void hide();
         void setSurface(int id);
+        std::shared_ptr<SurfaceTable> surfaces() const;
+        void prefetch(std::vector<ImagePath> list);
         void requestAdjust();
         void startAnimation(int id);
         bool isPlayingAnimation(int id);
@@ -89,6 +100,7 @@ class Character {
             return offset;
         }
         std::optional<Offset> getCharacterOffset(int side);
+        SDL_GPUDevice *gpuDevice();
         bool isAdjusted() const;
         std::string sendDirectSSTP(std::string method, std::string command, std::vector<std::string> args);
         void enqueueDirectSSTP(std::vector<Request> list);
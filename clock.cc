@@ -0,0 +1,33 @@
+#include "clock.h"
+
+#include <algorithm>
+
+std::atomic<bool> Clock::fake_(false);
+std::atomic<int64_t> Clock::now_(0);
+std::atomic<int64_t> Clock::limit_(0);
+
+Clock::time_point Clock::now() {
+    if (!fake_) {
+        return std::chrono::steady_clock::now();
+    }
+    return time_point(std::chrono::nanoseconds(now_.load()));
+}
+
+void Clock::useFake() {
+    // それまでに取った時刻より前に戻らないように今の時刻から始める
+    int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    now_ = now;
+    limit_ = now;
+    fake_ = true;
+}
+
+void Clock::setLimit(time_point tp) {
+    limit_ = std::chrono::duration_cast<std::chrono::nanoseconds>(tp.time_since_epoch()).count();
+}
+
+void Clock::advance(time_point tp) {
+    int64_t target = std::min<int64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(tp.time_since_epoch()).count(), limit_);
+    int64_t now = now_;
+    // 時計は戻さない
+    while (now < target && !now_.compare_exchange_weak(now, target)) {}
+}
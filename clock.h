@@ -0,0 +1,34 @@
+#ifndef CLOCK_H_
+#define CLOCK_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// 描画の間隔とSERIKOの時間を測る時計
+// 普段はstd::chrono::steady_clockそのままで、
+// 再生ツール(bench/replay.exe)では寝る代わりに時刻を進める偽の時計にする
+class Clock {
+    public:
+        using time_point = std::chrono::steady_clock::time_point;
+
+    private:
+        static std::atomic<bool> fake_;
+        // 偽の時計の現在時刻と進めてよい上限(time_since_epochのナノ秒)
+        static std::atomic<int64_t> now_;
+        static std::atomic<int64_t> limit_;
+
+    public:
+        static time_point now();
+        // 以降は実時間ではなくadvanceで進めた時刻を返す
+        static void useFake();
+        static bool fake() {
+            return fake_;
+        }
+        // 偽の時計をtpより先には進めない
+        static void setLimit(time_point tp);
+        // 偽の時計をtp(上限を超えるなら上限)まで進める
+        static void advance(time_point tp);
+};
+
+#endif // CLOCK_H_
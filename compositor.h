@@ -0,0 +1,30 @@
+#ifndef COMPOSITOR_H_
+#define COMPOSITOR_H_
+
+#include <memory>
+
+#include <SDL3/SDL_gpu.h>
+
+#include "layer.h"
+#include "texture.h"
+
+// 合成した結果(色は乗算済みアルファ)
+struct CompositeResult {
+    // 形状を取る画像で、textureが無ければこれをそのまま表示する
+    std::unique_ptr<WrapSurface> surface;
+    // GPUで合成した画像(surfaceにはアルファだけが入っている)
+    std::shared_ptr<SDL_GPUTexture> texture;
+};
+
+// LayerListをまとめて合成する
+class Compositor {
+    public:
+        virtual ~Compositor() {}
+        virtual CompositeResult composite(const LayerList &list) = 0;
+        // 結果のテクスチャを置くデバイス(表示するレンダラもこれで作る)
+        virtual SDL_GPUDevice *device() {
+            return nullptr;
+        }
+};
+
+#endif // COMPOSITOR_H_
@@ -0,0 +1,282 @@
+#include "cpu_compositor.h"
+
+#include <algorithm>
+#include <utility>
+
+namespace {
+    typedef CPUCompositor::float4 float4;
+
+    // これより少ない行数ではスレッドを分けない
+    const int kMinRowsPerBand = 32;
+    // 使い回すために残しておく出力の画素の数
+    const size_t kMaxFreeBuffers = 4;
+
+    struct Clip {
+        int x0, y0, x1, y1;
+    };
+
+    inline float4 splat(float v) {
+        return float4{v, v, v, v};
+    }
+
+    // toBlendModeやshader/compositor.compと同じ式
+    template<BlendOp op>
+    void blendSpan(const float4 *src, float4 *dst, int n) {
+        for (int i = 0; i < n; i++) {
+            float4 s = src[i];
+            float4 d = dst[i];
+            if constexpr (op == BlendOp::OverlayFast) {
+                float4 r = s * splat(d[3]) + d * splat(1.0f - s[3]);
+                r[3] = d[3];
+                dst[i] = r;
+            }
+            else if constexpr (op == BlendOp::Multiply) {
+                float4 r = s * d + d * splat(1.0f - s[3]);
+                r[3] = d[3];
+                dst[i] = r;
+            }
+            else if constexpr (op == BlendOp::Replace) {
+                dst[i] = s;
+            }
+            else if constexpr (op == BlendOp::Interpolate) {
+                dst[i] = s * splat(1.0f - d[3]) + d;
+            }
+            else if constexpr (op == BlendOp::Reduce) {
+                dst[i] = d * splat(s[3]);
+            }
+            else {
+                dst[i] = s + d * splat(1.0f - s[3]);
+            }
+        }
+    }
+
+    void blendSpan(BlendOp op, const float4 *src, float4 *dst, int n) {
+        switch (op) {
+            case BlendOp::OverlayFast:
+                blendSpan<BlendOp::OverlayFast>(src, dst, n);
+                break;
+            case BlendOp::Multiply:
+                blendSpan<BlendOp::Multiply>(src, dst, n);
+                break;
+            case BlendOp::Replace:
+                blendSpan<BlendOp::Replace>(src, dst, n);
+                break;
+            case BlendOp::Interpolate:
+                blendSpan<BlendOp::Interpolate>(src, dst, n);
+                break;
+            case BlendOp::Reduce:
+                blendSpan<BlendOp::Reduce>(src, dst, n);
+                break;
+            default:
+                blendSpan<BlendOp::Over>(src, dst, n);
+                break;
+        }
+    }
+
+    void load(const unsigned char *p, float4 *out, int n) {
+        for (int i = 0; i < n; i++) {
+            float4 v = {
+                static_cast<float>(p[4 * i + 0]),
+                static_cast<float>(p[4 * i + 1]),
+                static_cast<float>(p[4 * i + 2]),
+                static_cast<float>(p[4 * i + 3]),
+            };
+            out[i] = v * splat(1.0f / 255.0f);
+        }
+    }
+
+    void store(const float4 *in, unsigned char *p, int n) {
+        for (int i = 0; i < n; i++) {
+            float4 v = in[i] * splat(255.0f) + splat(0.5f);
+            for (int c = 0; c < 4; c++) {
+                p[4 * i + c] = static_cast<unsigned char>(std::min(std::max(v[c], 0.0f), 255.0f));
+            }
+        }
+    }
+}
+
+void CPUCompositor::compositeBand(const LayerList &list, int y0, int y1, Scratch &scratch, SDL_Surface *out) {
+    int w = list.width;
+    size_t size = w * (y1 - y0);
+    auto level = [&](int depth) -> std::vector<float4> & {
+        auto &v = scratch.levels[depth];
+        if (v.size() < size) {
+            v.resize(size);
+        }
+        return v;
+    };
+    auto clear = [&](std::vector<float4> &v, const Clip &c) {
+        for (int y = c.y0; y < c.y1; y++) {
+            std::fill_n(&v[(y - y0) * w + c.x0], c.x1 - c.x0, splat(0.0f));
+        }
+    };
+    Clip clip[layer::kMaxDepth];
+    int top = 0;
+    clip[0] = {0, y0, w, y1};
+    clear(level(0), clip[0]);
+    auto &row = scratch.row;
+    if (row.size() < static_cast<size_t>(w)) {
+        row.resize(w);
+    }
+    for (auto &l : list.layers) {
+        if (l.op == LayerOp::Draw) {
+            if (!l.image) {
+                continue;
+            }
+            const Clip &c = clip[top];
+            int xa = std::max(l.x, c.x0), xb = std::min(l.x + l.w, c.x1);
+            int ya = std::max(l.y, c.y0), yb = std::min(l.y + l.h, c.y1);
+            if (xa >= xb) {
+                continue;
+            }
+            auto &dst = level(top);
+            const unsigned char *src = l.image->get().data();
+            for (int y = ya; y < yb; y++) {
+                load(src + 4 * ((y - l.y) * l.w + (xa - l.x)), row.data(), xb - xa);
+                blendSpan(l.blend, row.data(), &dst[(y - y0) * w + xa], xb - xa);
+            }
+        }
+        else if (l.op == LayerOp::Push) {
+            const Clip &p = clip[top];
+            top++;
+            clip[top] = {
+                std::max(l.x, p.x0), std::max(l.y, p.y0),
+                std::min(l.x + l.w, p.x1), std::min(l.y + l.h, p.y1),
+            };
+            if (clip[top].x0 < clip[top].x1) {
+                clear(level(top), clip[top]);
+            }
+        }
+        else {
+            Clip c = clip[top];
+            auto &src = level(top);
+            top--;
+            auto &dst = level(top);
+            for (int y = c.y0; y < c.y1 && c.x0 < c.x1; y++) {
+                blendSpan(l.blend, &src[(y - y0) * w + c.x0], &dst[(y - y0) * w + c.x0], c.x1 - c.x0);
+            }
+        }
+    }
+    auto &result = level(0);
+    unsigned char *pixels = static_cast<unsigned char *>(out->pixels);
+    for (int y = y0; y < y1; y++) {
+        store(&result[(y - y0) * w], pixels + y * out->pitch, w);
+    }
+}
+
+CPUCompositor::CPUCompositor() : alive_(true), generation_(0), bands_(0), pending_(0), band_height_(0), list_(nullptr), out_(nullptr), buffers_(std::make_shared<BufferPool>()) {
+    size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    scratch_.resize(threads);
+    for (auto &s : scratch_) {
+        s.levels.resize(layer::kMaxDepth);
+    }
+    for (size_t i = 1; i < threads; i++) {
+        workers_.emplace_back(&CPUCompositor::run, this, i);
+    }
+}
+
+CPUCompositor::~CPUCompositor() {
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        alive_ = false;
+    }
+    start_.notify_all();
+    for (auto &th : workers_) {
+        th.join();
+    }
+}
+
+void CPUCompositor::run(size_t index) {
+    unsigned long long seen = 0;
+    while (true) {
+        const LayerList *list;
+        SDL_Surface *out;
+        int y0, y1;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            start_.wait(lock, [&]() { return generation_ != seen || !alive_; });
+            if (!alive_) {
+                break;
+            }
+            seen = generation_;
+            if (index >= bands_) {
+                continue;
+            }
+            list = list_;
+            out = out_;
+            y0 = static_cast<int>(index) * band_height_;
+            y1 = std::min(list->height, y0 + band_height_);
+        }
+        compositeBand(*list, y0, y1, scratch_[index], out);
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            pending_--;
+            if (pending_ == 0) {
+                finish_.notify_one();
+            }
+        }
+    }
+}
+
+std::shared_ptr<std::vector<unsigned char>> CPUCompositor::acquire(size_t size) {
+    std::unique_ptr<std::vector<unsigned char>> buffer;
+    {
+        std::unique_lock<std::mutex> lock(buffers_->mutex);
+        auto &free = buffers_->free;
+        // 足りるものの中で一番小さいもの
+        auto it = free.end();
+        for (auto i = free.begin(); i != free.end(); i++) {
+            if ((*i)->size() >= size && (it == free.end() || (*i)->size() < (*it)->size())) {
+                it = i;
+            }
+        }
+        if (it != free.end()) {
+            buffer = std::move(*it);
+            free.erase(it);
+        }
+    }
+    if (!buffer) {
+        buffer = std::make_unique<std::vector<unsigned char>>(size);
+    }
+    // 合成器が先に無くなっていれば普通に解放する
+    return std::shared_ptr<std::vector<unsigned char>>(buffer.release(), [pool = std::weak_ptr<BufferPool>(buffers_)](std::vector<unsigned char> *buffer) {
+        if (auto p = pool.lock()) {
+            std::unique_lock<std::mutex> lock(p->mutex);
+            p->free.emplace_back(buffer);
+            if (p->free.size() > kMaxFreeBuffers) {
+                p->free.erase(p->free.begin());
+            }
+            return;
+        }
+        delete buffer;
+    });
+}
+
+CompositeResult CPUCompositor::composite(const LayerList &list) {
+    int w = list.width, h = list.height;
+    if (w <= 0 || h <= 0) {
+        return {};
+    }
+    // 合成先に直接書き込む(要素毎の中間の面は作らない)
+    auto surface = std::make_unique<WrapSurface>(w, h, acquire(static_cast<size_t>(w) * h * 4), list.upconverted);
+    size_t bands = std::clamp<size_t>(h / kMinRowsPerBand, 1, scratch_.size());
+    int band = (h + bands - 1) / bands;
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        list_ = &list;
+        out_ = surface->surface();
+        band_height_ = band;
+        bands_ = (h + band - 1) / band;
+        pending_ = bands_ - 1;
+        generation_++;
+    }
+    start_.notify_all();
+    compositeBand(list, 0, std::min(h, band), scratch_[0], surface->surface());
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        finish_.wait(lock, [this]() { return pending_ == 0; });
+        list_ = nullptr;
+        out_ = nullptr;
+    }
+    return {std::move(surface), nullptr};
+}
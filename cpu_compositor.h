@@ -0,0 +1,59 @@
+#ifndef CPU_COMPOSITOR_H_
+#define CPU_COMPOSITOR_H_
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "compositor.h"
+
+// 行の帯ごとにスレッドを分けてCPUで合成する
+// スレッドと作業面、出力の画素は呼び出し間で使い回す(同時に複数のスレッドから呼ばない)
+class CPUCompositor : public Compositor {
+    public:
+        typedef float float4 __attribute__((vector_size(16)));
+
+    private:
+        // 帯毎の作業面
+        struct Scratch {
+            // 入れ子の深さ毎の面
+            std::vector<std::vector<float4>> levels;
+            // 画像の1行を読み込む先
+            std::vector<float4> row;
+        };
+        // 結果を手放した後の画素(結果は表示するスレッドで手放される)
+        struct BufferPool {
+            std::mutex mutex;
+            std::vector<std::unique_ptr<std::vector<unsigned char>>> free;
+        };
+
+        bool alive_;
+        std::mutex mutex_;
+        std::condition_variable start_;
+        std::condition_variable finish_;
+        // 帯を受け持つスレッド(0番目の帯は呼び出したスレッドが受け持つ)
+        std::vector<std::thread> workers_;
+        // 上がったら各スレッドが自分の帯を合成する
+        unsigned long long generation_;
+        // 合成中の帯の数と、終わっていない帯の数
+        size_t bands_;
+        size_t pending_;
+        int band_height_;
+        const LayerList *list_;
+        SDL_Surface *out_;
+        std::vector<Scratch> scratch_;
+        std::shared_ptr<BufferPool> buffers_;
+
+        void run(size_t index);
+        void compositeBand(const LayerList &list, int y0, int y1, Scratch &scratch, SDL_Surface *out);
+        std::shared_ptr<std::vector<unsigned char>> acquire(size_t size);
+
+    public:
+        CPUCompositor();
+        ~CPUCompositor();
+        CompositeResult composite(const LayerList &list) override;
+};
+
+#endif // CPU_COMPOSITOR_H_
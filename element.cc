@@ -2,31 +2,63 @@
 
 #include <cassert>
 
+#include "geometry_batch.h"
 #include "logger.h"
 
 namespace {
     const int kInf = 1000000;
+
+    struct Layer {
+        std::unique_ptr<WrapTexture> owned;
+        // ownedかTextureCacheのテクスチャを指す
+        WrapTexture *texture;
+        int w, h;
+        bool upconverted;
+    };
+
+    std::optional<Layer> getLayer(const Element &e, SDL_Renderer *renderer, std::unique_ptr<TextureCache> &texture_cache, std::unique_ptr<ImageCache> &image_cache, int scale) {
+        // 中間のテクスチャを作らずにキャッシュから直接描く
+        Layer l;
+        l.texture = e.getCachedTexture(renderer, texture_cache, image_cache, scale, l.w, l.h, l.upconverted);
+        if (l.texture == nullptr) {
+            return std::nullopt;
+        }
+        return l;
+    }
+
+    std::optional<Layer> getLayer(const ElementWithChildren &e, SDL_Renderer *renderer, std::unique_ptr<TextureCache> &texture_cache, std::unique_ptr<ImageCache> &image_cache, int scale) {
+        Layer l;
+        l.owned = e.getTexture(renderer, texture_cache, image_cache, scale);
+        if (!l.owned) {
+            return std::nullopt;
+        }
+        l.texture = l.owned.get();
+        l.w = l.owned->width();
+        l.h = l.owned->height();
+        l.upconverted = l.owned->isUpconverted();
+        return l;
+    }
 }
 
 std::unique_ptr<WrapTexture> ElementWithChildren::getTexture(SDL_Renderer *renderer, std::unique_ptr<TextureCache> &texture_cache, std::unique_ptr<ImageCache> &image_cache, int scale) const {
     int w = 0, h = 0;
     bool upconverted = true;
-    std::vector<std::optional<std::unique_ptr<WrapTexture>>> list;
+    std::vector<std::optional<Layer>> list;
     for (auto &element : children) {
         std::visit([&](const auto &e) {
-            auto t = e.getTexture(renderer, texture_cache, image_cache, scale);
-            if (!t) {
+            auto l = getLayer(e, renderer, texture_cache, image_cache, scale);
+            if (!l) {
                 list.push_back(std::nullopt);
                 return;
             }
-            upconverted = upconverted && t->isUpconverted();
-            if (w < (e.x * scale) / 100 + t->width()) {
-                w = (e.x * scale) / 100 + t->width();
+            upconverted = upconverted && l->upconverted;
+            if (w < (e.x * scale) / 100 + l->w) {
+                w = (e.x * scale) / 100 + l->w;
             }
-            if (h < (e.y * scale) / 100 + t->height()) {
-                h = (e.y * scale) / 100 + t->height();
+            if (h < (e.y * scale) / 100 + l->h) {
+                h = (e.y * scale) / 100 + l->h;
             }
-            list.push_back(std::move(t));
+            list.push_back(std::move(l));
         }, element);
     }
     if (w == 0 || h == 0) {
@@ -38,43 +70,19 @@ std::unique_ptr<WrapTexture> ElementWithChildren::getTexture(SDL_Renderer *rende
     SDL_SetRenderTarget(renderer, texture->texture());
     SDL_SetRenderDrawColor(renderer, 0x00, 0x00, 0x00, 0x00);
     SDL_RenderClear(renderer);
+    // 同じアトラスページとブレンドモードの子はまとめて描く
+    GeometryBatch batch;
     for (int i = 0; i < children.size(); i++) {
         if (!list[i]) {
             continue;
         }
-        SDL_BlendMode mode = SDL_ComposeCustomBlendMode(SDL_BLENDFACTOR_ONE, SDL_BLENDFACTOR_ONE_MINUS_SRC_ALPHA, SDL_BLENDOPERATION_ADD, SDL_BLENDFACTOR_ONE, SDL_BLENDFACTOR_ONE, SDL_BLENDOPERATION_ADD);
         std::visit([&](const auto &e) {
-            switch (e.method) {
-                case Method::Base:
-                case Method::Add:
-                case Method::Overlay:
-                    break;
-                case Method::OverlayFast:
-                    mode = SDL_ComposeCustomBlendMode(SDL_BLENDFACTOR_DST_ALPHA, SDL_BLENDFACTOR_ONE_MINUS_SRC_ALPHA, SDL_BLENDOPERATION_ADD, SDL_BLENDFACTOR_ONE, SDL_BLENDFACTOR_ONE, SDL_BLENDOPERATION_ADD);
-                    break;
-                case Method::OverlayMultiply:
-                    // FIXME
-                    mode = SDL_ComposeCustomBlendMode(SDL_BLENDFACTOR_ZERO, SDL_BLENDFACTOR_SRC_COLOR, SDL_BLENDOPERATION_ADD, SDL_BLENDFACTOR_ONE, SDL_BLENDFACTOR_ONE, SDL_BLENDOPERATION_ADD);
-                    break;
-                case Method::Replace:
-                    mode = SDL_ComposeCustomBlendMode(SDL_BLENDFACTOR_ONE, SDL_BLENDFACTOR_ZERO, SDL_BLENDOPERATION_ADD, SDL_BLENDFACTOR_ONE, SDL_BLENDFACTOR_ONE, SDL_BLENDOPERATION_ADD);
-                    break;
-                case Method::Interpolate:
-                    mode = SDL_ComposeCustomBlendMode(SDL_BLENDFACTOR_ONE_MINUS_DST_ALPHA, SDL_BLENDFACTOR_ONE_MINUS_SRC_ALPHA, SDL_BLENDOPERATION_ADD, SDL_BLENDFACTOR_ONE, SDL_BLENDFACTOR_ONE, SDL_BLENDOPERATION_ADD);
-                    break;
-                case Method::Reduce:
-                    // FIXME
-                    mode = SDL_ComposeCustomBlendMode(SDL_BLENDFACTOR_ZERO, SDL_BLENDFACTOR_SRC_ALPHA, SDL_BLENDOPERATION_ADD, SDL_BLENDFACTOR_ZERO, SDL_BLENDFACTOR_ONE, SDL_BLENDOPERATION_ADD);
-                    break;
-                default:
-                    break;
-            }
-            auto &t = list[i].value();
-            SDL_SetTextureBlendMode(t->texture(), mode);
-            SDL_FRect r = { (e.x * scale / 100), (e.y * scale / 100), t->width(), t->height() };
-            SDL_RenderTexture(renderer, t->texture(), nullptr, &r);
+            auto &l = list[i].value();
+            SDL_FRect r = { static_cast<float>(e.x * scale / 100), static_cast<float>(e.y * scale / 100), static_cast<float>(l.w), static_cast<float>(l.h) };
+            batch.add(l.texture->texture(), toBlendMode(e.method), l.texture->source(), r);
         }, children[i]);
     }
+    batch.flush(renderer);
     SDL_SetRenderTarget(renderer, nullptr);
     return texture;
 }
@@ -111,7 +119,7 @@ std::unique_ptr<WrapSurface> ElementWithChildren::getSurface(std::unique_ptr<Ima
         }
         std::visit([&](const auto &e) {
             auto &t = list[i].value();
-            SDL_SetSurfaceBlendMode(t->surface(), SDL_BLENDMODE_BLEND);
+            SDL_SetSurfaceBlendMode(t->surface(), SDL_BLENDMODE_BLEND_PREMULTIPLIED);
             SDL_Rect r = { (e.x * scale) / 100, (e.y * scale) / 100, t->width(), t->height() };
             SDL_BlitSurface(t->surface(), nullptr, surface->surface(), &r);
         }, children[i]);
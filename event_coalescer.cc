@@ -0,0 +1,175 @@
+#include "event_coalescer.h"
+
+#include <algorithm>
+#include <iterator>
+
+#include "logger.h"
+#include "metrics.h"
+#include "util.h"
+
+namespace {
+    // 溜められる通知の数
+    constexpr size_t kMaxPending = 256;
+
+    // Statsと同じ値をGetMetricsからも見えるようにする
+    metrics::Counter &sent = metrics::counter("event_coalescer.sent");
+    metrics::Counter &merged = metrics::counter("event_coalescer.merged");
+    metrics::Counter &dropped = metrics::counter("event_coalescer.dropped");
+    metrics::Gauge &queue_depth = metrics::gauge("event_coalescer.queue_depth");
+
+    std::optional<std::string> keyOf(const std::vector<Request> &list) {
+        if (list.size() != 1) {
+            return std::nullopt;
+        }
+        auto &r = list[0];
+        if (r.command == "OnMouseMove" || r.command == "OnMouseWheel") {
+            // 同じキャラクターの同じ当たり判定の上でのみまとめる
+            if (r.args.size() < 5) {
+                return std::nullopt;
+            }
+            return r.command + "\x01" + r.args[3] + "\x01" + r.args[4];
+        }
+        if (r.command == "UpdateSurfaceRect" || r.command == "UpdateMonitorRect" || r.command == "ResetBalloonPosition") {
+            if (r.args.empty()) {
+                return std::nullopt;
+            }
+            return r.command + "\x01" + r.args[0];
+        }
+        return std::nullopt;
+    }
+
+    void merge(Request &dst, const Request &src) {
+        if (dst.command == "OnMouseWheel" && dst.args.size() > 2 && src.args.size() > 2) {
+            // 回転量は足し合わせる
+            int a = 0, b = 0;
+            util::to_x(dst.args[2], a);
+            util::to_x(src.args[2], b);
+            auto args = src.args;
+            args[2] = util::to_s(a + b);
+            dst.args = std::move(args);
+            return;
+        }
+        dst.args = src.args;
+    }
+}
+
+EventCoalescer::EventCoalescer(Sink sink, int rate)
+    : alive_(true), sink_(sink), interval_(0), in_flight_(0), ordered_(false), stats_({0, 0, 0}) {
+    if (rate > 0) {
+        interval_ = std::chrono::nanoseconds(1000000000LL / rate);
+    }
+    th_ = std::make_unique<std::thread>(&EventCoalescer::run, this);
+}
+
+EventCoalescer::~EventCoalescer() {
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        alive_ = false;
+    }
+    cond_.notify_one();
+    th_->join();
+    Logger::log("coalescer: sent", stats_.sent, "merged", stats_.merged, "dropped", stats_.dropped);
+}
+
+void EventCoalescer::push(std::vector<Request> list) {
+    auto key = keyOf(list);
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (key) {
+            // まとめられない通知を追い越さない範囲で同じ種類のものを探す
+            // 間に別の種類が挟まっていれば古いものは取り除いて末尾に置き直し、届く順番を実際の順番に合わせる
+            for (auto it = queue_.rbegin(); it != queue_.rend() && it->key; it++) {
+                if (it->key == key) {
+                    merge(it->list[0], list[0]);
+                    stats_.merged++;
+                    merged.add();
+                    if (it != queue_.rbegin()) {
+                        Entry entry = std::move(*it);
+                        queue_.erase(std::next(it).base());
+                        queue_.push_back(std::move(entry));
+                    }
+                    return;
+                }
+            }
+            if (queue_.size() >= kMaxPending) {
+                stats_.dropped++;
+                dropped.add();
+                return;
+            }
+        }
+        queue_.push_back({std::move(list), std::move(key)});
+        queue_depth.set(queue_.size());
+    }
+    cond_.notify_one();
+}
+
+EventCoalescer::Stats EventCoalescer::stats() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    return stats_;
+}
+
+bool EventCoalescer::ready(const Entry &entry) const {
+    if (ordered_) {
+        return false;
+    }
+    if (!entry.key) {
+        // 先に送った通知を追い越さないように全て終わるのを待つ
+        return in_flight_ == 0;
+    }
+    // 同じ種類の通知は前のものが届くまで次を送らない
+    return !busy_.contains(entry.key.value());
+}
+
+void EventCoalescer::finish(const std::optional<std::string> &key) {
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        in_flight_--;
+        if (key) {
+            busy_.erase(key.value());
+        }
+        else {
+            ordered_ = false;
+        }
+    }
+    cond_.notify_one();
+}
+
+void EventCoalescer::run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        cond_.wait(lock, [this]() { return (!queue_.empty() && ready(queue_.front())) || !alive_; });
+        if (!alive_) {
+            break;
+        }
+        auto &head = queue_.front();
+        auto now = std::chrono::steady_clock::now();
+        if (head.key && last_sent_.contains(head.key.value())) {
+            auto due = last_sent_.at(head.key.value()) + interval_;
+            // 後ろにクリックなどが待っていればそちらを遅らせないようにすぐ送る
+            bool blocking = std::any_of(queue_.begin(), queue_.end(), [](const Entry &e) { return !e.key; });
+            if (now < due && !blocking) {
+                // 待っている間に届いた通知はこれにまとめられる
+                cond_.wait_until(lock, due);
+                continue;
+            }
+        }
+        Entry entry = std::move(head);
+        queue_.pop_front();
+        queue_depth.set(queue_.size());
+        if (entry.key) {
+            last_sent_.insert_or_assign(entry.key.value(), now);
+            busy_.insert(entry.key.value());
+        }
+        else {
+            ordered_ = true;
+        }
+        in_flight_++;
+        stats_.sent++;
+        sent.add();
+        lock.unlock();
+        sink_(std::move(entry.list), [this, key = entry.key]() {
+            finish(key);
+        });
+        lock.lock();
+    }
+}
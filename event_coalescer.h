@@ -0,0 +1,73 @@
+#ifndef EVENT_COALESCER_H_
+#define EVENT_COALESCER_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "misc.h"
+
+// マウス移動や位置の更新など後の値で置き換えられる通知をまとめ、
+// 同じ種類の通知は一定の間隔より短くは送らない
+// クリックなどそれ以外の通知は順番を変えずにそのまま送る
+// まとめられない通知は前に送ったものが全て終わってから1つずつ送り、終わるまで後ろのものも送らない
+class EventCoalescer {
+    public:
+        // 送り終わったら(失敗しても)doneを1回呼ぶこと
+        using Sink = std::function<void(std::vector<Request> list, std::function<void()> done)>;
+
+        struct Stats {
+            uint64_t sent;
+            // 未送信の通知にまとめた数
+            uint64_t merged;
+            // 溢れて捨てた数
+            uint64_t dropped;
+        };
+
+    private:
+        struct Entry {
+            std::vector<Request> list;
+            // まとめられない通知はstd::nullopt
+            std::optional<std::string> key;
+        };
+
+        bool alive_;
+        std::mutex mutex_;
+        std::condition_variable cond_;
+        std::unique_ptr<std::thread> th_;
+        Sink sink_;
+        // 0なら間隔を空けない
+        std::chrono::nanoseconds interval_;
+        std::deque<Entry> queue_;
+        std::unordered_map<std::string, std::chrono::steady_clock::time_point> last_sent_;
+        // 送って終わっていない通知の数と、その中のまとめられる通知の種類
+        size_t in_flight_;
+        std::unordered_set<std::string> busy_;
+        // まとめられない通知を送っている
+        bool ordered_;
+        Stats stats_;
+
+        // mutex_を持って呼ぶ
+        bool ready(const Entry &entry) const;
+        void finish(const std::optional<std::string> &key);
+        void run();
+
+    public:
+        // rate: 同じ種類の通知を1秒間に送る最大数
+        EventCoalescer(Sink sink, int rate);
+        ~EventCoalescer();
+        void push(std::vector<Request> list);
+        Stats stats();
+};
+
+#endif // EVENT_COALESCER_H_
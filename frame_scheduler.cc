@@ -0,0 +1,96 @@
+#include "frame_scheduler.h"
+
+#include <algorithm>
+
+#include <SDL3/SDL_video.h>
+
+#include "logger.h"
+#include "metrics.h"
+
+namespace {
+    // リフレッシュレートが分からない時に使う
+    const double kDefaultRefreshRate = 60.0;
+
+    // frames()とwakeups()はメインスレッド用なのでGetMetricsにはこちらを見せる
+    metrics::Counter &frame_count = metrics::counter("frame_scheduler.frames");
+    metrics::Counter &wakeup_count = metrics::counter("frame_scheduler.wakeups");
+}
+
+FrameScheduler::FrameScheduler() : next_frame_(Clock::now()), pending_(true), frames_(0), wakeups_(0) {
+    updateRefreshRate();
+}
+
+void FrameScheduler::updateRefreshRate() {
+    double rate = 0;
+    int count = 0;
+    SDL_DisplayID *displays = SDL_GetDisplays(&count);
+    for (int i = 0; i < count; i++) {
+        const SDL_DisplayMode *mode = SDL_GetCurrentDisplayMode(displays[i]);
+        if (mode != nullptr) {
+            rate = std::max<double>(rate, mode->refresh_rate);
+        }
+    }
+    SDL_free(displays);
+    if (rate <= 0) {
+        rate = kDefaultRefreshRate;
+    }
+    interval_ = std::chrono::nanoseconds(static_cast<long long>(1e9 / rate));
+    Logger::info("refresh rate:", rate);
+}
+
+void FrameScheduler::setDeadline(std::optional<int> ms) {
+    if (!ms) {
+        deadline_.reset();
+        return;
+    }
+    deadline_ = Clock::now() + std::chrono::milliseconds(std::max(0, ms.value()));
+}
+
+bool FrameScheduler::wait(SDL_Event &event) {
+    wakeups_++;
+    wakeup_count.add();
+    std::optional<Clock::time_point> until;
+    if (pending_) {
+        until = next_frame_;
+    }
+    else if (deadline_) {
+        until = std::max(next_frame_, deadline_.value());
+    }
+    if (Clock::fake()) {
+        // 寝る代わりに時計を進める(何も無ければ進めてよい所まで)
+        Clock::advance(until.value_or(Clock::time_point::max()));
+        return SDL_PollEvent(&event);
+    }
+    if (!until) {
+        // 何も起きないのでイベントが来るまで寝る
+        return SDL_WaitEvent(&event);
+    }
+    auto now = Clock::now();
+    if (until.value() <= now) {
+        return SDL_PollEvent(&event);
+    }
+    // 切り上げないと早く起きすぎて空回りする
+    auto ms = std::chrono::ceil<std::chrono::milliseconds>(until.value() - now).count();
+    return SDL_WaitEventTimeout(&event, ms);
+}
+
+bool FrameScheduler::due() const {
+    auto now = Clock::now();
+    if (now < next_frame_) {
+        return false;
+    }
+    return pending_ || (deadline_ && deadline_.value() <= now);
+}
+
+void FrameScheduler::presented() {
+    auto now = Clock::now();
+    next_frame_ += interval_;
+    // 長く止まっていた後にまとめて描画しないようにする
+    if (next_frame_ < now) {
+        next_frame_ = now + interval_;
+    }
+    pending_ = false;
+    deadline_.reset();
+    frames_++;
+    frame_count.add();
+}
@@ -0,0 +1,48 @@
+#ifndef FRAME_SCHEDULER_H_
+#define FRAME_SCHEDULER_H_
+
+#include <chrono>
+#include <cstdint>
+#include <optional>
+
+#include <SDL3/SDL_events.h>
+
+#include "clock.h"
+
+// 描画をディスプレイのリフレッシュ毎に1回にまとめ、
+// それ以外はSERIKOの次の切り替わりかイベントが来るまで待つ
+class FrameScheduler {
+    private:
+        Clock::time_point next_frame_;
+        std::chrono::nanoseconds interval_;
+        std::optional<Clock::time_point> deadline_;
+        bool pending_;
+        uint64_t frames_;
+        uint64_t wakeups_;
+
+    public:
+        FrameScheduler();
+        ~FrameScheduler() {}
+        // 接続されているディスプレイで一番高いリフレッシュレートに合わせる
+        void updateRefreshRate();
+        // 次のフレームで描画する
+        void request() {
+            pending_ = true;
+        }
+        // msミリ秒後に描画する(SERIKOの次の切り替わり)
+        void setDeadline(std::optional<int> ms);
+        // イベントが来たらtrue、描画する時刻になったらfalseを返す
+        bool wait(SDL_Event &event);
+        bool due() const;
+        void presented();
+        // 描画した回数
+        uint64_t frames() const {
+            return frames_;
+        }
+        // waitから戻った回数
+        uint64_t wakeups() const {
+            return wakeups_;
+        }
+};
+
+#endif // FRAME_SCHEDULER_H_
@@ -0,0 +1,79 @@
+#include "geometry_batch.h"
+
+#include <algorithm>
+
+#include "logger.h"
+
+namespace {
+    bool intersects(const SDL_FRect &a, const SDL_FRect &b) {
+        return a.x < b.x + b.w && b.x < a.x + a.w && a.y < b.y + b.h && b.y < a.y + a.h;
+    }
+
+    SDL_FRect unite(const SDL_FRect &a, const SDL_FRect &b) {
+        float x0 = std::min(a.x, b.x);
+        float y0 = std::min(a.y, b.y);
+        float x1 = std::max(a.x + a.w, b.x + b.w);
+        float y1 = std::max(a.y + a.h, b.y + b.h);
+        return {x0, y0, x1 - x0, y1 - y0};
+    }
+}
+
+bool GeometryBatch::overlaps(const Batch &batch, const SDL_FRect &rect) const {
+    if (!intersects(batch.bounds, rect)) {
+        return false;
+    }
+    for (auto &r : batch.rects) {
+        if (intersects(r, rect)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void GeometryBatch::add(SDL_Texture *texture, SDL_BlendMode mode, const SDL_FRect *src, const SDL_FRect &dst) {
+    quads_++;
+    // 後ろから見て、間にある矩形と重ならない限り前のバッチに合流できる
+    Batch *batch = nullptr;
+    for (auto it = batches_.rbegin(); it != batches_.rend(); it++) {
+        if (it->texture == texture && it->mode == mode) {
+            batch = &*it;
+            break;
+        }
+        if (overlaps(*it, dst)) {
+            break;
+        }
+    }
+    if (batch == nullptr) {
+        batches_.push_back({texture, mode, {}, {}, {}, dst});
+        batch = &batches_.back();
+    }
+    SDL_FRect s = {0, 0, static_cast<float>(texture->w), static_cast<float>(texture->h)};
+    if (src != nullptr) {
+        s = *src;
+    }
+    float u0 = s.x / texture->w, v0 = s.y / texture->h;
+    float u1 = (s.x + s.w) / texture->w, v1 = (s.y + s.h) / texture->h;
+    SDL_FColor color = {1.0f, 1.0f, 1.0f, 1.0f};
+    int base = batch->vertices.size();
+    batch->vertices.push_back({{dst.x, dst.y}, color, {u0, v0}});
+    batch->vertices.push_back({{dst.x + dst.w, dst.y}, color, {u1, v0}});
+    batch->vertices.push_back({{dst.x + dst.w, dst.y + dst.h}, color, {u1, v1}});
+    batch->vertices.push_back({{dst.x, dst.y + dst.h}, color, {u0, v1}});
+    for (int i : {0, 1, 2, 0, 2, 3}) {
+        batch->indices.push_back(base + i);
+    }
+    batch->rects.push_back(dst);
+    batch->bounds = unite(batch->bounds, dst);
+}
+
+void GeometryBatch::flush(SDL_Renderer *renderer) {
+    for (auto &batch : batches_) {
+        SDL_SetTextureBlendMode(batch.texture, batch.mode);
+        SDL_RenderGeometry(renderer, batch.texture, batch.vertices.data(), batch.vertices.size(), batch.indices.data(), batch.indices.size());
+    }
+#if defined(DEBUG)
+    Logger::log("geometry batch:", quads_, "quads in", batches_.size(), "batches");
+#endif // DEBUG
+    batches_.clear();
+    quads_ = 0;
+}
@@ -0,0 +1,33 @@
+#ifndef GEOMETRY_BATCH_H_
+#define GEOMETRY_BATCH_H_
+
+#include <vector>
+
+#include <SDL3/SDL_render.h>
+
+// テクスチャとブレンドモードが同じ矩形をまとめてSDL_RenderGeometryで描く
+class GeometryBatch {
+    private:
+        struct Batch {
+            SDL_Texture *texture;
+            SDL_BlendMode mode;
+            std::vector<SDL_Vertex> vertices;
+            std::vector<int> indices;
+            // 描画順を入れ替えてよいか調べるための描画先の範囲
+            std::vector<SDL_FRect> rects;
+            SDL_FRect bounds;
+        };
+        std::vector<Batch> batches_;
+        int quads_;
+
+        bool overlaps(const Batch &batch, const SDL_FRect &rect) const;
+
+    public:
+        GeometryBatch() : quads_(0) {}
+        ~GeometryBatch() {}
+        void add(SDL_Texture *texture, SDL_BlendMode mode, const SDL_FRect *src, const SDL_FRect &dst);
+        // 溜めた矩形を現在のレンダーターゲットに描く
+        void flush(SDL_Renderer *renderer);
+};
+
+#endif // GEOMETRY_BATCH_H_
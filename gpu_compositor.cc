@@ -0,0 +1,417 @@
+#include "gpu_compositor.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <vector>
+
+#include "logger.h"
+#include "metrics.h"
+
+namespace {
+    // shader/compositor.compと同じ配置
+    struct LayerDesc {
+        Sint32 op, blend;
+        Sint32 x, y, w, h;
+        Uint32 offset, padding;
+    };
+
+    struct Params {
+        Uint32 count, width, height, padding;
+    };
+
+    const int kThreads = 8;
+    // 1スレッドが受け持つ横の画素数
+    const int kPixelsPerThread = 4;
+    // 画像を置くバッファの最小の大きさ
+    const Uint32 kMinPixelsSize = 32 << 20;
+    // 使い回すために残しておく結果のテクスチャの数
+    const size_t kMaxFreeTargets = 4;
+
+    metrics::Counter &uploaded_bytes = metrics::counter("gpu_compositor.uploaded_bytes");
+    metrics::Counter &resets = metrics::counter("gpu_compositor.resets");
+
+    bool same(const std::weak_ptr<const std::vector<unsigned char>> &a, const std::weak_ptr<const std::vector<unsigned char>> &b) {
+        return !a.owner_before(b) && !b.owner_before(a);
+    }
+}
+
+GPUCompositor::GPUCompositor(SDL_GPUDevice *device, SDL_GPUComputePipeline *pipeline)
+    : device_(device), pipeline_(pipeline), pixels_(nullptr),
+    pixels_size_(0), pixels_used_(0), layers_(nullptr), alpha_(nullptr),
+    upload_(nullptr), download_(nullptr),
+    layers_size_(0), alpha_size_(0), upload_size_(0), download_size_(0) {}
+
+GPUCompositor::~GPUCompositor() {
+    for (auto &t : free_) {
+        SDL_ReleaseGPUTexture(device_, t.texture);
+    }
+    if (pixels_ != nullptr) {
+        SDL_ReleaseGPUBuffer(device_, pixels_);
+    }
+    if (layers_ != nullptr) {
+        SDL_ReleaseGPUBuffer(device_, layers_);
+    }
+    if (alpha_ != nullptr) {
+        SDL_ReleaseGPUBuffer(device_, alpha_);
+    }
+    if (upload_ != nullptr) {
+        SDL_ReleaseGPUTransferBuffer(device_, upload_);
+    }
+    if (download_ != nullptr) {
+        SDL_ReleaseGPUTransferBuffer(device_, download_);
+    }
+    SDL_ReleaseGPUComputePipeline(device_, pipeline_);
+    SDL_DestroyGPUDevice(device_);
+}
+
+std::unique_ptr<GPUCompositor> GPUCompositor::create(const std::filesystem::path &exe_dir) {
+    std::unique_ptr<GPUCompositor> invalid;
+#if defined(USE_GPU_COMPOSITOR)
+    std::ifstream ifs(exe_dir / "compositor.spv", std::ios::binary);
+    if (!ifs) {
+        Logger::warn("gpu compositor: shader not found");
+        return invalid;
+    }
+    std::vector<Uint8> code((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+    // ドライバはSDLに任せる(VK_DRIVER_FILESでlavapipeを指定すればソフトウェアで動く)
+    SDL_GPUDevice *device = SDL_CreateGPUDevice(SDL_GPU_SHADERFORMAT_SPIRV, false, nullptr);
+    if (device == nullptr) {
+        Logger::warn("gpu compositor:", SDL_GetError());
+        return invalid;
+    }
+    SDL_GPUComputePipelineCreateInfo info = {};
+    info.code_size = code.size();
+    info.code = code.data();
+    info.entrypoint = "main";
+    info.format = SDL_GPU_SHADERFORMAT_SPIRV;
+    info.num_readonly_storage_buffers = 2;
+    info.num_readwrite_storage_textures = 1;
+    info.num_readwrite_storage_buffers = 1;
+    info.num_uniform_buffers = 1;
+    info.threadcount_x = kThreads;
+    info.threadcount_y = kThreads;
+    info.threadcount_z = 1;
+    SDL_GPUComputePipeline *pipeline = SDL_CreateGPUComputePipeline(device, &info);
+    if (pipeline == nullptr) {
+        Logger::error("gpu compositor:", SDL_GetError());
+        SDL_DestroyGPUDevice(device);
+        return invalid;
+    }
+    Logger::info("gpu compositor:", SDL_GetGPUDeviceDriver(device));
+    return std::unique_ptr<GPUCompositor>(new GPUCompositor(device, pipeline));
+#else
+    // 結果のテクスチャをレンダラで表示できない
+    Logger::warn("gpu compositor: requires SDL 3.4");
+    return invalid;
+#endif // USE_GPU_COMPOSITOR
+}
+
+bool GPUCompositor::reservePixels(Uint32 size) {
+    if (pixels_ != nullptr && pixels_size_ >= size) {
+        return true;
+    }
+    if (pixels_ != nullptr) {
+        SDL_ReleaseGPUBuffer(device_, pixels_);
+    }
+    // 作り直すと中身は無くなる
+    resident_.clear();
+    pixels_used_ = 0;
+    pixels_size_ = std::max({size, kMinPixelsSize, pixels_size_ * 2});
+    SDL_GPUBufferCreateInfo info = {};
+    info.usage = SDL_GPU_BUFFERUSAGE_COMPUTE_STORAGE_READ;
+    info.size = pixels_size_;
+    pixels_ = SDL_CreateGPUBuffer(device_, &info);
+    return pixels_ != nullptr;
+}
+
+bool GPUCompositor::reserve(Uint32 layers_size, Uint32 alpha_size, Uint32 upload_size) {
+    auto buffer = [this](SDL_GPUBuffer *&buffer, Uint32 &capacity, Uint32 size, SDL_GPUBufferUsageFlags usage) {
+        if (buffer != nullptr && capacity >= size) {
+            return true;
+        }
+        if (buffer != nullptr) {
+            SDL_ReleaseGPUBuffer(device_, buffer);
+        }
+        capacity = std::max(size, capacity * 2);
+        SDL_GPUBufferCreateInfo info = {};
+        info.usage = usage;
+        info.size = capacity;
+        buffer = SDL_CreateGPUBuffer(device_, &info);
+        return buffer != nullptr;
+    };
+    auto transfer = [this](SDL_GPUTransferBuffer *&buffer, Uint32 &capacity, Uint32 size, SDL_GPUTransferBufferUsage usage) {
+        if (buffer != nullptr && capacity >= size) {
+            return true;
+        }
+        if (buffer != nullptr) {
+            SDL_ReleaseGPUTransferBuffer(device_, buffer);
+        }
+        capacity = std::max(size, capacity * 2);
+        SDL_GPUTransferBufferCreateInfo info = {};
+        info.usage = usage;
+        info.size = capacity;
+        buffer = SDL_CreateGPUTransferBuffer(device_, &info);
+        return buffer != nullptr;
+    };
+    return buffer(layers_, layers_size_, layers_size, SDL_GPU_BUFFERUSAGE_COMPUTE_STORAGE_READ) &&
+        buffer(alpha_, alpha_size_, alpha_size, SDL_GPU_BUFFERUSAGE_COMPUTE_STORAGE_WRITE) &&
+        transfer(upload_, upload_size_, upload_size, SDL_GPU_TRANSFERBUFFERUSAGE_UPLOAD) &&
+        transfer(download_, download_size_, alpha_size, SDL_GPU_TRANSFERBUFFERUSAGE_DOWNLOAD);
+}
+
+std::shared_ptr<SDL_GPUTexture> GPUCompositor::acquire(int w, int h) {
+    SDL_GPUTexture *texture = nullptr;
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto it = std::find_if(free_.begin(), free_.end(), [w, h](const Target &t) {
+            return t.w == w && t.h == h;
+        });
+        if (it != free_.end()) {
+            texture = it->texture;
+            free_.erase(it);
+        }
+    }
+    if (texture == nullptr) {
+        SDL_GPUTextureCreateInfo info = {};
+        info.type = SDL_GPU_TEXTURETYPE_2D;
+        info.format = SDL_GPU_TEXTUREFORMAT_R8G8B8A8_UNORM;
+        // レンダラがそのまま描画に使う
+        info.usage = SDL_GPU_TEXTUREUSAGE_SAMPLER | SDL_GPU_TEXTUREUSAGE_COMPUTE_STORAGE_WRITE;
+        info.width = w;
+        info.height = h;
+        info.layer_count_or_depth = 1;
+        info.num_levels = 1;
+        info.sample_count = SDL_GPU_SAMPLECOUNT_1;
+        texture = SDL_CreateGPUTexture(device_, &info);
+    }
+    if (texture == nullptr) {
+        std::shared_ptr<SDL_GPUTexture> invalid;
+        return invalid;
+    }
+    return std::shared_ptr<SDL_GPUTexture>(texture, [this, w, h](SDL_GPUTexture *texture) {
+        release(texture, w, h);
+    });
+}
+
+void GPUCompositor::release(SDL_GPUTexture *texture, int w, int h) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    free_.push_back({texture, w, h});
+    if (free_.size() > kMaxFreeTargets) {
+        SDL_ReleaseGPUTexture(device_, free_.front().texture);
+        free_.erase(free_.begin());
+    }
+}
+
+CompositeResult GPUCompositor::composite(const LayerList &list) {
+    int w = list.width, h = list.height;
+    if (w <= 0 || h <= 0) {
+        return {};
+    }
+    auto invalid = [this]() -> CompositeResult {
+        Logger::error("gpu compositor:", SDL_GetError());
+        // 転送しなかった画像を置いたことにしない
+        resident_.clear();
+        pixels_used_ = 0;
+        return {};
+    };
+    if (!reservePixels(4)) {
+        return invalid();
+    }
+
+    // まだ置いていない画像をpixels_の空きに詰める
+    std::vector<LayerDesc> descs(list.layers.size());
+    std::vector<const ImageInfo *> uploads;
+    Uint32 begin = 0, upload_size = 0;
+    auto place = [&]() {
+        uploads.clear();
+        begin = pixels_used_;
+        upload_size = 0;
+        for (size_t i = 0; i < list.layers.size(); i++) {
+            auto &l = list.layers[i];
+            descs[i] = {static_cast<Sint32>(l.op), static_cast<Sint32>(l.blend), l.x, l.y, l.w, l.h, 0, 0};
+            if (!l.image) {
+                continue;
+            }
+            auto ref = l.image->ref();
+            auto &r = resident_[l.path];
+            auto it = r.find(l.image->scale());
+            if (it == r.end() || !same(it->second.ref, ref)) {
+                Uint32 size = l.image->bytes();
+                if (pixels_used_ + size > pixels_size_) {
+                    return false;
+                }
+                it = r.insert_or_assign(l.image->scale(), Resident{ref, pixels_used_}).first;
+                uploads.push_back(&l.image.value());
+                pixels_used_ += size;
+                upload_size += size;
+            }
+            descs[i].offset = it->second.offset / 4;
+        }
+        return true;
+    };
+    if (!place()) {
+        // 溢れたら空にして、このフレームで使う分だけを置き直す
+        resets.add();
+        resident_.clear();
+        pixels_used_ = 0;
+        Uint32 total = 0;
+        for (auto &l : list.layers) {
+            if (l.image) {
+                total += l.image->bytes();
+            }
+        }
+        if (!reservePixels(total) || !place()) {
+            return invalid();
+        }
+    }
+    uploaded_bytes.add(upload_size);
+
+    Uint32 layers_size = std::max<Uint32>(descs.size() * sizeof(LayerDesc), sizeof(LayerDesc));
+    // 1行を4画素単位に切り上げたアルファ
+    int stride = (w + kPixelsPerThread - 1) / kPixelsPerThread * kPixelsPerThread;
+    Uint32 alpha_size = stride * h;
+    if (!reserve(layers_size, alpha_size, upload_size + layers_size)) {
+        return invalid();
+    }
+    auto texture = acquire(w, h);
+    if (!texture) {
+        return invalid();
+    }
+
+    auto *mapped = static_cast<unsigned char *>(SDL_MapGPUTransferBuffer(device_, upload_, false));
+    if (mapped == nullptr) {
+        return invalid();
+    }
+    unsigned char *p = mapped;
+    for (auto *info : uploads) {
+        auto &data = info->get();
+        std::memcpy(p, data.data(), data.size());
+        p += data.size();
+    }
+    std::memcpy(mapped + upload_size, descs.data(), descs.size() * sizeof(LayerDesc));
+    SDL_UnmapGPUTransferBuffer(device_, upload_);
+
+    SDL_GPUCommandBuffer *cmd = SDL_AcquireGPUCommandBuffer(device_);
+    if (cmd == nullptr) {
+        return invalid();
+    }
+    SDL_GPUCopyPass *copy = SDL_BeginGPUCopyPass(cmd);
+    if (upload_size > 0) {
+        // 置いてある画像は残したままにする
+        SDL_GPUTransferBufferLocation src = {upload_, 0};
+        SDL_GPUBufferRegion dst = {pixels_, begin, upload_size};
+        SDL_UploadToGPUBuffer(copy, &src, &dst, false);
+    }
+    {
+        SDL_GPUTransferBufferLocation src = {upload_, upload_size};
+        SDL_GPUBufferRegion dst = {layers_, 0, layers_size};
+        SDL_UploadToGPUBuffer(copy, &src, &dst, false);
+    }
+    SDL_EndGPUCopyPass(copy);
+
+    SDL_GPUStorageTextureReadWriteBinding target = {};
+    target.texture = texture.get();
+    // 使い回したテクスチャがまだ表示に使われていれば別の実体に書く
+    target.cycle = true;
+    SDL_GPUStorageBufferReadWriteBinding alpha = {};
+    alpha.buffer = alpha_;
+    SDL_GPUComputePass *compute = SDL_BeginGPUComputePass(cmd, &target, 1, &alpha, 1);
+    SDL_BindGPUComputePipeline(compute, pipeline_);
+    SDL_GPUBuffer *buffers[] = {pixels_, layers_};
+    SDL_BindGPUComputeStorageBuffers(compute, 0, buffers, 2);
+    Params params = {static_cast<Uint32>(descs.size()), static_cast<Uint32>(w), static_cast<Uint32>(h), 0};
+    SDL_PushGPUComputeUniformData(cmd, 0, &params, sizeof(params));
+    int columns = stride / kPixelsPerThread;
+    SDL_DispatchGPUCompute(compute, (columns + kThreads - 1) / kThreads, (h + kThreads - 1) / kThreads, 1);
+    SDL_EndGPUComputePass(compute);
+
+    // 形状に使うアルファだけを読み戻す
+    copy = SDL_BeginGPUCopyPass(cmd);
+    {
+        SDL_GPUBufferRegion src = {alpha_, 0, alpha_size};
+        SDL_GPUTransferBufferLocation dst = {download_, 0};
+        SDL_DownloadFromGPUBuffer(copy, &src, &dst);
+    }
+    SDL_EndGPUCopyPass(copy);
+    SDL_GPUFence *fence = SDL_SubmitGPUCommandBufferAndAcquireFence(cmd);
+    if (fence == nullptr) {
+        return invalid();
+    }
+    SDL_WaitForGPUFences(device_, true, &fence, 1);
+    SDL_ReleaseGPUFence(device_, fence);
+
+    auto *result = static_cast<unsigned char *>(SDL_MapGPUTransferBuffer(device_, download_, false));
+    if (result == nullptr) {
+        return invalid();
+    }
+    auto surface = std::make_unique<WrapSurface>(w, h, list.upconverted);
+    SDL_ClearSurface(surface->surface(), 0, 0, 0, 0);
+    SDL_LockSurface(surface->surface());
+    auto *pixels = static_cast<unsigned char *>(surface->surface()->pixels);
+    for (int y = 0; y < h; y++) {
+        unsigned char *row = pixels + y * surface->surface()->pitch;
+        for (int x = 0; x < w; x++) {
+            row[4 * x + 3] = result[y * stride + x];
+        }
+    }
+    SDL_UnlockSurface(surface->surface());
+    SDL_UnmapGPUTransferBuffer(device_, download_);
+    return {std::move(surface), std::move(texture)};
+}
+
+std::unique_ptr<WrapSurface> GPUCompositor::download(SDL_GPUTexture *texture, int w, int h) {
+    std::unique_ptr<WrapSurface> invalid;
+    SDL_GPUTransferBufferCreateInfo info = {};
+    info.usage = SDL_GPU_TRANSFERBUFFERUSAGE_DOWNLOAD;
+    info.size = w * h * 4;
+    SDL_GPUTransferBuffer *buffer = SDL_CreateGPUTransferBuffer(device_, &info);
+    if (buffer == nullptr) {
+        Logger::error("gpu compositor:", SDL_GetError());
+        return invalid;
+    }
+    SDL_GPUCommandBuffer *cmd = SDL_AcquireGPUCommandBuffer(device_);
+    if (cmd == nullptr) {
+        Logger::error("gpu compositor:", SDL_GetError());
+        SDL_ReleaseGPUTransferBuffer(device_, buffer);
+        return invalid;
+    }
+    SDL_GPUCopyPass *copy = SDL_BeginGPUCopyPass(cmd);
+    {
+        SDL_GPUTextureRegion src = {};
+        src.texture = texture;
+        src.w = w;
+        src.h = h;
+        src.d = 1;
+        SDL_GPUTextureTransferInfo dst = {};
+        dst.transfer_buffer = buffer;
+        dst.pixels_per_row = w;
+        dst.rows_per_layer = h;
+        SDL_DownloadFromGPUTexture(copy, &src, &dst);
+    }
+    SDL_EndGPUCopyPass(copy);
+    SDL_GPUFence *fence = SDL_SubmitGPUCommandBufferAndAcquireFence(cmd);
+    if (fence == nullptr) {
+        Logger::error("gpu compositor:", SDL_GetError());
+        SDL_ReleaseGPUTransferBuffer(device_, buffer);
+        return invalid;
+    }
+    SDL_WaitForGPUFences(device_, true, &fence, 1);
+    SDL_ReleaseGPUFence(device_, fence);
+    auto *result = static_cast<unsigned char *>(SDL_MapGPUTransferBuffer(device_, buffer, false));
+    if (result == nullptr) {
+        SDL_ReleaseGPUTransferBuffer(device_, buffer);
+        return invalid;
+    }
+    auto surface = std::make_unique<WrapSurface>(w, h);
+    SDL_LockSurface(surface->surface());
+    auto *pixels = static_cast<unsigned char *>(surface->surface()->pixels);
+    for (int y = 0; y < h; y++) {
+        std::memcpy(pixels + y * surface->surface()->pitch, result + 4 * y * w, 4 * w);
+    }
+    SDL_UnlockSurface(surface->surface());
+    SDL_UnmapGPUTransferBuffer(device_, buffer);
+    SDL_ReleaseGPUTransferBuffer(device_, buffer);
+    return surface;
+}
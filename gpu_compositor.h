@@ -0,0 +1,66 @@
+#ifndef GPU_COMPOSITOR_H_
+#define GPU_COMPOSITOR_H_
+
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <SDL3/SDL_gpu.h>
+
+#include "compositor.h"
+
+// SDL GPUのコンピュートシェーダで全レイヤを1パスで合成する
+// 画像は倍率毎にGPUに置いたままにして、まだ置いていないものだけを転送する
+// 結果はGPUのテクスチャのまま渡し、形状に使うアルファだけを読み戻す
+// (GPUで拡縮するモードではこのアルファをワーカーで表示する大きさにする)
+class GPUCompositor : public Compositor {
+    private:
+        // pixels_に置いてある画像
+        struct Resident {
+            std::weak_ptr<const std::vector<unsigned char>> ref;
+            Uint32 offset;
+        };
+        // 使い終わった結果のテクスチャ
+        struct Target {
+            SDL_GPUTexture *texture;
+            int w, h;
+        };
+        SDL_GPUDevice *device_;
+        SDL_GPUComputePipeline *pipeline_;
+        // 画像を先頭から詰めて置き、溢れたら空にしてそのフレームの分から置き直す
+        SDL_GPUBuffer *pixels_;
+        Uint32 pixels_size_, pixels_used_;
+        std::unordered_map<ImagePath, std::map<int, Resident>> resident_;
+        // 大きさが足りなくなったら作り直す
+        SDL_GPUBuffer *layers_;
+        SDL_GPUBuffer *alpha_;
+        SDL_GPUTransferBuffer *upload_;
+        SDL_GPUTransferBuffer *download_;
+        Uint32 layers_size_, alpha_size_, upload_size_, download_size_;
+        // 結果は表示するスレッドで手放されるので鍵をかける
+        std::mutex mutex_;
+        std::vector<Target> free_;
+
+        GPUCompositor(SDL_GPUDevice *device, SDL_GPUComputePipeline *pipeline);
+        bool reservePixels(Uint32 size);
+        bool reserve(Uint32 layers_size, Uint32 alpha_size, Uint32 upload_size);
+        std::shared_ptr<SDL_GPUTexture> acquire(int w, int h);
+        void release(SDL_GPUTexture *texture, int w, int h);
+
+    public:
+        ~GPUCompositor();
+        // シェーダ(compositor.spv)は実行ファイルと同じ場所から読む
+        static std::unique_ptr<GPUCompositor> create(const std::filesystem::path &exe_dir);
+        // 結果のテクスチャは合成器より先に手放す
+        CompositeResult composite(const LayerList &list) override;
+        SDL_GPUDevice *device() override {
+            return device_;
+        }
+        // 結果のテクスチャを全て読み戻す(CPUCompositorとの比較用)
+        std::unique_ptr<WrapSurface> download(SDL_GPUTexture *texture, int w, int h);
+};
+
+#endif // GPU_COMPOSITOR_H_
@@ -1,17 +1,47 @@
 #include "image_cache.h"
 #include "misc.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 
 #include <SDL3_image/SDL_image.h>
 
 #include "logger.h"
+#include "metrics.h"
 #include "texture.h"
+#include "trace.h"
 
+namespace {
+    // 現在の倍率以外の画像とアニメーションのフレーム(追い出せるもの)に使える容量
+    const size_t kPyramidBudget = 256 * 1024 * 1024;
+
+    // アニメーションは要求されたフレームから先読みしておく枚数
+    const int kLookAhead = 4;
+    // アニメーション毎に保持するフレームの上限(原寸、拡縮後それぞれ)
+    const size_t kMaxResidentFrames = 16;
+
+    metrics::Counter &hits = metrics::counter("image_cache.hits");
+    metrics::Counter &misses = metrics::counter("image_cache.misses");
+    // 正確な倍率のものが出来るまで近い倍率で間に合わせた数
+    metrics::Counter &nearest_hits = metrics::counter("image_cache.nearest_hits");
+    metrics::Counter &evictions = metrics::counter("image_cache.evictions");
+    metrics::Gauge &resident_bytes = metrics::gauge("image_cache.resident_bytes");
+    // バックグラウンドの拡縮(ONNXでの拡大を含む)
+    metrics::Gauge &queue_depth = metrics::gauge("image_cache.queue_depth");
+    metrics::Histogram &queue_wait = metrics::histogram("image_cache.queue_wait_us");
+    metrics::Histogram &job_time = metrics::histogram("image_cache.job_us");
+    metrics::Histogram &upconvert_time = metrics::histogram("image_cache.upconvert_us");
+}
+
+ImageCache::ImageCache(const std::filesystem::path &exe_dir, bool use_self_alpha, bool serve_nearest, bool gpu_scaling, ResampleFilter filter)
+    : alive_(true), use_self_alpha_(use_self_alpha), use_upconverter_(false),
+    serve_nearest_(serve_nearest), gpu_scaling_(gpu_scaling), filter_(filter), scale_(100), resident_(0), evictable_(0)
+#if defined(USE_ONNX)
+    , session_(nullptr)
+#endif // USE_ONNX
+{
 #if defined(USE_ONNX)
-ImageCache::ImageCache(const std::filesystem::path &exe_dir, bool use_self_alpha)
-    : alive_(true), use_self_alpha_(use_self_alpha), scale_(100), session_(nullptr) {
     std::filesystem::path model_path = exe_dir / "model.onnx";
     try {
         Ort::SessionOptions session_options;
@@ -20,113 +50,294 @@ ImageCache::ImageCache(const std::filesystem::path &exe_dir, bool use_self_alpha
 #else
         session_ = {env_, model_path.string().c_str(), session_options};
 #endif // Windows
+        use_upconverter_ = true;
+    }
+    catch (Ort::Exception &e) {
+        Logger::warn(e.what());
+    }
+#endif // USE_ONNX
+    if (use_upconverter_ || serve_nearest_) {
         th_ = std::make_unique<std::thread>([&]() {
-            while (true) {
-                ImagePath p;
-                int scale;
-                {
-                    std::unique_lock<std::mutex> lock(mutex_);
-                    cond_.wait(lock, [&]() { return !queue_.empty(); });
-                    p = queue_.front();
-                    queue_.pop();
-                    scale = scale_;
-                }
-                int num_resize = std::ceil(std::log2(scale_ / 100.0));
-                auto &info = cache_orig_.at(p);
-                int w = info->width();
-                int h = info->height();
-                std::vector<unsigned char> src;
-                std::vector<unsigned char> dest = info->get();
-                for (int i = 0; i < num_resize; i++, w <<= 1, h <<= 1) {
-                    src = dest;
-                    dest.resize(src.size() * 4);
-                    std::array<int64_t, 4> input_shape = {4, 1, h, w};
-                    std::array<int64_t, 4> output_shape = {4, 1, 2 * h, 2 * w};
-                    std::vector<float> input;
-                    input.resize(src.size());
-                    std::vector<float> output;
-                    output.resize(dest.size());
-                    for (int i = 0; i < w * h; i++) {
-                        for (int c = 0; c < 4; c++) {
-                            input[c * w * h + i] = src[4 * i + c] / 255.0;
-                        }
-                    }
-                    auto mem_info = Ort::MemoryInfo::CreateCpu(OrtDeviceAllocator, OrtMemTypeCPU);
-                    Ort::Value input_tensor = Ort::Value::CreateTensor<float>(mem_info, input.data(), input.size(), input_shape.data(), input_shape.size());
-                    Ort::Value output_tensor = Ort::Value::CreateTensor<float>(mem_info, output.data(), output.size(), output_shape.data(), output_shape.size());
-                    const char *input_names[] = {"input"};
-                    const char *output_names[] = {"output"};
-                    Ort::RunOptions run_options;
-                    try {
-                        session_.Run(run_options, input_names, &input_tensor, 1, output_names, &output_tensor, 1);
-                    }
-                    catch (Ort::Exception &e) {
-                        Logger::log(e.what());
-                        auto &tmp = cache_.at(p);
-                        cache_[p] = {tmp->get(), tmp->width(), tmp->height(), true};
-                    }
-                    for (int i = 0; i < (2 * w) * (2 * h); i++) {
-                        for (int c = 0; c < 4; c++) {
-                            int byte = std::round(output[c * (2 * w) * (2 * h) + i] * 255);
-                            dest[4 * i + c] = std::max(0, std::min(255, byte));
-                        }
-                    }
-                }
-                if (info->width() * scale_ / 100.0 != w) {
-                    int w_resize = std::round(info->width() * scale_ / 100.0);
-                    int h_resize = std::round(info->height() * scale_ / 100.0);
-                    std::vector<unsigned char> resize;
-                    resize.resize(w_resize * h_resize * 4);
+            run();
+        });
+    }
+}
 
-                    SDL_Surface *in = SDL_CreateSurfaceFrom(w, h, SDL_PIXELFORMAT_ABGR8888, dest.data(), w * 4);
-                    SDL_Surface *out = SDL_CreateSurface(w_resize, h_resize, SDL_PIXELFORMAT_ABGR8888);
-                    SDL_ClearSurface(out, 0, 0, 0, 0);
-                    SDL_BlitSurfaceScaled(in, nullptr, out, nullptr, SDL_SCALEMODE_LINEAR);
-                    SDL_LockSurface(out);
-                    memcpy(resize.data(), out->pixels, sizeof(unsigned char) * w_resize * h_resize * 4);
-                    SDL_UnlockSurface(out);
-                    SDL_DestroySurface(in);
-                    SDL_DestroySurface(out);
+ImageCache::~ImageCache() {
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        alive_ = false;
+    }
+    cond_.notify_one();
+    if (th_) {
+        th_->join();
+    }
+}
 
-                    dest = resize;
-                    w = w_resize;
-                    h = h_resize;
-                }
-                {
-                    std::unique_lock<std::mutex> lock(mutex_);
-                    if (scale == scale_) {
-                        cache_[p] = {dest, w, h, true};
-                    }
-                }
+void ImageCache::run() {
+    while (true) {
+        ScaledImagePath p;
+        std::optional<ImageInfo> orig;
+        std::chrono::steady_clock::time_point begin;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cond_.wait(lock, [&]() { return !queue_.empty() || !alive_; });
+            if (!alive_) {
+                break;
+            }
+            p = queue_.front().path;
+            begin = std::chrono::steady_clock::now();
+            queue_wait.record(begin - queue_.front().queued);
+            queue_.pop();
+            queue_depth.set(queue_.size());
+            if (cache_orig_.contains(p.path)) {
+                orig = cache_orig_.at(p.path);
+            }
+        }
+        // アニメーションのフレームは既に破棄されていることがある
+        if (!orig) {
+            orig = getOriginal(p.path.path, p.path.index);
+        }
+        std::optional<ImageInfo> info;
+        if (orig) {
+#if defined(USE_ONNX)
+            if (use_upconverter_ && p.scale > 100) {
+                metrics::Timer timer(upconvert_time);
+                info = upconvert(orig.value(), p.scale);
                 Logger::log("upconverted!");
             }
-        });
+#endif // USE_ONNX
+            if (!info) {
+                info = resize(orig.value(), p.scale, true);
+            }
+        }
+        std::function<void()> listener;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            pending_.erase(p);
+            if (info) {
+                store(p.path, p.scale, info);
+                listener = listener_;
+            }
+        }
+        job_time.record(std::chrono::steady_clock::now() - begin);
+        if (listener) {
+            listener();
+        }
     }
-    catch (Ort::Exception &e) {
-        Logger::log(e.what());
+}
+
+void ImageCache::setListener(std::function<void()> listener) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    listener_ = listener;
+}
+
+#if defined(USE_ONNX)
+std::optional<ImageInfo> ImageCache::upconvert(ImageInfo &info, int scale) {
+    TRACE_ZONE("ImageCache::upconvert");
+    int num_resize = std::ceil(std::log2(scale / 100.0));
+    int w = info.width();
+    int h = info.height();
+    std::vector<unsigned char> src;
+    std::vector<unsigned char> dest = info.get();
+    for (int i = 0; i < num_resize; i++, w <<= 1, h <<= 1) {
+        src = dest;
+        dest.resize(src.size() * 4);
+        std::array<int64_t, 4> input_shape = {4, 1, h, w};
+        std::array<int64_t, 4> output_shape = {4, 1, 2 * h, 2 * w};
+        std::vector<float> input;
+        input.resize(src.size());
+        std::vector<float> output;
+        output.resize(dest.size());
+        for (int i = 0; i < w * h; i++) {
+            for (int c = 0; c < 4; c++) {
+                input[c * w * h + i] = src[4 * i + c] / 255.0;
+            }
+        }
+        auto mem_info = Ort::MemoryInfo::CreateCpu(OrtDeviceAllocator, OrtMemTypeCPU);
+        Ort::Value input_tensor = Ort::Value::CreateTensor<float>(mem_info, input.data(), input.size(), input_shape.data(), input_shape.size());
+        Ort::Value output_tensor = Ort::Value::CreateTensor<float>(mem_info, output.data(), output.size(), output_shape.data(), output_shape.size());
+        const char *input_names[] = {"input"};
+        const char *output_names[] = {"output"};
+        Ort::RunOptions run_options;
+        try {
+            session_.Run(run_options, input_names, &input_tensor, 1, output_names, &output_tensor, 1);
+        }
+        catch (Ort::Exception &e) {
+            Logger::error(e.what());
+            return std::nullopt;
+        }
+        for (int i = 0; i < (2 * w) * (2 * h); i++) {
+            for (int c = 0; c < 4; c++) {
+                int byte = std::round(output[c * (2 * w) * (2 * h) + i] * 255);
+                dest[4 * i + c] = std::max(0, std::min(255, byte));
+            }
+        }
     }
+    ImageInfo upconverted(dest, w, h, true, 100 * (1 << num_resize));
+    if (info.width() * scale / 100.0 != w) {
+        return resize(upconverted, scale, true);
+    }
+    return ImageInfo(dest, w, h, true, scale);
 }
 #endif // USE_ONNX
 
-ImageCache::~ImageCache() {
-    alive_ = false;
-    if (th_) {
-        {
-            std::unique_lock<std::mutex> lock(mutex_);
-            queue_.push({"", std::nullopt});
-            cond_.notify_one();
+ImageInfo ImageCache::resize(ImageInfo &info, int scale, bool is_upconverted) {
+    int w = std::round(info.width() * scale / static_cast<double>(info.scale()));
+    int h = std::round(info.height() * scale / static_cast<double>(info.scale()));
+    auto resize = resampler::resize(info.get().data(), info.width(), info.height(), w, h, filter_, true);
+    return ImageInfo(std::move(resize), w, h, is_upconverted, scale);
+}
+
+ImageCache::ScaledImage *ImageCache::find(const ImagePath &key, int scale) {
+    if (!cache_.contains(key)) {
+        return nullptr;
+    }
+    auto &pyramid = cache_.at(key);
+    if (!pyramid.contains(scale)) {
+        return nullptr;
+    }
+    auto &entry = pyramid.at(scale);
+    lru_.splice(lru_.begin(), lru_, entry.lru);
+    return &entry;
+}
+
+void ImageCache::store(const ImagePath &key, int scale, const std::optional<ImageInfo> &info) {
+    if (key.index.has_value() && !cache_.contains(key)) {
+        auto &frames = scaled_frames_[key.path];
+        frames.push_back(*key.index);
+        while (frames.size() > kMaxResidentFrames) {
+            drop({key.path, frames.front()});
         }
-        th_->join();
+    }
+    auto &pyramid = cache_[key];
+    if (pyramid.contains(scale)) {
+        auto &entry = pyramid.at(scale);
+        account(key, scale, entry.info, false);
+        entry.info = info;
+        lru_.splice(lru_.begin(), lru_, entry.lru);
+    }
+    else {
+        lru_.push_front({key, scale});
+        pyramid.emplace(scale, ScaledImage{info, lru_.begin()});
+    }
+    account(key, scale, info, true);
+    evict();
+}
+
+void ImageCache::enqueue(const ImagePath &key, int scale) {
+    ScaledImagePath p = {key, scale};
+    if (pending_.contains(p)) {
+        return;
+    }
+    pending_.emplace(p);
+    queue_.push({p, std::chrono::steady_clock::now()});
+    queue_depth.set(queue_.size());
+    cond_.notify_one();
+}
+
+bool ImageCache::isEvictable(const ImagePath &key, int scale) const {
+    // 現在の倍率の画像は追い出さない
+    // アニメーションのフレームは再デコードできるので追い出してよい
+    return scale != scale_ || key.index.has_value();
+}
+
+void ImageCache::account(const ImagePath &key, int scale, const std::optional<ImageInfo> &info, bool add) {
+    if (!info) {
+        return;
+    }
+    size_t bytes = info->bytes();
+    if (add) {
+        resident_ += bytes;
+    }
+    else {
+        resident_ -= bytes;
+    }
+    if (!isEvictable(key, scale)) {
+        return;
+    }
+    if (add) {
+        evictable_ += bytes;
+    }
+    else {
+        evictable_ -= bytes;
+    }
+}
+
+void ImageCache::evict() {
+    auto it = lru_.end();
+    while (evictable_ > kPyramidBudget && it != lru_.begin()) {
+        --it;
+        if (!isEvictable(it->path, it->scale)) {
+            continue;
+        }
+        auto &pyramid = cache_.at(it->path);
+        auto &entry = pyramid.at(it->scale);
+        account(it->path, it->scale, entry.info, false);
+        pyramid.erase(it->scale);
+        if (pyramid.empty()) {
+            forget(it->path);
+            cache_.erase(it->path);
+        }
+        it = lru_.erase(it);
+        evictions.add();
+    }
+    resident_bytes.set(resident_);
+}
+
+void ImageCache::drop(const ImagePath &key) {
+    forget(key);
+    if (!cache_.contains(key)) {
+        return;
+    }
+    for (auto &[scale, entry] : cache_.at(key)) {
+        account(key, scale, entry.info, false);
+        lru_.erase(entry.lru);
+        evictions.add();
+    }
+    cache_.erase(key);
+    resident_bytes.set(resident_);
+}
+
+void ImageCache::forget(const ImagePath &key) {
+    if (!key.index.has_value() || !scaled_frames_.contains(key.path)) {
+        return;
+    }
+    auto &frames = scaled_frames_.at(key.path);
+    auto it = std::find(frames.begin(), frames.end(), *key.index);
+    if (it != frames.end()) {
+        frames.erase(it);
+    }
+    if (frames.empty()) {
+        scaled_frames_.erase(key.path);
     }
 }
 
 void ImageCache::setScale(int scale) {
+    if (useGPUScaling()) {
+        return;
+    }
     std::unique_lock<std::mutex> lock(mutex_);
     scale_ = scale;
-    cache_.clear();
+    // 倍率が変わると追い出せるものも変わるので数え直す
+    evictable_ = 0;
+    for (auto &[key, pyramid] : cache_) {
+        for (auto &[s, entry] : pyramid) {
+            if (entry.info && isEvictable(key, s)) {
+                evictable_ += entry.info->bytes();
+            }
+        }
+    }
+    evict();
+}
+
+int ImageCache::scale() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    return scale_;
 }
 
 std::optional<ImageInfo> ImageCache::load(const ImagePath &path, SDL_Surface *in) {
+    TRACE_ZONE("ImageCache::load");
     SDL_Surface *abgr = SDL_ConvertSurface(in, SDL_PIXELFORMAT_ABGR8888);
     int w = abgr->w, h = abgr->h;
     std::vector<unsigned char> data;
@@ -180,151 +391,182 @@ std::optional<ImageInfo> ImageCache::load(const ImagePath &path, SDL_Surface *in
             }
         }
     }
-    // そのままだとalphaが0とそうでない部分の境界で
-    // alpha-blendがうまくいかなくなるので
-    // alpha>0なピクセルの値をalpha=0なピクセルに伝播させる
-    {
-        std::vector<unsigned char> blurred;
-        blurred.resize(data.size());
-        const int blur[3][3] = {
-            {1, 2, 1},
-            {2, 4, 2},
-            {1, 2, 1},
-        };
-        auto in = [](int x, int y, int w, int h) {
-            if (x < 0) {
-                return false;
-            }
-            if (y < 0) {
-                return false;
-            }
-            if (x >= w) {
-                return false;
-            }
-            if (y >= h) {
-                return false;
-            }
-            return true;
-        };
-        for (int y = 0; y < h; y++) {
-            for (int x = 0; x < w; x++) {
-                double n = 0.0;
-                int sum[4] = {};
-                for (int j = -1; j <= 1; j++) {
-                    for (int i = -1; i <= 1; i++) {
-                        if (in(x + i, y + j, w, h)) {
-                            int index = 4 * ((y + j) * w + (x + i));
-                            // alpha>0なピクセルを伝播させるため
-                            // alpha=0なら無視する
-                            if (data[index + 3] == 0) {
-                                continue;
-                            }
-                            auto factor = blur[1 + j][1 + i];
-                            n += factor;
-                            sum[0] += data[index + 0] * factor;
-                            sum[1] += data[index + 1] * factor;
-                            sum[2] += data[index + 2] * factor;
-                            sum[3] += data[index + 3] * factor;
-                        }
-                    }
-                }
-                int index = 4 * (y * w + x);
-                blurred[index + 0] = std::min(255.0, std::ceil(sum[0] / n));
-                blurred[index + 1] = std::min(255.0, std::ceil(sum[1] / n));
-                blurred[index + 2] = std::min(255.0, std::ceil(sum[2] / n));
-                blurred[index + 3] = std::min(255.0, std::ceil(sum[3] / n));
-            }
-        }
-        for (int i = 0; i < w * h; i++) {
-            // alpha以外を伝播
-            if (blurred[4 * i + 3] > 0 && data[4 * i + 3] == 0) {
-                data[4 * i + 0] = blurred[4 * i + 0];
-                data[4 * i + 1] = blurred[4 * i + 1];
-                data[4 * i + 2] = blurred[4 * i + 2];
-            }
+    // 乗算済みアルファにしておく
+    // 合成や拡縮で透明部分の色が滲み出さなくなる
+    for (int i = 0; i < w * h; i++) {
+        int alpha = data[4 * i + 3];
+        for (int c = 0; c < 3; c++) {
+            data[4 * i + c] = (data[4 * i + c] * alpha + 127) / 255;
         }
     }
     return std::make_optional<ImageInfo>(data, w, h, true);
 }
 
-std::optional<ImageInfo> &ImageCache::getOriginal(const std::filesystem::path &path, const std::optional<int> &index) {
-    Logger::log("scale => ", scale_);
-    Logger::log("file: ", path.string());
+std::optional<ImageInfo> ImageCache::getOriginal(const std::filesystem::path &path, const std::optional<int> &index) {
     ImagePath key = {path, index};
-    if (cache_orig_.contains(key)) {
-        return cache_orig_.at(key);
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (cache_orig_.contains(key)) {
+            return cache_orig_.at(key);
+        }
     }
+    Logger::log("scale => ", scale_);
+    Logger::log("file: ", path.string());
     if (index.has_value()) {
-        Logger::log("load animation!", path);
-        IMG_Animation *anim = IMG_LoadAnimation(path.string().c_str());
-        if (anim == nullptr) {
-            cache_orig_[key] = std::nullopt;
-        }
-        else {
-            for (int i = 0; i < anim->count; i++) {
-                ImagePath k = {path, i};
-                cache_orig_[k] = load(k, anim->frames[i]);
-            }
-            IMG_FreeAnimation(anim);
-        }
+        return loadFrames(path, index.value());
     }
     else {
         SDL_Surface *in = IMG_Load(path.string().c_str());
-        if (in == nullptr) {
-            cache_orig_[key] = std::nullopt;
-        }
-        else {
-            cache_orig_[key] = load(key, in);
+        std::optional<ImageInfo> info;
+        if (in != nullptr) {
+            info = load(key, in);
             SDL_DestroySurface(in);
         }
+        std::unique_lock<std::mutex> lock(mutex_);
+        cache_orig_[key] = info;
+    }
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!cache_orig_.contains(key)) {
+        cache_orig_[key] = std::nullopt;
     }
     return cache_orig_.at(key);
 }
 
-std::optional<ImageInfo> &ImageCache::get(const std::filesystem::path &path, const std::optional<int> index) {
-    ImagePath key = {path, index};
+std::optional<ImageInfo> ImageCache::loadFrames(const std::filesystem::path &path, int index) {
+    std::unique_lock<std::mutex> animation_lock(animation_mutex_);
     {
         std::unique_lock<std::mutex> lock(mutex_);
-        if (cache_.contains(key)) {
-            return cache_.at(key);
+        if (cache_orig_.contains({path, index})) {
+            return cache_orig_.at({path, index});
         }
     }
-    auto &info = getOriginal(path, index);
-    if (info == std::nullopt || scale_ == 100) {
-        cache_[key] = info;
-        return cache_.at(key);
+    Logger::log("load animation!", path, index);
+    auto &frames = animations_[path];
+    if (!frames.source) {
+        frames.source = std::make_unique<AnimationSource>(path);
+    }
+    std::vector<std::pair<int, std::optional<ImageInfo>>> decoded;
+    frames.source->decode(index, kLookAhead, [&](int i, SDL_Surface *frame) {
+        if (std::find(frames.resident.begin(), frames.resident.end(), i) != frames.resident.end()) {
+            return;
+        }
+        decoded.emplace_back(i, load({path, i}, frame));
+    });
+    // デコードできなかったフレームも失敗として覚えておく
+    std::optional<ImageInfo> result;
+    if (decoded.empty() || decoded.front().first != index) {
+        decoded.emplace(decoded.begin(), index, std::nullopt);
+    }
+    result = decoded.front().second;
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (auto &[i, info] : decoded) {
+        cache_orig_[{path, i}] = info;
+        frames.resident.push_back(i);
+    }
+    while (frames.resident.size() > kMaxResidentFrames) {
+        // 拡縮したものも一緒に手放す
+        cache_orig_.erase({path, frames.resident.front()});
+        drop({path, frames.resident.front()});
+        frames.resident.pop_front();
     }
-    int w = std::round(info->width() * scale_ / 100.0);
-    int h = std::round(info->height() * scale_ / 100.0);
-    std::vector<unsigned char> resize;
-    resize.resize(w * h * 4);
+    return result;
+}
 
-    SDL_Surface *in = SDL_CreateSurfaceFrom(info->width(), info->height(), SDL_PIXELFORMAT_ABGR8888, info->get().data(), info->width() * 4);
-    SDL_Surface *out = SDL_CreateSurface(w, h, SDL_PIXELFORMAT_ABGR8888);
-    SDL_ClearSurface(out, 0, 0, 0, 0);
-    SDL_BlitSurfaceScaled(in, nullptr, out, nullptr, SDL_SCALEMODE_LINEAR);
-    SDL_LockSurface(out);
-    memcpy(resize.data(), out->pixels, sizeof(unsigned char) * w * h * 4);
-    SDL_UnlockSurface(out);
-    SDL_DestroySurface(in);
-    SDL_DestroySurface(out);
+std::optional<ImageInfo> ImageCache::get(const std::filesystem::path &path, const std::optional<int> index) {
+    TRACE_ZONE("ImageCache::get");
+    ImagePath key = {path, index};
+    int scale;
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        scale = scale_;
+        auto *entry = find(key, scale);
+        if (entry != nullptr) {
+            hits.add();
+            return entry->info;
+        }
+    }
+    misses.add();
+    auto info = getOriginal(path, index);
+    if (info == std::nullopt || scale == 100) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        store(key, scale, info);
+        return info;
+    }
+    bool is_upconverted = (scale <= 100 || !use_upconverter_);
+    auto resized = resize(info.value(), scale, is_upconverted);
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        store(key, scale, resized);
+        if (!is_upconverted) {
+            enqueue(key, scale);
+        }
+    }
+    return resized;
+}
 
-    if (scale_ <= 100 || !th_) {
-        cache_[key] = {resize, w, h, true};
+std::optional<ImageInfo> ImageCache::getNearest(const std::filesystem::path &path, const std::optional<int> index) {
+    if (!serve_nearest_) {
+        return get(path, index);
     }
-    else {
-        cache_[key] = {resize, w, h, false};
-        {
-            std::unique_lock<std::mutex> lock(mutex_);
-            queue_.push(key);
+    ImagePath key = {path, index};
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto *entry = find(key, scale_);
+        if (entry != nullptr) {
+            hits.add();
+            return entry->info;
+        }
+        // 倍率の比が1に近いものを選ぶ
+        std::optional<ImageInfo> nearest;
+        double distance = 0;
+        auto choose = [&](const std::optional<ImageInfo> &info) {
+            if (!info) {
+                return;
+            }
+            double d = std::abs(std::log(info->scale() / static_cast<double>(scale_)));
+            if (!nearest || d < distance) {
+                nearest = info;
+                distance = d;
+            }
+        };
+        if (cache_.contains(key)) {
+            for (auto &[_, v] : cache_.at(key)) {
+                choose(v.info);
+            }
+        }
+        if (cache_orig_.contains(key)) {
+            choose(cache_orig_.at(key));
+        }
+        if (nearest) {
+            // 正確な倍率のものはバックグラウンドで作る
+            enqueue(key, scale_);
+            nearest_hits.add();
+            nearest->setUpconverted(false);
+            return nearest;
         }
-        cond_.notify_one();
     }
+    return get(path, index);
+}
 
-    return cache_.at(key);
+bool ImageCache::contains(const std::filesystem::path &path, const std::optional<int> index) {
+    ImagePath key = {path, index};
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (find(key, scale_) != nullptr) {
+        return true;
+    }
+    // 近い倍率で間に合わせる場合は何かあればよい
+    return serve_nearest_ && cache_.contains(key);
 }
 
 void ImageCache::clearCache() {
+    std::unique_lock<std::mutex> animation_lock(animation_mutex_);
+    animations_.clear();
+    std::unique_lock<std::mutex> lock(mutex_);
     cache_.clear();
     cache_orig_.clear();
+    lru_.clear();
+    scaled_frames_.clear();
+    resident_ = 0;
+    evictable_ = 0;
+    resident_bytes.set(0);
 }
@@ -1,20 +1,31 @@
 #ifndef IMAGE_CACHE_H_
 #define IMAGE_CACHE_H_
 
+#include <chrono>
 #include <condition_variable>
+#include <deque>
 #include <filesystem>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
 #include <mutex>
 #if defined(USE_ONNX)
 #include <onnxruntime_cxx_api.h>
 #endif // USE_ONNX
 #include <optional>
 #include <queue>
+#include <thread>
 #include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
 #include <SDL3/SDL_surface.h>
 
+#include "animation_source.h"
+#include "resampler.h"
+
 struct ImagePath {
     std::filesystem::path path;
     std::optional<int> index;
@@ -34,16 +45,36 @@ struct std::hash<ImagePath> {
     }
 };
 
+struct ScaledImagePath {
+    ImagePath path;
+    int scale;
+    bool operator==(const ScaledImagePath &rhs) const {
+        return path == rhs.path && scale == rhs.scale;
+    }
+};
+
+template<>
+struct std::hash<ScaledImagePath> {
+    size_t operator ()(const ScaledImagePath &p) const {
+        return std::hash<ImagePath>()(p.path) ^ (std::hash<int>()(p.scale) << 1);
+    }
+};
+
 class ImageInfo {
     private:
-        std::vector<unsigned char> data_;
+        // 倍率違いのキャッシュ間で共有するのでshared_ptrで持つ
+        std::shared_ptr<std::vector<unsigned char>> data_;
         int width_, height_;
         bool is_upconverted_;
+        int scale_;
     public:
-        ImageInfo(const std::vector<unsigned char> &data, int width, int height, bool is_upconverted) : data_(data), width_(width), height_(height), is_upconverted_(is_upconverted) {}
+        ImageInfo(std::vector<unsigned char> data, int width, int height, bool is_upconverted, int scale = 100) : data_(std::make_shared<std::vector<unsigned char>>(std::move(data))), width_(width), height_(height), is_upconverted_(is_upconverted), scale_(scale) {}
         ~ImageInfo() {}
         std::vector<unsigned char> &get() {
-            return data_;
+            return *data_;
+        }
+        const std::vector<unsigned char> &get() const {
+            return *data_;
         }
         int width() const {
             return width_;
@@ -51,40 +82,105 @@ class ImageInfo {
         int height() const {
             return height_;
         }
+        size_t bytes() const {
+            return data_->size();
+        }
+        // 同じ画素かどうかの判定に使う(弱参照を持っている間は別の画像と取り違えない)
+        std::weak_ptr<const std::vector<unsigned char>> ref() const {
+            return data_;
+        }
         bool isUpconverted() const {
             return is_upconverted_;
         }
+        void setUpconverted(bool is_upconverted) {
+            is_upconverted_ = is_upconverted;
+        }
+        int scale() const {
+            return scale_;
+        }
 };
 
 class ImageCache {
     private:
+        struct ScaledImage {
+            std::optional<ImageInfo> info;
+            std::list<ScaledImagePath>::iterator lru;
+        };
+
+        // バックグラウンドで作る画像
+        struct Job {
+            ScaledImagePath path;
+            std::chrono::steady_clock::time_point queued;
+        };
+
+        struct AnimationFrames {
+            std::unique_ptr<AnimationSource> source;
+            // cache_orig_に置いているフレーム(古い順)
+            std::deque<int> resident;
+        };
+
         bool alive_;
         bool use_self_alpha_;
+        bool use_upconverter_;
+        bool serve_nearest_;
+        bool gpu_scaling_;
+        ResampleFilter filter_;
         int scale_;
+        size_t resident_;
+        // resident_のうち追い出せるもの(現在の倍率以外とアニメーションのフレーム)
+        size_t evictable_;
         std::mutex mutex_;
         std::condition_variable cond_;
         std::unique_ptr<std::thread> th_;
-        std::queue<ImagePath> queue_;
+        std::queue<Job> queue_;
+        std::unordered_set<ScaledImagePath> pending_;
         std::unordered_map<ImagePath, std::optional<ImageInfo>> cache_orig_;
-        std::unordered_map<ImagePath, std::optional<ImageInfo>> cache_;
+        // 画像毎の倍率ピラミッド
+        std::unordered_map<ImagePath, std::map<int, ScaledImage>> cache_;
+        std::list<ScaledImagePath> lru_;
+        // cache_に置いているアニメーションのフレーム(古い順)
+        std::unordered_map<std::filesystem::path, std::deque<int>> scaled_frames_;
+        // デコーダはフレーム順に進むので1つずつしか使えない
+        std::mutex animation_mutex_;
+        std::unordered_map<std::filesystem::path, AnimationFrames> animations_;
+        // バックグラウンドで画像が出来た時に呼ぶ
+        std::function<void()> listener_;
 #if defined(USE_ONNX)
         Ort::Env env_;
         Ort::Session session_;
 #endif // USE_ONNX
 
+        void run();
         std::optional<ImageInfo> load(const ImagePath &p, SDL_Surface *in);
-        std::optional<ImageInfo> &getOriginal(const std::filesystem::path &path, const std::optional<int> &index);
-
-    public:
+        std::optional<ImageInfo> getOriginal(const std::filesystem::path &path, const std::optional<int> &index);
+        std::optional<ImageInfo> loadFrames(const std::filesystem::path &path, int index);
+        ImageInfo resize(ImageInfo &info, int scale, bool is_upconverted);
 #if defined(USE_ONNX)
-        ImageCache(const std::filesystem::path &exe_dir, bool use_self_alpha);
-#else
-        ImageCache(const std::filesystem::path &exe_dir, bool use_self_alpha)
-        : alive_(true), use_self_alpha_(use_self_alpha), scale_(100) {}
+        std::optional<ImageInfo> upconvert(ImageInfo &info, int scale);
 #endif // USE_ONNX
+        ScaledImage *find(const ImagePath &key, int scale);
+        void store(const ImagePath &key, int scale, const std::optional<ImageInfo> &info);
+        void enqueue(const ImagePath &key, int scale);
+        void evict();
+        bool isEvictable(const ImagePath &key, int scale) const;
+        void account(const ImagePath &key, int scale, const std::optional<ImageInfo> &info, bool add);
+        void drop(const ImagePath &key);
+        void forget(const ImagePath &key);
+
+    public:
+        ImageCache(const std::filesystem::path &exe_dir, bool use_self_alpha, bool serve_nearest, bool gpu_scaling, ResampleFilter filter);
         ~ImageCache();
+        void setListener(std::function<void()> listener);
         void setScale(int scale);
-        std::optional<ImageInfo> &get(const std::filesystem::path &path, const std::optional<int> index = std::nullopt);
+        int scale();
+        // 画像は原寸のまま返し、拡縮は描画時にGPUで行う
+        bool useGPUScaling() const {
+            return gpu_scaling_ && !use_upconverter_;
+        }
+        std::optional<ImageInfo> get(const std::filesystem::path &path, const std::optional<int> index = std::nullopt);
+        std::optional<ImageInfo> getNearest(const std::filesystem::path &path, const std::optional<int> index = std::nullopt);
+        // 読み込み済みならtrue(読み込みはしない)
+        bool contains(const std::filesystem::path &path, const std::optional<int> index = std::nullopt);
         void clearCache();
 };
 
@@ -1,66 +1,184 @@
 #ifndef SSTP_HEADER_H_
 #define SSTP_HEADER_H_
 
-#include <algorithm>
-#include <sstream>
+#include <cctype>
+#include <charconv>
 #include <string>
-#include <unordered_map>
+#include <string_view>
+#include <utility>
+#include <vector>
 
 #include "base/optional.h"
 
 namespace base {
 
+// 改行までの1行を取り出してviewを進める(末尾の\rは除く)
+inline std::string_view getline(std::string_view &view) {
+    auto pos = view.find('\x0a');
+    std::string_view line = view.substr(0, pos);
+    view = (pos == std::string_view::npos) ? (std::string_view()) : (view.substr(pos + 1));
+    if (!line.empty() && line.back() == '\x0d') {
+        line.remove_suffix(1);
+    }
+    return line;
+}
+
+// "<name>/<数字>.<数字>"であるか
+inline bool isProtocol(std::string_view s, std::string_view name) {
+    if (s.size() <= name.size() + 1 || s.substr(0, name.size()) != name || s[name.size()] != '/') {
+        return false;
+    }
+    s.remove_prefix(name.size() + 1);
+    auto dot = s.find('.');
+    if (dot == 0 || dot == std::string_view::npos || dot + 1 == s.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < s.size(); i++) {
+        if (i != dot && !std::isdigit(static_cast<unsigned char>(s[i]))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// ヘッダは数が少ないのでmapではなく配列で持つ
+// Reference0..Nの様な番号付きの引数は番号で引ける別の配列に入れる
 class Header {
     public:
-        Header() {}
+        Header(std::string_view arg) : arg_(arg) {}
 
         ~Header() {}
 
-        static Header parse(std::string str) {
-            auto result = std::remove_if(str.begin(), str.end(),
-                    [](int ch) {return ch == '\x0d';}
-            );
-            str.erase(result, str.end());
-            std::istringstream iss(str);
-            return parse(iss);
-        }
-
-        static Header parse(std::istringstream& iss) {
-            Header tmp;
-            std::string header;
-            while (std::getline(iss, header, '\x0a') && !header.empty()) {
-                decltype(header)::size_type pos    = header.find(':');
-                if (pos == decltype(header)::npos) {
+        // 空行か終端まで読む
+        static Header parse(std::string_view &view, std::string_view arg) {
+            Header tmp(arg);
+            while (!view.empty()) {
+                auto line = getline(view);
+                if (line.empty()) {
+                    break;
+                }
+                auto pos = line.find(':');
+                if (pos == std::string_view::npos) {
                     continue;
                 }
-                std::string key = header.substr(0, pos);
-                std::string value = header.substr(pos + 2);
-                tmp[key] = value;
+                auto value = line.substr(pos + 1);
+                if (!value.empty() && value.front() == ' ') {
+                    value.remove_prefix(1);
+                }
+                tmp[line.substr(0, pos)] = std::string(value);
             }
             return tmp;
         }
 
-        inline void remove(const std::string& key) {
-            map_.erase(key);
+        inline void remove(std::string_view key) {
+            if (auto index = toIndex(key)) {
+                if (index.value() < args_.size()) {
+                    args_[index.value()].reset();
+                }
+                return;
+            }
+            for (auto it = entries_.begin(); it != entries_.end(); it++) {
+                if (it->first == key) {
+                    entries_.erase(it);
+                    return;
+                }
+            }
         }
 
-        inline optional& operator[](const std::string& key) { return map_[key]; }
-        operator std::string() const {
-            std::ostringstream oss;
-            auto h = map_;
+        inline optional& operator[](std::string_view key) {
+            if (auto index = toIndex(key)) {
+                return arg(index.value());
+            }
+            for (auto &[k, v] : entries_) {
+                if (k == key) {
+                    return v;
+                }
+            }
+            entries_.emplace_back(std::string(key), optional());
+            return entries_.back().second;
+        }
+
+        inline optional& arg(size_t index) {
+            if (index >= args_.size()) {
+                args_.resize(index + 1);
+            }
+            return args_[index];
+        }
+
+        // outの末尾に書き出す
+        void serialize(std::string &out) const {
             // Charsetは他のヘッダより優先する
-            if (h["Charset"]) {
-                oss << "Charset: " << h["Charset"].value() << "\x0d\x0a";
+            for (auto &[k, v] : entries_) {
+                if (k == "Charset" && v) {
+                    append(out, k, v.value());
+                }
             }
-            for (auto& [k, v] : h) {
+            for (auto &[k, v] : entries_) {
                 if (k != "Charset" && v) {
-                    oss << k << ": " << v.value() << "\x0d\x0a";
+                    append(out, k, v.value());
+                }
+            }
+            char digits[24];
+            for (size_t i = 0; i < args_.size(); i++) {
+                if (!args_[i]) {
+                    continue;
                 }
+                auto [end, _] = std::to_chars(digits, digits + sizeof(digits), i);
+                out.append(arg_);
+                out.append(digits, end);
+                out.append(": ");
+                out.append(args_[i].value());
+                out.append("\x0d\x0a");
             }
-            return oss.str();
         }
+
+        // 書き出した時のおおよその大きさ
+        size_t size() const {
+            size_t n = 0;
+            for (auto &[k, v] : entries_) {
+                n += k.size() + ((v) ? (v->size()) : (0)) + 4;
+            }
+            for (auto &v : args_) {
+                n += arg_.size() + ((v) ? (v->size()) : (0)) + 8;
+            }
+            return n;
+        }
+
+        operator std::string() const {
+            std::string out;
+            out.reserve(size());
+            serialize(out);
+            return out;
+        }
+
     private:
-        std::unordered_map<std::string, optional> map_;
+        static constexpr size_t kMaxArgs = 256;
+
+        std::string_view arg_;
+        std::vector<std::pair<std::string, optional>> entries_;
+        std::vector<optional> args_;
+
+        // "<arg><番号>"なら番号を返す
+        std::optional<size_t> toIndex(std::string_view key) const {
+            if (key.size() <= arg_.size() || key.substr(0, arg_.size()) != arg_) {
+                return std::nullopt;
+            }
+            key.remove_prefix(arg_.size());
+            size_t index = 0;
+            auto [ptr, ec] = std::from_chars(key.data(), key.data() + key.size(), index);
+            // 大きすぎる番号は普通のヘッダとして扱う
+            if (ec != std::errc() || ptr != key.data() + key.size() || index >= kMaxArgs) {
+                return std::nullopt;
+            }
+            return index;
+        }
+
+        static void append(std::string &out, std::string_view key, std::string_view value) {
+            out.append(key);
+            out.append(": ");
+            out.append(value);
+            out.append("\x0d\x0a");
+        }
 };
 
 }
@@ -1,9 +1,8 @@
 #ifndef SSTP_REQUEST_H_
 #define SSTP_REQUEST_H_
 
-#include <regex>
-#include <sstream>
 #include <string>
+#include <string_view>
 
 #include "base/header.h"
 
@@ -12,56 +11,49 @@ namespace base {
     template<const char *protocol_name, const char *protocol_version, const char *value, const char *arg>
         class Request {
             public:
-                Request(std::string command) : command_(command), protocol_(std::string(protocol_name) + "/" + protocol_version), header_() {}
+                Request(std::string command) : command_(command), protocol_(std::string(protocol_name) + "/" + protocol_version), header_(arg) {}
                 ~Request() {}
-                static Request parse(std::string str) {
-                    auto result = std::remove_if(str.begin(), str.end(),
-                            [](int ch) {return ch == '\x0d';}
-                    );
-                    str.erase(result, str.end());
-                    std::istringstream iss(str);
-                    return parse(iss);
-                }
-                static Request parse(std::istringstream& iss) {
+                static Request parse(std::string_view view) {
                     Request ret;
-                    std::string line;
-                    getline(iss, line, '\x0a');
-                    decltype(line)::size_type pos    = line.rfind(' ');
-                    if (pos == decltype(line)::npos) {
+                    auto line = getline(view);
+                    auto pos = line.rfind(' ');
+                    if (pos == std::string_view::npos) {
                         return ret;
                     }
-                    // assert protocol name
-                    // line.substr(pos + 1)
-                    std::string protocol = line.substr(pos + 1);
-                    std::ostringstream pattern;
-                    pattern << protocol_name << R"(/\d+\.\d+)";
-                    if (!regex_match(protocol, std::regex(pattern.str()))) {
+                    auto protocol = line.substr(pos + 1);
+                    if (!isProtocol(protocol, protocol_name)) {
                         return ret;
                     }
                     ret.command_    = line.substr(0, pos);
                     ret.protocol_   = protocol;
-                    ret.header_     = Header::parse(iss);
+                    ret.header_     = Header::parse(view, arg);
                     return ret;
                 }
                 std::string getCommand() { return command_; }
                 std::string getProtocol() { return protocol_; }
-                optional& operator[](const std::string& key) {
+                optional& operator[](std::string_view key) {
                     return header_[key];
                 }
                 optional& operator()() {
                     return header_[value];
                 }
                 optional& operator()(size_t index) {
-                    std::ostringstream oss;
-                    oss << arg << index;
-                    return header_[oss.str()];
+                    return header_.arg(index);
+                }
+                // outの末尾に書き出す
+                void serialize(std::string &out) const {
+                    out.append(command_);
+                    out.append(" ");
+                    out.append(protocol_);
+                    out.append("\x0d\x0a");
+                    header_.serialize(out);
+                    out.append("\x0d\x0a");
                 }
                 operator std::string() const {
-                    std::ostringstream oss;
-                    oss << command_ << " " << protocol_ << "\x0d\x0a";
-                    oss << static_cast<std::string>(header_);
-                    oss << "\x0d\x0a";
-                    return oss.str();
+                    std::string out;
+                    out.reserve(command_.size() + protocol_.size() + header_.size() + 5);
+                    serialize(out);
+                    return out;
                 }
 
             private:
@@ -69,7 +61,7 @@ namespace base {
                 std::string protocol_;
                 Header header_;
 
-                Request() : command_(), protocol_(), header_() {}
+                Request() : command_(), protocol_(), header_(arg) {}
         };
 
 }
@@ -1,9 +1,9 @@
 #ifndef SSTP_RESPONSE_H_
 #define SSTP_RESPONSE_H_
 
-#include <regex>
-#include <sstream>
+#include <charconv>
 #include <string>
+#include <string_view>
 
 #include "base/header.h"
 
@@ -12,71 +12,69 @@ namespace base {
     template<const char *protocol_name, const char *protocol_version, const char *value, const char *arg>
         class Response {
             public:
-                Response(int code, std::string status) : code_(code), status_(status), protocol_(std::string(protocol_name) + "/" + protocol_version), header_() {}
+                Response(int code, std::string status) : code_(code), status_(status), protocol_(std::string(protocol_name) + "/" + protocol_version), header_(arg) {}
                 ~Response() {}
-                static Response parse(std::string str) {
-                    auto result = std::remove_if(str.begin(), str.end(),
-                            [](int ch) {return ch == '\x0d';}
-                    );
-                    str.erase(result, str.end());
-                    std::istringstream iss(str);
-                    return parse(iss);
-                }
-                static Response parse(std::istringstream& iss) {
+                static Response parse(std::string_view view) {
                     Response ret;
-                    std::string line;
-                    getline(iss, line, '\x0a');
-                    decltype(line)::size_type pos    = line.find(' ');
-                    if (pos == decltype(line)::npos) {
+                    auto line = getline(view);
+                    auto pos = line.find(' ');
+                    if (pos == std::string_view::npos) {
                         return ret;
                     }
-                    // assert protocol name
-                    // line.substr(0, pos);
-                    std::string protocol = line.substr(0, pos);
-                    std::ostringstream pattern;
-                    pattern << protocol_name << R"(/\d+\.\d+)";
-                    if (!regex_match(protocol, std::regex(pattern.str()))) {
+                    auto protocol = line.substr(0, pos);
+                    if (!isProtocol(protocol, protocol_name)) {
                         return ret;
                     }
-                    line    = line.substr(pos + 1);
-                    pos    = line.find(' ');
-                    if (pos == decltype(line)::npos) {
+                    line = line.substr(pos + 1);
+                    pos = line.find(' ');
+                    if (pos == std::string_view::npos) {
                         return ret;
                     }
-                    ret.code_ = std::atoi(line.substr(0, pos).c_str());
+                    std::from_chars(line.data(), line.data() + pos, ret.code_);
                     ret.status_ = line.substr(pos + 1);
                     ret.protocol_   = protocol;
-                    ret.header_ = Header::parse(iss);
-                    std::getline(iss, ret.content_, '\x0a');
+                    ret.header_ = Header::parse(view, arg);
+                    ret.content_ = getline(view);
                     return ret;
                 }
                 int getStatusCode() { return code_; }
                 std::string getStatus() { return status_; }
                 std::string getProtocol() { return protocol_; }
-                optional& operator[](const std::string& key) {
+                optional& operator[](std::string_view key) {
                     return header_[key];
                 }
                 optional& operator()() {
                     return header_[value];
                 }
                 optional& operator()(size_t index) {
-                    std::ostringstream oss;
-                    oss << arg << index;
-                    return header_[oss.str()];
+                    return header_.arg(index);
                 }
                 std::string getContent() const {
                     return content_;
                 }
-                operator std::string() const {
-                    std::ostringstream oss;
-                    oss << protocol_ << " " << code_ << " " << status_ << "\x0d\x0a";
-                    oss << static_cast<std::string>(header_);
-                    oss << "\x0d\x0a";
+                // outの末尾に書き出す
+                void serialize(std::string &out) const {
+                    char code[16];
+                    auto [end, _] = std::to_chars(code, code + sizeof(code), code_);
+                    out.append(protocol_);
+                    out.append(" ");
+                    out.append(code, end);
+                    out.append(" ");
+                    out.append(status_);
+                    out.append("\x0d\x0a");
+                    header_.serialize(out);
+                    out.append("\x0d\x0a");
                     if (!content_.empty()) {
-                        oss << content_ << "\x0d\x0a";
-                        oss << "\x0d\x0a";
+                        out.append(content_);
+                        out.append("\x0d\x0a");
+                        out.append("\x0d\x0a");
                     }
-                    return oss.str();
+                }
+                operator std::string() const {
+                    std::string out;
+                    out.reserve(protocol_.size() + status_.size() + header_.size() + content_.size() + 24);
+                    serialize(out);
+                    return out;
                 }
             private:
                 int code_;
@@ -85,7 +83,7 @@ namespace base {
                 Header header_;
                 std::string content_;
 
-                Response() : code_(), status_(), protocol_(), header_() {}
+                Response() : code_(), status_(), protocol_(), header_(arg) {}
         };
 
 }
@@ -0,0 +1,118 @@
+#include "ipc.h"
+
+#include <cstring>
+
+#include "misc.h"
+
+#if defined(IS_WINDOWS)
+#include <io.h>
+#else
+#include <unistd.h>
+#endif // WIN32
+
+namespace {
+    constexpr size_t kInitialBufferSize = 64 * 1024;
+
+    long readFd(int fd, char *buf, size_t n) {
+#if defined(IS_WINDOWS)
+        return _read(fd, buf, static_cast<unsigned int>(n));
+#else
+        return ::read(fd, buf, n);
+#endif // WIN32
+    }
+
+    long writeFd(int fd, const char *buf, size_t n) {
+#if defined(IS_WINDOWS)
+        return _write(fd, buf, static_cast<unsigned int>(n));
+#else
+        return ::write(fd, buf, n);
+#endif // WIN32
+    }
+}
+
+FramedReader::FramedReader(int fd) : fd_(fd), buffer_(kInitialBufferSize), begin_(0), end_(0) {}
+
+bool FramedReader::fill() {
+    if (begin_ > 0) {
+        // 未処理の分を先頭に寄せる
+        std::memmove(buffer_.data(), buffer_.data() + begin_, end_ - begin_);
+        end_ -= begin_;
+        begin_ = 0;
+    }
+    if (end_ == buffer_.size()) {
+        buffer_.resize(buffer_.size() * 2);
+    }
+    long ret = readFd(fd_, buffer_.data() + end_, buffer_.size() - end_);
+    if (ret <= 0) {
+        return false;
+    }
+    end_ += ret;
+    return true;
+}
+
+bool FramedReader::ready() const {
+    size_t n = end_ - begin_;
+    if (n < sizeof(uint32_t)) {
+        return false;
+    }
+    uint32_t len;
+    std::memcpy(&len, buffer_.data() + begin_, sizeof(len));
+    return n - sizeof(uint32_t) >= len;
+}
+
+std::optional<std::string_view> FramedReader::next() {
+    while (end_ - begin_ < sizeof(uint32_t)) {
+        if (!fill()) {
+            return std::nullopt;
+        }
+    }
+    uint32_t len;
+    std::memcpy(&len, buffer_.data() + begin_, sizeof(len));
+    if (len == 0) {
+        return std::nullopt;
+    }
+    if (buffer_.size() < sizeof(uint32_t) + len) {
+        // 先頭に寄せてから入りきる大きさにする
+        std::memmove(buffer_.data(), buffer_.data() + begin_, end_ - begin_);
+        end_ -= begin_;
+        begin_ = 0;
+        buffer_.resize(sizeof(uint32_t) + len);
+    }
+    while (end_ - begin_ < sizeof(uint32_t) + len) {
+        if (!fill()) {
+            return std::nullopt;
+        }
+    }
+    std::string_view message(buffer_.data() + begin_ + sizeof(uint32_t), len);
+    begin_ += sizeof(uint32_t) + len;
+    return message;
+}
+
+FramedWriter::FramedWriter(int fd) : fd_(fd) {
+    buffer_.reserve(kInitialBufferSize);
+}
+
+FramedWriter::~FramedWriter() {
+    flush();
+}
+
+void FramedWriter::write(std::string_view message) {
+    uint32_t len = message.size();
+    const char *p = reinterpret_cast<const char *>(&len);
+    buffer_.insert(buffer_.end(), p, p + sizeof(len));
+    buffer_.insert(buffer_.end(), message.begin(), message.end());
+}
+
+bool FramedWriter::flush() {
+    size_t written = 0;
+    while (written < buffer_.size()) {
+        long ret = writeFd(fd_, buffer_.data() + written, buffer_.size() - written);
+        if (ret <= 0) {
+            buffer_.clear();
+            return false;
+        }
+        written += ret;
+    }
+    buffer_.clear();
+    return true;
+}
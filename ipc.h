@@ -0,0 +1,43 @@
+#ifndef IPC_H_
+#define IPC_H_
+
+#include <cstdint>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+// 標準入出力上の「長さ(uint32_t) + 本体」の形式のメッセージを読み書きする
+// バッファは使い回し、1回のreadで届いた分はまとめて処理する
+class FramedReader {
+    private:
+        int fd_;
+        std::vector<char> buffer_;
+        // 未処理のデータの範囲
+        size_t begin_, end_;
+
+        bool fill();
+
+    public:
+        FramedReader(int fd);
+        ~FramedReader() {}
+        // 次のメッセージ(次に呼ぶまで有効)
+        // 終端や長さ0のメッセージではstd::nullopt
+        std::optional<std::string_view> next();
+        // 読み込まずに次のメッセージを返せる
+        bool ready() const;
+};
+
+// 書き込みは溜めておいてflushでまとめて出力する
+class FramedWriter {
+    private:
+        int fd_;
+        std::vector<char> buffer_;
+
+    public:
+        FramedWriter(int fd);
+        ~FramedWriter();
+        void write(std::string_view message);
+        bool flush();
+};
+
+#endif // IPC_H_
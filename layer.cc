@@ -0,0 +1,95 @@
+#include "layer.h"
+
+#include <algorithm>
+#include <type_traits>
+#include <utility>
+
+#include "logger.h"
+
+namespace {
+    struct Context {
+        std::unique_ptr<ImageCache> &cache;
+        int scale;
+        bool upconverted;
+    };
+
+    // 子を(x, y)を原点として積み、範囲の大きさを返す
+    std::pair<int, int> append(std::vector<Layer> &layers, const ElementWithChildren &e, int x, int y, int depth, Context &c);
+
+    std::pair<int, int> append(std::vector<Layer> &layers, const Element &e, int x, int y, int depth, Context &c) {
+        auto info = c.cache->get(e.filename, e.index);
+        if (!info) {
+            return {0, 0};
+        }
+        c.upconverted = c.upconverted && info->isUpconverted();
+        int w = info->width(), h = info->height();
+        layers.push_back({LayerOp::Draw, layer::toBlendOp(e.method), x, y, w, h, std::move(info), {e.filename, e.index}});
+        return {w, h};
+    }
+
+    std::pair<int, int> append(std::vector<Layer> &layers, const ElementWithChildren &e, int x, int y, int depth, Context &c) {
+        int w = 0, h = 0;
+        for (auto &child : e.children) {
+            std::visit([&](const auto &v) {
+                int dx = (v.x * c.scale) / 100;
+                int dy = (v.y * c.scale) / 100;
+                size_t begin = layers.size();
+                std::pair<int, int> size;
+                if constexpr (std::is_same_v<std::decay_t<decltype(v)>, Element>) {
+                    size = append(layers, v, x + dx, y + dy, depth, c);
+                }
+                else {
+                    if (depth + 1 >= layer::kMaxDepth) {
+                        Logger::warn("layer: too deep");
+                        return;
+                    }
+                    layers.push_back({LayerOp::Push, BlendOp::Over, x + dx, y + dy, 0, 0, std::nullopt, {}});
+                    size = append(layers, v, x + dx, y + dy, depth + 1, c);
+                    if (size.first == 0 || size.second == 0) {
+                        // 空の入れ子は描かない
+                        layers.resize(begin);
+                        return;
+                    }
+                    layers[begin].w = size.first;
+                    layers[begin].h = size.second;
+                    layers.push_back({LayerOp::Pop, layer::toBlendOp(v.method), x + dx, y + dy, size.first, size.second, std::nullopt, {}});
+                }
+                if (size.first == 0 || size.second == 0) {
+                    return;
+                }
+                w = std::max(w, dx + size.first);
+                h = std::max(h, dy + size.second);
+            }, child);
+        }
+        return {w, h};
+    }
+}
+
+namespace layer {
+    BlendOp toBlendOp(Method method) {
+        switch (method) {
+            case Method::OverlayFast:
+                return BlendOp::OverlayFast;
+            case Method::OverlayMultiply:
+                return BlendOp::Multiply;
+            case Method::Replace:
+                return BlendOp::Replace;
+            case Method::Interpolate:
+                return BlendOp::Interpolate;
+            case Method::Reduce:
+                return BlendOp::Reduce;
+            default:
+                return BlendOp::Over;
+        }
+    }
+
+    LayerList flatten(const ElementWithChildren &root, std::unique_ptr<ImageCache> &cache, int scale) {
+        LayerList list;
+        Context c = {cache, scale, true};
+        auto [w, h] = append(list.layers, root, 0, 0, 0, c);
+        list.width = w;
+        list.height = h;
+        list.upconverted = c.upconverted;
+        return list;
+    }
+}
@@ -0,0 +1,51 @@
+#ifndef LAYER_H_
+#define LAYER_H_
+
+#include <memory>
+#include <optional>
+#include <vector>
+
+#include "element.h"
+#include "image_cache.h"
+
+// 乗算済みアルファでの合成方法(toBlendModeと同じ式)
+enum class BlendOp {
+    Over, OverlayFast, Multiply, Replace, Interpolate, Reduce,
+};
+
+enum class LayerOp {
+    // 画像を重ねる
+    Draw,
+    // 透明な作業面を積む(範囲外は描かれない)
+    Push,
+    // 作業面を1つ下の面に重ねる
+    Pop,
+};
+
+struct Layer {
+    LayerOp op;
+    BlendOp blend;
+    // 出力画像上の範囲
+    int x, y, w, h;
+    std::optional<ImageInfo> image;
+    // 画像の識別(GPUに置いたままにする画像の検索に使う)
+    ImagePath path;
+};
+
+// 描画木を前から順に合成すればよい命令列にしたもの
+struct LayerList {
+    std::vector<Layer> layers;
+    int width, height;
+    bool upconverted;
+};
+
+namespace layer {
+    // 入れ子はこれより深くしない
+    constexpr int kMaxDepth = 8;
+
+    BlendOp toBlendOp(Method method);
+
+    LayerList flatten(const ElementWithChildren &root, std::unique_ptr<ImageCache> &cache, int scale);
+}
+
+#endif // LAYER_H_
@@ -1,4 +1,212 @@
 #include "logger.h"
 
-std::unique_ptr<std::ofstream> Logger::ofs_;
-std::mutex Logger::mutex_;
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+    // スレッド毎のバッファの大きさ
+    const size_t kRingSize = 64 * 1024;
+    // 1行の上限(超えた分は切り詰める)
+    const size_t kMaxLine = kRingSize / 4;
+    // 書き出すスレッドが見に行く間隔
+    const std::chrono::milliseconds kInterval(20);
+    const int kDisabled = static_cast<int>(LogLevel::Error) + 1;
+
+    struct RecordHeader {
+        // スレッドをまたいで並べ直すための通し番号
+        uint64_t seq;
+        uint64_t size;
+    };
+
+    // 書き込むのは持ち主のスレッド、読み込むのは書き出すスレッドだけ
+    struct Ring {
+        std::vector<char> data = std::vector<char>(kRingSize);
+        // 書き込み済みの位置と読み込み済みの位置(どちらも増える一方)
+        std::atomic<uint64_t> head = 0;
+        std::atomic<uint64_t> tail = 0;
+        std::atomic<uint64_t> dropped = 0;
+        // 持ち主のスレッドが終わった
+        std::atomic<bool> closed = false;
+
+        void copyIn(uint64_t pos, const void *src, size_t n) {
+            size_t offset = pos % kRingSize;
+            size_t first = std::min(n, kRingSize - offset);
+            std::memcpy(data.data() + offset, src, first);
+            std::memcpy(data.data(), static_cast<const char *>(src) + first, n - first);
+        }
+
+        void copyOut(uint64_t pos, void *dest, size_t n) const {
+            size_t offset = pos % kRingSize;
+            size_t first = std::min(n, kRingSize - offset);
+            std::memcpy(dest, data.data() + offset, first);
+            std::memcpy(static_cast<char *>(dest) + first, data.data(), n - first);
+        }
+    };
+
+    class Writer {
+        private:
+            std::mutex mutex_;
+            std::condition_variable cond_;
+            std::vector<std::shared_ptr<Ring>> rings_;
+            std::ofstream ofs_;
+            std::unique_ptr<std::thread> th_;
+            bool alive_ = false;
+
+            // mutex_を持って呼ぶ
+            void drain() {
+                std::vector<std::pair<uint64_t, std::string>> lines;
+                uint64_t dropped = 0;
+                for (auto &ring : rings_) {
+                    uint64_t head = ring->head.load(std::memory_order_acquire);
+                    uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+                    while (tail < head) {
+                        RecordHeader header;
+                        ring->copyOut(tail, &header, sizeof(header));
+                        std::string line(header.size, '\0');
+                        ring->copyOut(tail + sizeof(header), line.data(), header.size);
+                        lines.emplace_back(header.seq, std::move(line));
+                        tail += sizeof(header) + header.size;
+                    }
+                    ring->tail.store(tail, std::memory_order_release);
+                    dropped += ring->dropped.exchange(0, std::memory_order_relaxed);
+                }
+                // 終わったスレッドのバッファは読み終えたら捨てる
+                std::erase_if(rings_, [](const std::shared_ptr<Ring> &ring) {
+                    return ring->closed && ring->tail == ring->head;
+                });
+                if (!ofs_.is_open()) {
+                    return;
+                }
+                std::sort(lines.begin(), lines.end(), [](const auto &a, const auto &b) {
+                    return a.first < b.first;
+                });
+                for (auto &[_, line] : lines) {
+                    ofs_ << line << '\n';
+                }
+                if (dropped > 0) {
+                    ofs_ << "[warning] logger: " << dropped << " lines dropped\n";
+                }
+                if (!lines.empty() || dropped > 0) {
+                    ofs_.flush();
+                }
+            }
+
+        public:
+            ~Writer() {
+                stop();
+            }
+
+            void add(std::shared_ptr<Ring> ring) {
+                std::unique_lock<std::mutex> lock(mutex_);
+                rings_.push_back(std::move(ring));
+            }
+
+            void start(const std::filesystem::path &p) {
+                std::unique_lock<std::mutex> lock(mutex_);
+                drain();
+                ofs_.close();
+                ofs_.open(p);
+                if (th_) {
+                    return;
+                }
+                alive_ = true;
+                th_ = std::make_unique<std::thread>([this]() {
+                    std::unique_lock<std::mutex> lock(mutex_);
+                    while (alive_) {
+                        cond_.wait_for(lock, kInterval, [this]() { return !alive_; });
+                        drain();
+                    }
+                });
+            }
+
+            void stop() {
+                {
+                    std::unique_lock<std::mutex> lock(mutex_);
+                    if (!th_) {
+                        return;
+                    }
+                    alive_ = false;
+                }
+                cond_.notify_one();
+                th_->join();
+                th_.reset();
+                std::unique_lock<std::mutex> lock(mutex_);
+                drain();
+            }
+    };
+
+    Writer &writer() {
+        static Writer w;
+        return w;
+    }
+
+    std::atomic<uint64_t> sequence = 0;
+
+    Ring &local() {
+        struct Holder {
+            std::shared_ptr<Ring> ring;
+            ~Holder() {
+                if (ring) {
+                    ring->closed = true;
+                }
+            }
+        };
+        thread_local Holder holder;
+        if (!holder.ring) {
+            holder.ring = std::make_shared<Ring>();
+            writer().add(holder.ring);
+        }
+        return *holder.ring;
+    }
+}
+
+std::atomic<int> Logger::level_(kDisabled);
+
+void Logger::push(std::string_view line) {
+    line = line.substr(0, kMaxLine);
+    auto &ring = local();
+    size_t need = sizeof(RecordHeader) + line.size();
+    uint64_t head = ring.head.load(std::memory_order_relaxed);
+    uint64_t tail = ring.tail.load(std::memory_order_acquire);
+    if (kRingSize - (head - tail) < need) {
+        ring.dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    RecordHeader header = {sequence.fetch_add(1, std::memory_order_relaxed), line.size()};
+    ring.copyIn(head, &header, sizeof(header));
+    ring.copyIn(head + sizeof(header), line.data(), line.size());
+    // 行全体を書き終えてから見えるようにする
+    ring.head.store(head + need, std::memory_order_release);
+}
+
+std::ostringstream &Logger::stream() {
+    thread_local std::ostringstream oss;
+    oss.str("");
+    oss.clear();
+    return oss;
+}
+
+void Logger::configure(std::filesystem::path p, LogLevel level) {
+    writer().start(p);
+    level_ = static_cast<int>(level);
+    // 書き出すスレッドより先に終わらせて残りを書き出す
+    static std::once_flag once;
+    std::call_once(once, []() {
+        std::atexit(Logger::shutdown);
+    });
+}
+
+void Logger::shutdown() {
+    level_ = kDisabled;
+    writer().stop();
+}
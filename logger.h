@@ -1,32 +1,78 @@
 #ifndef LOGGER_H_
 #define LOGGER_H_
 
+#include <atomic>
 #include <filesystem>
-#include <fstream>
-#include <memory>
-#include <mutex>
+#include <sstream>
+#include <string_view>
+#include <utility>
 
+// これより低いレベルの呼び出しはコンパイル時に取り除く(0: Debug, 1: Info, 2: Warning, 3: Error)
+#if !defined(LOG_MIN_LEVEL)
+#define LOG_MIN_LEVEL 0
+#endif // LOG_MIN_LEVEL
+
+enum class LogLevel {
+    Debug, Info, Warning, Error,
+};
+
+// 呼び出したスレッドでは1行に整えて自分のリングバッファに入れるだけで、
+// ファイルへの書き出しは専用のスレッドがまとめて行う
+// 行の途中に他のスレッドの出力が混ざることはなく、バッファが一杯なら待たずに捨てる
 class Logger {
     private:
-        static std::unique_ptr<std::ofstream> ofs_;
-        static std::mutex mutex_;
+        // configureするまでは何も出力しない
+        static std::atomic<int> level_;
+
+        static void push(std::string_view line);
+        // 空にしたスレッド毎の作業用のストリーム
+        static std::ostringstream &stream();
+
+        template<typename... Args>
+        static void write(LogLevel level, const char *prefix, Args&&... args) {
+            if (static_cast<int>(level) < level_.load(std::memory_order_relaxed)) {
+                return;
+            }
+            auto &oss = stream();
+            oss << prefix;
+            ((oss << args << " "), ...);
+            push(oss.view());
+        }
+
     public:
-        static void configure(std::filesystem::path p) {
-            ofs_ = std::make_unique<std::ofstream>(p);
+        // pに書き出し始める(levelより低いものは捨てる)
+        static void configure(std::filesystem::path p, LogLevel level = LogLevel::Debug);
+        // 溜まっている分を書き出して止める
+        static void shutdown();
+
+        template<typename... Args>
+        static void debug(Args&&... args) {
+            if constexpr (LOG_MIN_LEVEL <= 0) {
+                write(LogLevel::Debug, "", std::forward<Args>(args)...);
+            }
         }
-        static void log() {
-            if (ofs_) {
-                std::unique_lock<std::mutex> lock(mutex_);
-                *ofs_ << std::endl;
+        template<typename... Args>
+        static void info(Args&&... args) {
+            if constexpr (LOG_MIN_LEVEL <= 1) {
+                write(LogLevel::Info, "", std::forward<Args>(args)...);
             }
         }
-        template<typename Head, typename... Remain>
-        static void log(Head&& h, Remain&&... remain) {
-            if (ofs_) {
-                std::unique_lock<std::mutex> lock(mutex_);
-                *ofs_ << h << " ";
+        template<typename... Args>
+        static void warn(Args&&... args) {
+            if constexpr (LOG_MIN_LEVEL <= 2) {
+                write(LogLevel::Warning, "[warning] ", std::forward<Args>(args)...);
             }
-            log(std::forward<Remain>(remain)...);
+        }
+        template<typename... Args>
+        static void error(Args&&... args) {
+            if constexpr (LOG_MIN_LEVEL <= 3) {
+                write(LogLevel::Error, "[error] ", std::forward<Args>(args)...);
+            }
+        }
+        // 以前からの呼び出しはDebugとして扱う
+        template<typename... Args>
+        static void log(Args&&... args) {
+            debug(std::forward<Args>(args)...);
         }
 };
 
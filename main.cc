@@ -12,6 +12,20 @@
 #include "logger.h"
 
 int main(int argc, char **argv) {
+    if (getenv("AO_LOG")) {
+        LogLevel level = LogLevel::Debug;
+        std::string name = (getenv("AO_LOG_LEVEL")) ? (getenv("AO_LOG_LEVEL")) : ("debug");
+        if (name == "info") {
+            level = LogLevel::Info;
+        }
+        else if (name == "warning") {
+            level = LogLevel::Warning;
+        }
+        else if (name == "error") {
+            level = LogLevel::Error;
+        }
+        Logger::configure(getenv("AO_LOG"), level);
+    }
     SDL_SetHint(SDL_HINT_MOUSE_FOCUS_CLICKTHROUGH, "1");
     SDL_SetHint("SDL_BORDERLESS_WINDOWED_STYLE", "0");
     SDL_SetHint(SDL_HINT_APP_ID, "io.github.tatakinov.ninix-kagari.ao.ao_builtin");
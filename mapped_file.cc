@@ -0,0 +1,46 @@
+#include "mapped_file.h"
+
+#include <fstream>
+#include <iterator>
+
+#include "misc.h"
+
+#if !defined(IS_WINDOWS)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif // WIN32
+
+MappedFile::MappedFile(const std::filesystem::path &path) : data_(nullptr), size_(0), mapped_(false) {
+#if !defined(IS_WINDOWS)
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd != -1) {
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                data_ = static_cast<const char *>(p);
+                size_ = st.st_size;
+                mapped_ = true;
+            }
+        }
+        close(fd);
+        if (mapped_) {
+            return;
+        }
+    }
+#endif // WIN32
+    std::ifstream ifs(path, std::ios::binary);
+    buffer_.assign(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+    data_ = buffer_.data();
+    size_ = buffer_.size();
+}
+
+MappedFile::~MappedFile() {
+#if !defined(IS_WINDOWS)
+    if (mapped_) {
+        munmap(const_cast<char *>(data_), size_);
+    }
+#endif // WIN32
+}
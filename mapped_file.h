@@ -0,0 +1,27 @@
+#ifndef MAPPED_FILE_H_
+#define MAPPED_FILE_H_
+
+#include <filesystem>
+#include <string_view>
+#include <vector>
+
+// ファイル全体を読み取り専用でメモリに割り当てる
+// mmapが使えない環境では全体を読み込む
+class MappedFile {
+    private:
+        const char *data_;
+        size_t size_;
+        bool mapped_;
+        std::vector<char> buffer_;
+
+    public:
+        MappedFile(const std::filesystem::path &path);
+        ~MappedFile();
+        MappedFile(const MappedFile &) = delete;
+        MappedFile &operator=(const MappedFile &) = delete;
+        std::string_view view() const {
+            return {data_, size_};
+        }
+};
+
+#endif // MAPPED_FILE_H_
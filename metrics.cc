@@ -0,0 +1,157 @@
+#include "metrics.h"
+
+#include <algorithm>
+#include <map>
+#include <utility>
+
+#include "logger.h"
+
+namespace {
+    static_assert(metrics::Histogram::bucketOf(metrics::Histogram::kMaxValue) + 1 == metrics::Histogram::kBuckets);
+
+    struct Registry {
+        std::mutex mutex;
+        std::map<std::string, std::unique_ptr<metrics::Counter>> counters;
+        std::map<std::string, std::unique_ptr<metrics::Gauge>> gauges;
+        std::map<std::string, std::unique_ptr<metrics::Histogram>> histograms;
+    };
+
+    // 終了時に他のスレッドやstaticな参照から触られても壊れないよう破棄しない
+    Registry &registry() {
+        static Registry *r = new Registry();
+        return *r;
+    }
+
+    template<typename T>
+    T &find(std::map<std::string, std::unique_ptr<T>> &map, const std::string &name) {
+        std::unique_lock<std::mutex> lock(registry().mutex);
+        auto &p = map[name];
+        if (!p) {
+            p = std::make_unique<T>();
+        }
+        return *p;
+    }
+}
+
+namespace metrics {
+    void Histogram::record(uint64_t us) {
+        buckets_[bucketOf(us)].fetch_add(1, std::memory_order_relaxed);
+        count_.fetch_add(1, std::memory_order_relaxed);
+        sum_.fetch_add(us, std::memory_order_relaxed);
+        uint64_t prev = min_.load(std::memory_order_relaxed);
+        while (us < prev && !min_.compare_exchange_weak(prev, us, std::memory_order_relaxed)) {}
+        prev = max_.load(std::memory_order_relaxed);
+        while (us > prev && !max_.compare_exchange_weak(prev, us, std::memory_order_relaxed)) {}
+    }
+
+    uint64_t Histogram::percentile(double p) const {
+        uint64_t total = count();
+        if (total == 0) {
+            return 0;
+        }
+        uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(p * total + 0.5));
+        uint64_t seen = 0;
+        uint64_t max = max_.load(std::memory_order_relaxed);
+        for (int i = 0; i < kBuckets; i++) {
+            seen += buckets_[i].load(std::memory_order_relaxed);
+            if (seen >= rank) {
+                uint64_t upper = (i + 1 < kBuckets) ? (lowerBound(i + 1) - 1) : (kMaxValue);
+                return std::min(upper, max);
+            }
+        }
+        return max;
+    }
+
+    Json::Value Histogram::toJson() const {
+        Json::Value v;
+        uint64_t n = count();
+        v["count"] = static_cast<Json::UInt64>(n);
+        if (n == 0) {
+            return v;
+        }
+        v["mean_us"] = static_cast<double>(sum_.load(std::memory_order_relaxed)) / n;
+        v["min_us"] = static_cast<Json::UInt64>(min_.load(std::memory_order_relaxed));
+        v["max_us"] = static_cast<Json::UInt64>(max_.load(std::memory_order_relaxed));
+        v["p50_us"] = static_cast<Json::UInt64>(percentile(0.50));
+        v["p90_us"] = static_cast<Json::UInt64>(percentile(0.90));
+        v["p99_us"] = static_cast<Json::UInt64>(percentile(0.99));
+        v["p999_us"] = static_cast<Json::UInt64>(percentile(0.999));
+        return v;
+    }
+
+    Counter &counter(const std::string &name) {
+        return find(registry().counters, name);
+    }
+
+    Gauge &gauge(const std::string &name) {
+        return find(registry().gauges, name);
+    }
+
+    Histogram &histogram(const std::string &name) {
+        return find(registry().histograms, name);
+    }
+
+    Json::Value snapshot() {
+        auto &r = registry();
+        std::unique_lock<std::mutex> lock(r.mutex);
+        Json::Value root;
+        root["counters"] = Json::objectValue;
+        root["gauges"] = Json::objectValue;
+        root["histograms"] = Json::objectValue;
+        for (auto &[name, c] : r.counters) {
+            root["counters"][name] = static_cast<Json::UInt64>(c->value());
+        }
+        for (auto &[name, g] : r.gauges) {
+            root["gauges"][name] = static_cast<Json::Int64>(g->value());
+        }
+        for (auto &[name, h] : r.histograms) {
+            root["histograms"][name] = h->toJson();
+        }
+        return root;
+    }
+
+    Reporter::Reporter(std::chrono::milliseconds interval, const std::filesystem::path &path) : alive_(true), interval_(interval) {
+        if (!path.empty()) {
+            ofs_.open(path, std::ios::app);
+            if (!ofs_) {
+                Logger::warn("metrics: failed to open", path);
+            }
+        }
+        th_ = std::make_unique<std::thread>(&Reporter::run, this);
+    }
+
+    Reporter::~Reporter() {
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            alive_ = false;
+        }
+        cond_.notify_one();
+        th_->join();
+        // 最後の区間の分も残す
+        write();
+    }
+
+    void Reporter::run() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            if (cond_.wait_for(lock, interval_, [this]() { return !alive_; })) {
+                break;
+            }
+            write();
+        }
+    }
+
+    void Reporter::write() {
+        Json::Value line;
+        line["t"] = static_cast<Json::Int64>(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count());
+        line["metrics"] = snapshot();
+        Json::StreamWriterBuilder builder;
+        builder["indentation"] = "";
+        if (ofs_.is_open()) {
+            ofs_ << Json::writeString(builder, line) << std::endl;
+        }
+        else {
+            Logger::info("metrics:", Json::writeString(builder, line));
+        }
+    }
+}
@@ -0,0 +1,142 @@
+#ifndef METRICS_H_
+#define METRICS_H_
+
+// 動作中の様子を外から見るための計測値
+// カウンタ、ゲージ、ヒストグラムを名前で登録し、sorakadoのGetMetricsや定期的な書き出しでJSONにして返す
+// 値はアトミックに更新するのでどのスレッドからでも触ってよい
+// 登録したものは最後まで消さないので、参照をstaticや呼び出し側のメンバに持っておく
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <json/json.h>
+
+namespace metrics {
+    class Counter {
+        private:
+            std::atomic<uint64_t> value_ = 0;
+        public:
+            void add(uint64_t n = 1) {
+                value_.fetch_add(n, std::memory_order_relaxed);
+            }
+            uint64_t value() const {
+                return value_.load(std::memory_order_relaxed);
+            }
+    };
+
+    class Gauge {
+        private:
+            std::atomic<int64_t> value_ = 0;
+        public:
+            void set(int64_t v) {
+                value_.store(v, std::memory_order_relaxed);
+            }
+            void add(int64_t delta) {
+                value_.fetch_add(delta, std::memory_order_relaxed);
+            }
+            int64_t value() const {
+                return value_.load(std::memory_order_relaxed);
+            }
+    };
+
+    // マイクロ秒単位のHDRヒストグラム
+    // 2の冪毎の区間を64に分けるので、誤差は値の1/64程度に収まる
+    class Histogram {
+        public:
+            // 仮数部のビット数
+            static constexpr int kSubBits = 6;
+            // これより大きい値はこれとして数える(約71分)
+            static constexpr uint64_t kMaxValue = (uint64_t(1) << 32) - 1;
+            static constexpr int kBuckets = ((32 - kSubBits) << kSubBits) + (1 << kSubBits);
+
+            static constexpr int bucketOf(uint64_t v) {
+                if (v > kMaxValue) {
+                    v = kMaxValue;
+                }
+                int msb = 63 - std::countl_zero(v | 1);
+                int shift = (msb > kSubBits) ? (msb - kSubBits) : (0);
+                return (shift << kSubBits) + static_cast<int>(v >> shift);
+            }
+
+            // バケットに入る最小の値
+            static constexpr uint64_t lowerBound(int index) {
+                if (index < (2 << kSubBits)) {
+                    return index;
+                }
+                int shift = (index >> kSubBits) - 1;
+                uint64_t m = (index & ((1 << kSubBits) - 1)) + (1 << kSubBits);
+                return m << shift;
+            }
+
+        private:
+            std::array<std::atomic<uint64_t>, kBuckets> buckets_ = {};
+            std::atomic<uint64_t> count_ = 0;
+            std::atomic<uint64_t> sum_ = 0;
+            std::atomic<uint64_t> min_ = UINT64_MAX;
+            std::atomic<uint64_t> max_ = 0;
+
+        public:
+            void record(uint64_t us);
+            template<typename Rep, typename Period>
+            void record(std::chrono::duration<Rep, Period> d) {
+                auto us = std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+                record(static_cast<uint64_t>((us > 0) ? (us) : (0)));
+            }
+            uint64_t count() const {
+                return count_.load(std::memory_order_relaxed);
+            }
+            // pは0から1(値はバケットの上端をmaxで抑えたもの)
+            uint64_t percentile(double p) const;
+            Json::Value toJson() const;
+    };
+
+    // スコープを抜けるまでの時間をヒストグラムに入れる
+    class Timer {
+        private:
+            Histogram &histogram_;
+            std::chrono::steady_clock::time_point begin_;
+        public:
+            Timer(Histogram &histogram) : histogram_(histogram), begin_(std::chrono::steady_clock::now()) {}
+            ~Timer() {
+                histogram_.record(std::chrono::steady_clock::now() - begin_);
+            }
+    };
+
+    // 同じ名前なら同じものを返す
+    Counter &counter(const std::string &name);
+    Gauge &gauge(const std::string &name);
+    Histogram &histogram(const std::string &name);
+
+    // 登録されている全ての値
+    Json::Value snapshot();
+
+    // intervalごとにsnapshotを1行のJSONとしてpathに追記する(pathが空ならログに出す)
+    class Reporter {
+        private:
+            bool alive_;
+            std::mutex mutex_;
+            std::condition_variable cond_;
+            std::unique_ptr<std::thread> th_;
+            std::chrono::milliseconds interval_;
+            std::ofstream ofs_;
+
+            void run();
+            void write();
+
+        public:
+            Reporter(std::chrono::milliseconds interval, const std::filesystem::path &path);
+            ~Reporter();
+    };
+}
+
+#endif // METRICS_H_
@@ -0,0 +1,188 @@
+#include "prefetcher.h"
+
+#include <algorithm>
+#include <utility>
+
+#include "seriko.h"
+
+namespace {
+    // 予測に使う候補の数
+    const size_t kCandidates = 3;
+    // 覚えておく切り替え前のIDの数
+    const size_t kMaxSources = 256;
+    // 切り替え前のID毎に覚えておく切り替え後のIDの数
+    const size_t kMaxSuccessors = 16;
+    // 回数がこれに達したらそのIDの回数を全て半分にして古い傾向を薄める
+    const int kMaxCount = 64;
+}
+
+Prefetcher::Prefetcher(std::unique_ptr<ImageCache> &cache) : alive_(true), cache_(cache), turn_(0) {
+    th_ = std::make_unique<std::thread>(&Prefetcher::run, this);
+}
+
+Prefetcher::~Prefetcher() {
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        alive_ = false;
+    }
+    cond_.notify_one();
+    if (th_) {
+        th_->join();
+    }
+}
+
+std::vector<int> Prefetcher::observe(int side, int id) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    // 非表示(-1)は履歴に含めない
+    if (id < 0) {
+        return {};
+    }
+    if (last_.contains(side) && last_.at(side) != id) {
+        record(last_.at(side), id);
+    }
+    last_[side] = id;
+    if (!transitions_.contains(id)) {
+        return {};
+    }
+    std::vector<std::pair<int, int>> list(transitions_.at(id).begin(), transitions_.at(id).end());
+    std::sort(list.begin(), list.end(), [](const std::pair<int, int> &a, const std::pair<int, int> &b) {
+        if (a.second != b.second) {
+            return a.second > b.second;
+        }
+        return a.first < b.first;
+    });
+    std::vector<int> ret;
+    for (size_t i = 0; i < list.size() && i < kCandidates; i++) {
+        ret.push_back(list[i].first);
+    }
+    return ret;
+}
+
+void Prefetcher::record(int from, int to) {
+    auto total = [](const std::unordered_map<int, int> &successors) {
+        int sum = 0;
+        for (auto &[_, count] : successors) {
+            sum += count;
+        }
+        return sum;
+    };
+    auto fewer = [](const std::pair<const int, int> &a, const std::pair<const int, int> &b) {
+        return a.second < b.second;
+    };
+    if (!transitions_.contains(from) && transitions_.size() >= kMaxSources) {
+        // 記録の最も少ないIDを忘れる
+        auto it = std::min_element(transitions_.begin(), transitions_.end(), [&](const auto &a, const auto &b) {
+            return total(a.second) < total(b.second);
+        });
+        transitions_.erase(it);
+    }
+    auto &successors = transitions_[from];
+    if (!successors.contains(to) && successors.size() >= kMaxSuccessors) {
+        successors.erase(std::min_element(successors.begin(), successors.end(), fewer));
+    }
+    if (++successors[to] < kMaxCount) {
+        return;
+    }
+    for (auto it = successors.begin(); it != successors.end();) {
+        it->second /= 2;
+        if (it->second == 0) {
+            it = successors.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+}
+
+std::vector<ImagePath> Prefetcher::images(SurfaceTable &surfaces, int id, const std::vector<int> &next) {
+    std::vector<ImagePath> list;
+    // 今のサーフェスの画像は描画で読み込むのでアニメーションで使うものだけ
+    Seriko::images(surfaces, id, false, list);
+    for (auto n : next) {
+        Seriko::images(surfaces, n, true, list);
+    }
+    return list;
+}
+
+void Prefetcher::prefetch(int side, std::shared_ptr<SurfaceTable> surfaces, int id, std::vector<int> next) {
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto &s = sides_[side];
+        s.surfaces = std::move(surfaces);
+        s.id = id;
+        s.next = std::move(next);
+        s.queue.clear();
+        s.generation++;
+    }
+    cond_.notify_one();
+}
+
+std::optional<std::vector<ImagePath>> Prefetcher::resolved(int side) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!sides_.contains(side)) {
+        return std::nullopt;
+    }
+    return std::exchange(sides_.at(side).resolved, std::nullopt);
+}
+
+void Prefetcher::run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        cond_.wait(lock, [&]() {
+            if (!alive_) {
+                return true;
+            }
+            return std::any_of(sides_.begin(), sides_.end(), [](const auto &p) {
+                return p.second.surfaces || !p.second.queue.empty();
+            });
+        });
+        if (!alive_) {
+            break;
+        }
+        // 解決していない要求を先に片付ける
+        auto it = std::find_if(sides_.begin(), sides_.end(), [](const auto &p) {
+            return p.second.surfaces != nullptr;
+        });
+        if (it != sides_.end()) {
+            int side = it->first;
+            auto &s = it->second;
+            auto surfaces = std::move(s.surfaces);
+            s.surfaces.reset();
+            int id = s.id;
+            auto next = std::move(s.next);
+            auto generation = s.generation;
+            lock.unlock();
+            auto list = images(*surfaces, id, next);
+            lock.lock();
+            auto &current = sides_.at(side);
+            if (current.generation == generation) {
+                current.queue.assign(list.begin(), list.end());
+                current.resolved = std::move(list);
+            }
+            continue;
+        }
+        // 前回読み込んだキャラクターの次から探す
+        std::optional<int> first, after;
+        for (auto &[k, s] : sides_) {
+            if (s.queue.empty()) {
+                continue;
+            }
+            if (!first || k < *first) {
+                first = k;
+            }
+            if (k > turn_ && (!after || k < *after)) {
+                after = k;
+            }
+        }
+        turn_ = (after) ? (*after) : (*first);
+        auto &queue = sides_.at(turn_).queue;
+        ImagePath p = std::move(queue.front());
+        queue.pop_front();
+        lock.unlock();
+        // 現在の倍率で読み込んでImageCacheに置いておく
+        if (!cache_->contains(p.path, p.index)) {
+            cache_->get(p.path, p.index);
+        }
+        lock.lock();
+    }
+}
@@ -0,0 +1,64 @@
+#ifndef PREFETCHER_H_
+#define PREFETCHER_H_
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "image_cache.h"
+#include "surface_table.h"
+
+// SetSurfaceIDの履歴からどのIDの次にどのIDが来やすいかを数えておき、
+// 次に表示しそうなサーフェスの画像を裏で読み込んでおく
+// サーフェスの解決(遅延モードではブロックの解析)もこのスレッドで行う
+class Prefetcher {
+    private:
+        // キャラクター毎の予測
+        struct Side {
+            // まだ画像に解決していない要求
+            std::shared_ptr<SurfaceTable> surfaces;
+            int id;
+            std::vector<int> next;
+            // 解決した順に読み込む画像
+            std::deque<ImagePath> queue;
+            // 解決したがメインスレッドがまだ受け取っていないもの
+            std::optional<std::vector<ImagePath>> resolved;
+            // 要求が来る度に増やして、解決中に次の要求が来たら結果を捨てる
+            unsigned long long generation = 0;
+        };
+
+        bool alive_;
+        std::mutex mutex_;
+        std::condition_variable cond_;
+        std::unique_ptr<std::thread> th_;
+        std::unique_ptr<ImageCache> &cache_;
+        std::unordered_map<int, Side> sides_;
+        // 画像の読み込みはキャラクターの間で順番に回す
+        int turn_;
+        // 切り替え前のID => 切り替え後のID => 回数(数と回数には上限がある)
+        std::unordered_map<int, std::unordered_map<int, int>> transitions_;
+        // キャラクター毎の最後のID
+        std::unordered_map<int, int> last_;
+
+        void run();
+        void record(int from, int to);
+        static std::vector<ImagePath> images(SurfaceTable &surfaces, int id, const std::vector<int> &next);
+
+    public:
+        Prefetcher(std::unique_ptr<ImageCache> &cache);
+        ~Prefetcher();
+        // sideがidに切り替わったことを記録し、その次に来そうなIDを可能性の高い順に返す
+        std::vector<int> observe(int side, int id);
+        // sideの前の予測で残っているものは捨てて、idとnextで使う画像を裏で集めて読み込む
+        // 他のキャラクターの予測には影響しない
+        void prefetch(int side, std::shared_ptr<SurfaceTable> surfaces, int id, std::vector<int> next);
+        // prefetchで集めた画像の一覧(前回受け取ってから新しく出来ていなければnullopt)
+        std::optional<std::vector<ImagePath>> resolved(int side);
+};
+
+#endif // PREFETCHER_H_
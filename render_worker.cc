@@ -0,0 +1,143 @@
+#include "render_worker.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "cpu_compositor.h"
+#include "trace.h"
+
+namespace {
+    // 形状に使うアルファだけを最近傍で拡縮する(色は0のまま)
+    std::unique_ptr<WrapSurface> scaleAlpha(WrapSurface &src, int scale) {
+        TRACE_ZONE("RenderWorker::scaleAlpha");
+        int src_w = src.width(), src_h = src.height();
+        int w = std::max(1, static_cast<int>(std::round(src_w * scale / 100.0)));
+        int h = std::max(1, static_cast<int>(std::round(src_h * scale / 100.0)));
+        auto dst = std::make_unique<WrapSurface>(w, h, src.isUpconverted());
+        SDL_ClearSurface(dst->surface(), 0, 0, 0, 0);
+        std::vector<int> xs(w);
+        for (int x = 0; x < w; x++) {
+            xs[x] = std::min(src_w - 1, static_cast<int>((2LL * x + 1) * src_w / (2LL * w)));
+        }
+        auto *in = static_cast<const unsigned char *>(src.surface()->pixels);
+        auto *out = static_cast<unsigned char *>(dst->surface()->pixels);
+        int in_pitch = src.surface()->pitch, out_pitch = dst->surface()->pitch;
+        for (int y = 0; y < h; y++) {
+            int sy = std::min(src_h - 1, static_cast<int>((2LL * y + 1) * src_h / (2LL * h)));
+            const unsigned char *in_row = in + sy * in_pitch;
+            unsigned char *out_row = out + y * out_pitch;
+            for (int x = 0; x < w; x++) {
+                out_row[4 * x + 3] = in_row[4 * xs[x] + 3];
+            }
+        }
+        return dst;
+    }
+}
+
+RenderWorker::RenderWorker(std::unique_ptr<ImageCache> &cache, std::unique_ptr<Compositor> compositor)
+    : alive_(true), cache_(cache), composited_(compositor != nullptr), compositor_(std::move(compositor)) {
+    if (!compositor_) {
+        compositor_ = std::make_unique<CPUCompositor>();
+    }
+    th_ = std::make_unique<std::thread>(&RenderWorker::run, this);
+}
+
+RenderWorker::~RenderWorker() {
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        alive_ = false;
+    }
+    cond_.notify_one();
+    if (th_) {
+        th_->join();
+    }
+}
+
+void RenderWorker::setListener(std::function<void()> listener) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    listener_ = listener;
+}
+
+void RenderWorker::submit(FrameRequest request) {
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto it = requests_.find(request.side);
+        if (it != requests_.end()) {
+            // 上書きされる要求の倍率変更は引き継ぐ
+            request.changed = request.changed || it->second.changed;
+            it->second = std::move(request);
+        }
+        else {
+            requests_.emplace(request.side, std::move(request));
+        }
+    }
+    cond_.notify_one();
+}
+
+std::optional<FrameResult> RenderWorker::take(int side) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto it = results_.find(side);
+    if (it == results_.end()) {
+        return std::nullopt;
+    }
+    FrameResult result = std::move(it->second);
+    results_.erase(it);
+    return result;
+}
+
+CompositeResult RenderWorker::compose(const FrameRequest &request) {
+    if (!cache_->useGPUScaling() || request.scale == 100) {
+        return compositor_->composite(layer::flatten(request.element, cache_, request.scale));
+    }
+    // 画像は原寸のまま合成し、拡縮は表示する時にGPUで行う
+    // 合成器を使わない場合も形状のために原寸のアルファを作る
+    return compositor_->composite(layer::flatten(request.element, cache_, 100));
+}
+
+void RenderWorker::run() {
+    while (true) {
+        FrameRequest request;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cond_.wait(lock, [this]() { return !requests_.empty() || !alive_; });
+            if (!alive_) {
+                break;
+            }
+            auto it = requests_.begin();
+            request = std::move(it->second);
+            requests_.erase(it);
+        }
+        auto &histogram = compose_time_[request.side];
+        if (histogram == nullptr) {
+            histogram = &metrics::histogram("render_worker." + std::to_string(request.side) + ".compose_us");
+        }
+        auto begin = std::chrono::steady_clock::now();
+        auto result = compose(request);
+        // 形状は表示する大きさにして渡す(表示する画像を読み戻さずに済む)
+        std::unique_ptr<WrapSurface> shape;
+        if (result.surface && cache_->useGPUScaling() && request.scale != 100) {
+            shape = scaleAlpha(*result.surface, request.scale);
+            if (!composited_) {
+                // 表示はテクスチャで行うので原寸の画像は要らない
+                result.surface.reset();
+            }
+        }
+        histogram->record(std::chrono::steady_clock::now() - begin);
+        std::function<void()> listener;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            auto it = results_.find(request.side);
+            // 取り出される前に次の結果が出来た場合も倍率変更は残す
+            bool changed = request.changed || (it != results_.end() && it->second.changed);
+            results_.insert_or_assign(request.side, FrameResult{request.side, std::move(request.element), std::move(result.surface), std::move(shape), std::move(result.texture), changed});
+            listener = listener_;
+        }
+        if (listener) {
+            listener();
+        }
+    }
+}
@@ -0,0 +1,80 @@
+#ifndef RENDER_WORKER_H_
+#define RENDER_WORKER_H_
+
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+
+#include "compositor.h"
+#include "element.h"
+#include "image_cache.h"
+#include "metrics.h"
+#include "texture.h"
+
+// 描画する内容(作った後は変更しない)
+struct FrameRequest {
+    int side;
+    ElementWithChildren element;
+    int scale;
+    bool changed;
+};
+
+struct FrameResult {
+    int side;
+    ElementWithChildren element;
+    // 形状を取る画像(合成器を使う場合はtextureが無ければそのまま表示する)
+    // GPUで拡縮するモードでは原寸
+    std::unique_ptr<WrapSurface> surface;
+    // GPUで拡縮するモードで形状を取る画像(表示する大きさでアルファだけ)
+    std::unique_ptr<WrapSurface> shape;
+    // GPUで合成した画像
+    std::shared_ptr<SDL_GPUTexture> texture;
+    // 倍率が変わったので描き直す必要がある
+    bool changed;
+};
+
+// 画像の読み込みと合成をメインスレッドの外で行う
+// テクスチャの作成と表示はメインスレッドに残す
+class RenderWorker {
+    private:
+        bool alive_;
+        std::mutex mutex_;
+        std::condition_variable cond_;
+        std::unique_ptr<std::thread> th_;
+        std::unique_ptr<ImageCache> &cache_;
+        // falseなら合成器は形状を取る画像を作るだけで、表示はテクスチャで行う
+        bool composited_;
+        std::unique_ptr<Compositor> compositor_;
+        // 未処理のものはキャラクター毎に最新の1つだけ残す
+        std::map<int, FrameRequest> requests_;
+        std::map<int, FrameResult> results_;
+        std::function<void()> listener_;
+        // キャラクター毎の合成時間(ワーカーのスレッドだけが触る)
+        std::map<int, metrics::Histogram *> compose_time_;
+
+        void run();
+        CompositeResult compose(const FrameRequest &request);
+
+    public:
+        // compositorが無ければ形状を取る画像をCPUCompositorで作る
+        RenderWorker(std::unique_ptr<ImageCache> &cache, std::unique_ptr<Compositor> compositor);
+        ~RenderWorker();
+        // 合成が終わった時に呼ぶ
+        void setListener(std::function<void()> listener);
+        void submit(FrameRequest request);
+        std::optional<FrameResult> take(int side);
+        // 結果が合成済みの画像でそのまま表示できる
+        bool composited() const {
+            return composited_;
+        }
+        // 結果のテクスチャがあるデバイス(ウィンドウのレンダラもこれで作る)
+        SDL_GPUDevice *device() const {
+            return compositor_->device();
+        }
+};
+
+#endif // RENDER_WORKER_H_
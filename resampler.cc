@@ -0,0 +1,335 @@
+#include "resampler.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <numbers>
+#include <thread>
+
+namespace {
+    // 1画素(RGBA)を1つのSIMDレジスタで扱う
+    typedef float float4 __attribute__((vector_size(16)));
+
+    // これより少ない行数ではスレッドを分けない
+    const int kMinRowsPerBand = 32;
+
+    struct Weights {
+        int stride;
+        std::vector<int> begin;
+        std::vector<int> count;
+        std::vector<float> weight;
+    };
+
+    double sinc(double x) {
+        if (x == 0) {
+            return 1.0;
+        }
+        x *= std::numbers::pi;
+        return std::sin(x) / x;
+    }
+
+    double kernel(ResampleFilter filter, double x) {
+        x = std::abs(x);
+        switch (filter) {
+            case ResampleFilter::Linear:
+                return std::max(0.0, 1.0 - x);
+            case ResampleFilter::Bicubic:
+                {
+                    // Catmull-Rom
+                    const double a = -0.5;
+                    if (x < 1.0) {
+                        return (a + 2) * x * x * x - (a + 3) * x * x + 1;
+                    }
+                    if (x < 2.0) {
+                        return a * x * x * x - 5 * a * x * x + 8 * a * x - 4 * a;
+                    }
+                    return 0.0;
+                }
+            case ResampleFilter::Lanczos3:
+                if (x < 3.0) {
+                    return sinc(x) * sinc(x / 3.0);
+                }
+                return 0.0;
+            default:
+                return 0.0;
+        }
+    }
+
+    double support(ResampleFilter filter) {
+        switch (filter) {
+            case ResampleFilter::Linear:
+                return 1.0;
+            case ResampleFilter::Bicubic:
+                return 2.0;
+            case ResampleFilter::Lanczos3:
+                return 3.0;
+            default:
+                return 0.5;
+        }
+    }
+
+    Weights makeWeights(int src, int dst, ResampleFilter filter) {
+        Weights w;
+        double scale = dst / static_cast<double>(src);
+        std::vector<std::vector<float>> list(dst);
+        w.begin.resize(dst);
+        w.count.resize(dst);
+        w.stride = 0;
+        for (int i = 0; i < dst; i++) {
+            int begin, end;
+            std::vector<double> tmp;
+            if (filter == ResampleFilter::Area) {
+                // 出力画素が覆う範囲と入力画素の重なりを重みにする
+                double x0 = i / scale;
+                double x1 = (i + 1) / scale;
+                begin = std::max(0, static_cast<int>(std::floor(x0)));
+                end = std::min(src, static_cast<int>(std::ceil(x1)));
+                for (int j = begin; j < end; j++) {
+                    tmp.push_back(std::max(0.0, std::min(x1, j + 1.0) - std::max(x0, static_cast<double>(j))));
+                }
+            }
+            else {
+                // 縮小時はカーネルを広げる
+                double f = std::max(1.0, 1.0 / scale);
+                double center = (i + 0.5) / scale;
+                begin = std::max(0, static_cast<int>(std::floor(center - support(filter) * f)));
+                end = std::min(src, static_cast<int>(std::ceil(center + support(filter) * f)));
+                for (int j = begin; j < end; j++) {
+                    tmp.push_back(kernel(filter, (j + 0.5 - center) / f));
+                }
+            }
+            double sum = 0;
+            for (auto v : tmp) {
+                sum += v;
+            }
+            if (tmp.empty() || sum == 0) {
+                begin = std::min(src - 1, static_cast<int>(i / scale));
+                tmp = {1.0};
+                sum = 1.0;
+            }
+            w.begin[i] = begin;
+            w.count[i] = tmp.size();
+            for (auto v : tmp) {
+                list[i].push_back(v / sum);
+            }
+            w.stride = std::max<int>(w.stride, tmp.size());
+        }
+        w.weight.resize(dst * w.stride, 0.0f);
+        for (int i = 0; i < dst; i++) {
+            std::copy(list[i].begin(), list[i].end(), w.weight.begin() + i * w.stride);
+        }
+        return w;
+    }
+
+    // 1回のparallelで分けた帯
+    // 呼び出したスレッドも帯を取りに行くので、プールが他の拡縮で塞がっていても止まらない
+    struct Batch {
+        std::function<void(int, int)> f;
+        int n, band, bands;
+        std::atomic<int> next = 0;
+        std::mutex mutex;
+        std::condition_variable cond;
+        int finished = 0;
+
+        void run() {
+            int done = 0;
+            for (int i = next++; i < bands; i = next++) {
+                f(i * band, std::min(n, (i + 1) * band));
+                done++;
+            }
+            if (done == 0) {
+                return;
+            }
+            std::unique_lock<std::mutex> lock(mutex);
+            finished += done;
+            if (finished == bands) {
+                cond.notify_all();
+            }
+        }
+    };
+
+    // 拡縮は複数のスレッド(ImageCacheやPrefetcher)から呼ばれるので、プロセスで1つのプールを共有する
+    class Pool {
+        private:
+            std::mutex mutex_;
+            std::condition_variable cond_;
+            std::deque<std::shared_ptr<Batch>> queue_;
+            std::vector<std::thread> workers_;
+            bool alive_;
+
+        public:
+            Pool(int threads) : alive_(true) {
+                for (int i = 0; i < threads; i++) {
+                    workers_.emplace_back([this]() {
+                        while (true) {
+                            std::shared_ptr<Batch> batch;
+                            {
+                                std::unique_lock<std::mutex> lock(mutex_);
+                                cond_.wait(lock, [this]() { return !queue_.empty() || !alive_; });
+                                if (!alive_) {
+                                    return;
+                                }
+                                batch = std::move(queue_.front());
+                                queue_.pop_front();
+                            }
+                            batch->run();
+                        }
+                    });
+                }
+            }
+            ~Pool() {
+                {
+                    std::unique_lock<std::mutex> lock(mutex_);
+                    alive_ = false;
+                }
+                cond_.notify_all();
+                for (auto &th : workers_) {
+                    th.join();
+                }
+            }
+            // 手伝うスレッドをcount個まで起こす
+            void submit(const std::shared_ptr<Batch> &batch, int count) {
+                {
+                    std::unique_lock<std::mutex> lock(mutex_);
+                    for (int i = 0; i < count; i++) {
+                        queue_.push_back(batch);
+                    }
+                }
+                cond_.notify_all();
+            }
+    };
+
+    int concurrency() {
+        return std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    Pool &pool() {
+        // 呼び出したスレッドも帯を受け持つので1つ少なくてよい
+        static Pool p(concurrency() - 1);
+        return p;
+    }
+
+    template<typename F>
+    void parallel(int n, F f) {
+        int threads = std::min<int>(concurrency(), n / kMinRowsPerBand);
+        if (threads <= 1) {
+            f(0, n);
+            return;
+        }
+        auto batch = std::make_shared<Batch>();
+        batch->f = f;
+        batch->n = n;
+        batch->band = (n + threads - 1) / threads;
+        batch->bands = (n + batch->band - 1) / batch->band;
+        pool().submit(batch, batch->bands - 1);
+        batch->run();
+        std::unique_lock<std::mutex> lock(batch->mutex);
+        batch->cond.wait(lock, [&]() { return batch->finished == batch->bands; });
+    }
+
+    inline float4 splat(float v) {
+        return float4{v, v, v, v};
+    }
+}
+
+namespace resampler {
+    ResampleFilter toFilter(const std::string &name) {
+        if (name == "area") {
+            return ResampleFilter::Area;
+        }
+        if (name == "linear") {
+            return ResampleFilter::Linear;
+        }
+        if (name == "bicubic") {
+            return ResampleFilter::Bicubic;
+        }
+        if (name == "lanczos3") {
+            return ResampleFilter::Lanczos3;
+        }
+        return ResampleFilter::Auto;
+    }
+
+    std::vector<unsigned char> resize(const unsigned char *src, int src_w, int src_h, int dst_w, int dst_h, ResampleFilter filter, bool premultiplied) {
+        std::vector<unsigned char> dst(dst_w * dst_h * 4);
+        if (src_w <= 0 || src_h <= 0 || dst_w <= 0 || dst_h <= 0) {
+            return dst;
+        }
+        auto choose = [filter](int s, int d) {
+            if (filter != ResampleFilter::Auto) {
+                return filter;
+            }
+            return (d < s) ? (ResampleFilter::Area) : (ResampleFilter::Lanczos3);
+        };
+        Weights wx = makeWeights(src_w, dst_w, choose(src_w, dst_w));
+        Weights wy = makeWeights(src_h, dst_h, choose(src_h, dst_h));
+
+        // 横方向
+        std::vector<float4> tmp(src_h * dst_w);
+        parallel(src_h, [&](int begin, int end) {
+            std::vector<float4> row(src_w);
+            for (int y = begin; y < end; y++) {
+                const unsigned char *p = src + 4 * y * src_w;
+                for (int x = 0; x < src_w; x++) {
+                    float4 v = {
+                        static_cast<float>(p[4 * x + 0]),
+                        static_cast<float>(p[4 * x + 1]),
+                        static_cast<float>(p[4 * x + 2]),
+                        static_cast<float>(p[4 * x + 3]),
+                    };
+                    if (!premultiplied) {
+                        float a = p[4 * x + 3] / 255.0f;
+                        v *= float4{a, a, a, 1.0f};
+                    }
+                    row[x] = v;
+                }
+                float4 *out = &tmp[y * dst_w];
+                for (int x = 0; x < dst_w; x++) {
+                    const float *w = &wx.weight[x * wx.stride];
+                    const float4 *in = &row[wx.begin[x]];
+                    float4 acc = splat(0.0f);
+                    for (int k = 0; k < wx.count[x]; k++) {
+                        acc += in[k] * splat(w[k]);
+                    }
+                    out[x] = acc;
+                }
+            }
+        });
+
+        // 縦方向
+        parallel(dst_h, [&](int begin, int end) {
+            std::vector<float4> line(dst_w);
+            for (int y = begin; y < end; y++) {
+                std::fill(line.begin(), line.end(), splat(0.0f));
+                const float *w = &wy.weight[y * wy.stride];
+                for (int k = 0; k < wy.count[y]; k++) {
+                    const float4 *in = &tmp[(wy.begin[y] + k) * dst_w];
+                    float4 f = splat(w[k]);
+                    for (int x = 0; x < dst_w; x++) {
+                        line[x] += in[x] * f;
+                    }
+                }
+                unsigned char *out = &dst[4 * y * dst_w];
+                for (int x = 0; x < dst_w; x++) {
+                    float4 v = line[x];
+                    float a = std::min(std::max(v[3], 0.0f), 255.0f);
+                    float f = 1.0f;
+                    if (!premultiplied) {
+                        f = (a > 0) ? (255.0f / a) : (0.0f);
+                    }
+                    // リンギングで色がアルファを超えないようにする
+                    for (int c = 0; c < 3; c++) {
+                        float value = std::min(std::max(v[c], 0.0f), a) * f;
+                        out[4 * x + c] = static_cast<unsigned char>(value + 0.5f);
+                    }
+                    out[4 * x + 3] = static_cast<unsigned char>(a + 0.5f);
+                }
+            }
+        });
+        return dst;
+    }
+}
@@ -0,0 +1,19 @@
+#ifndef RESAMPLER_H_
+#define RESAMPLER_H_
+
+#include <string>
+#include <vector>
+
+enum class ResampleFilter {
+    Auto, Area, Linear, Bicubic, Lanczos3,
+};
+
+namespace resampler {
+    ResampleFilter toFilter(const std::string &name);
+
+    // RGBA8888の画像を拡縮する
+    // 計算は乗算済みアルファで行い、出力はpremultipliedの指定に合わせる
+    std::vector<unsigned char> resize(const unsigned char *src, int src_w, int src_h, int dst_w, int dst_h, ResampleFilter filter, bool premultiplied);
+}
+
+#endif // RESAMPLER_H_
@@ -4,9 +4,10 @@
 #include <iostream>
 
 #include "logger.h"
+#include "trace.h"
 
 void Seriko::update(bool change) {
-    auto now = std::chrono::system_clock::now();
+    auto now = Clock::now();
     int elapsed = (change) ? (0) : (std::chrono::duration_cast<std::chrono::milliseconds>(now - prev_time_).count());
     while (!process_.empty()) {
         process_.pop();
@@ -25,6 +26,24 @@ void Seriko::update(bool change) {
     prev_time_ = now;
 }
 
+std::optional<int> Seriko::nextDeadline() {
+    std::optional<int> deadline;
+    for (auto &[_, v] : actors_) {
+        if (!v.active()) {
+            continue;
+        }
+        if (!deadline || v.remaining() < deadline.value()) {
+            deadline = v.remaining();
+        }
+    }
+    if (deadline) {
+        auto now = Clock::now();
+        int elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(now - prev_time_).count();
+        deadline = std::max(0, deadline.value() - elapsed);
+    }
+    return deadline;
+}
+
 void Seriko::push(int id, int elapsed) {
     if (!actors_.contains(id)) {
         return;
@@ -67,7 +86,8 @@ void Seriko::inactivate(int id) {
 }
 
 ElementWithChildren Seriko::get(int id) {
-    if (!surfaces_.contains(id)) {
+    TRACE_ZONE("Seriko::get");
+    if (!surfaces_->contains(id)) {
         return {
             .method = Method::Overlay,
             .x = 0, .y = 0, .children = {}
@@ -79,14 +99,14 @@ ElementWithChildren Seriko::get(int id) {
     };
     if (current_id_ != id) {
         current_id_ = id;
-        if (!surfaces_.contains(id)) {
+        if (!surfaces_->contains(id)) {
             return {
                 .method = Method::Overlay,
                 .x = 0, .y = 0,
                 .children = {}
             };
         }
-        auto &surface = surfaces_.at(id);
+        auto &surface = surfaces_->at(id);
         actors_.clear();
         for (auto &[k, v] : surface.animation) {
             Actor actor = {k, v, this};
@@ -98,7 +118,7 @@ ElementWithChildren Seriko::get(int id) {
     else {
         update();
     }
-    auto &surface = surfaces_.at(id);
+    auto &surface = surfaces_->at(id);
     std::vector<int> list;
     list.reserve(std::max(surface.element.size(), actors_.size()));
     ret.children.reserve(surface.element.size());
@@ -108,7 +128,7 @@ ElementWithChildren Seriko::get(int id) {
     }
     std::sort(list.begin(), list.end());
     for (auto i : list) {
-        ret.children.emplace_back(surface.element[i]);
+        ret.children.emplace_back(surface.element.at(i));
     }
     list.clear();
     int allocate = ret.children.size();
@@ -147,11 +167,11 @@ ElementWithChildren Seriko::get(int id) {
 }
 
 std::vector<RenderInfo> Seriko::getElements(int id, std::unordered_set<int> &done) {
-    if (!surfaces_.contains(id)) {
+    if (!surfaces_->contains(id)) {
         return {};
     }
     std::vector<RenderInfo> ret;
-    auto &surface = surfaces_.at(id);
+    auto &surface = surfaces_->at(id);
     done.emplace(id);
     // TODO background
     for (auto &[_, v] : surface.element) {
@@ -163,9 +183,9 @@ std::vector<RenderInfo> Seriko::getElements(int id, std::unordered_set<int> &don
     }
     std::sort(list.begin(), list.end());
     for (auto i : list) {
-        auto &interval = surface.animation[i].interval;
+        auto &interval = surface.animation.at(i).interval;
         if (interval.size() == 1 && interval.contains(Interval::Bind)) {
-            auto ps = surface.animation[i].pattern;
+            auto &ps = surface.animation.at(i).pattern;
             for (auto &p : ps) {
                 if (!done.contains(p.id)) {
                     ElementWithChildren e = { p.method, p.x, p.y, getElements(p.id, done) };
@@ -177,16 +197,54 @@ std::vector<RenderInfo> Seriko::getElements(int id, std::unordered_set<int> &don
     return ret;
 }
 
+void Seriko::images(SurfaceTable &surfaces, int id, bool include_self, std::vector<ImagePath> &list) {
+    if (!surfaces.contains(id)) {
+        return;
+    }
+    auto add = [&](const Surface &surface) {
+        std::vector<int> keys;
+        for (auto &[k, _] : surface.element) {
+            keys.push_back(k);
+        }
+        std::sort(keys.begin(), keys.end());
+        for (auto k : keys) {
+            auto &e = surface.element.at(k);
+            ImagePath p = {e.filename, e.index};
+            if (std::find(list.begin(), list.end(), p) == list.end()) {
+                list.push_back(std::move(p));
+            }
+        }
+    };
+    auto &surface = surfaces.at(id);
+    if (include_self) {
+        add(surface);
+    }
+    std::vector<int> keys;
+    for (auto &[k, _] : surface.animation) {
+        keys.push_back(k);
+    }
+    std::sort(keys.begin(), keys.end());
+    for (auto k : keys) {
+        for (auto &p : surface.animation.at(k).pattern) {
+            // -1は何も表示しない
+            if (p.id == -1 || p.id == id || !surfaces.contains(p.id)) {
+                continue;
+            }
+            add(surfaces.at(p.id));
+        }
+    }
+}
+
 std::vector<CollisionInfo> Seriko::getCollision(int id) {
-    if (!surfaces_.contains(id)) {
+    if (!surfaces_->contains(id)) {
         return {};
     }
     if (current_id_ != id) {
         current_id_ = id;
-        if (!surfaces_.contains(id)) {
+        if (!surfaces_->contains(id)) {
             return {};
         }
-        auto &surface = surfaces_.at(id);
+        auto &surface = surfaces_->at(id);
         actors_.clear();
         for (auto &[k, v] : surface.animation) {
             Actor actor = {k, v, this};
@@ -203,7 +261,7 @@ std::vector<CollisionInfo> Seriko::getCollision(int id) {
     auto comp = [](const Collision &a, const Collision &b) {
         return a.factor > b.factor;
     };
-    auto &surface = surfaces_.at(id);
+    auto &surface = surfaces_->at(id);
     // TODO background
     {
         CollisionInfo info = {0, 0, {}};
@@ -224,10 +282,10 @@ std::vector<CollisionInfo> Seriko::getCollision(int id) {
         auto &actor = actors_.at(i);
         auto p = actor.currentPattern();
         int id = p.id;
-        if (!surfaces_.contains(id)) {
+        if (!surfaces_->contains(id)) {
             continue;
         }
-        auto &s = surfaces_.at(id);
+        auto &s = surfaces_->at(id);
         CollisionInfo info = {p.x, p.y, {}};
         for (auto &[_, v] : s.collision) {
             info.list.push_back(v);
@@ -254,6 +312,10 @@ void Seriko::bind(int id, bool enable) {
     else {
         actors_.at(id).inactivate();
     }
+    // 単体で動かす(ベンチマークなど)ときは親が無い
+    if (!parent_) {
+        return;
+    }
     auto addids = parent_->getBindAddId(id);
     for (auto e : addids) {
         if (enable) {
@@ -280,7 +342,7 @@ bool Seriko::isBinding(int id) {
 void Seriko::updateBind() {
     for (auto &[k, _] : actors_) {
         if (!binds_.contains(k)) {
-            binds_[k] = parent_->isBinding(k);
+            binds_[k] = (parent_) ? (parent_->isBinding(k)) : (false);
             Logger::log("updateBind: ", k, binds_[k]);
             assert(binds_.contains(k));
             bind(k, binds_.at(k));
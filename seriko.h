@@ -2,14 +2,19 @@
 #define SERIKO_H_
 
 #include <iostream>
+#include <memory>
+#include <optional>
 #include <queue>
 #include <variant>
 #include <vector>
 
 #include "actor.h"
 #include "character.h"
+#include "clock.h"
 #include "element.h"
+#include "image_cache.h"
 #include "surface.h"
+#include "surface_table.h"
 
 class Actor;
 
@@ -34,9 +39,9 @@ class Character;
 class Seriko {
     private:
         int current_id_;
-        std::unordered_map<int, Surface> surfaces_;
+        std::shared_ptr<SurfaceTable> surfaces_;
         std::unordered_map<int, Actor> actors_;
-        std::chrono::system_clock::time_point prev_time_;
+        Clock::time_point prev_time_;
         std::priority_queue<ActorWithPriority, std::vector<ActorWithPriority>, Compare> process_;
         Character *parent_;
         std::unordered_map<int, bool> binds_;
@@ -44,7 +49,7 @@ class Seriko {
         void update(bool change = false);
         void updateBind();
     public:
-        Seriko(const std::unordered_map<int, Surface> &surfaces) : current_id_(-1), surfaces_(surfaces) {}
+        Seriko(std::shared_ptr<SurfaceTable> surfaces) : current_id_(-1), surfaces_(surfaces), parent_(nullptr) {}
         ~Seriko() {}
         void setParent(Character *parent) {
             parent_ = parent;
@@ -54,8 +59,17 @@ class Seriko {
         void activate(From from, int id, int elapsed);
         void inactivate(int id);
         ElementWithChildren get(int id);
+        // 次にアニメーションが切り替わるまでの時間(ms)
+        std::optional<int> nextDeadline();
         std::vector<RenderInfo> getElements(int id, std::unordered_set<int> &done);
         std::vector<CollisionInfo> getCollision(int id);
+        // idのサーフェスとそのアニメーション(bindを含む)が参照するサーフェスで使う画像を集める
+        // include_self: id自身の要素も含めるか
+        // Serikoの状態は使わないのでどのスレッドから呼んでもよい
+        static void images(SurfaceTable &surfaces, int id, bool include_self, std::vector<ImagePath> &list);
+        std::shared_ptr<SurfaceTable> surfaces() const {
+            return surfaces_;
+        }
         void bind(int id, bool enable);
         bool isBinding(int id);
 };
@@ -0,0 +1,409 @@
+#include "shell_cache.h"
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+#include "logger.h"
+#include "mapped_file.h"
+
+namespace {
+    const char kMagic[4] = {'A', 'O', 'S', 'C'};
+    // Surfaceなどの構造を変えたら上げる
+    constexpr uint32_t kFormatVersion = 2;
+
+    struct Stamp {
+        std::string path;
+        int64_t mtime;
+        uint64_t size;
+        bool operator==(const Stamp &rhs) const {
+            return path == rhs.path && mtime == rhs.mtime && size == rhs.size;
+        }
+    };
+
+    // Windowsでも文字化けしないようにUTF-8で保存する
+    std::string toString(const std::filesystem::path &path) {
+        auto u = path.u8string();
+        return std::string(u.begin(), u.end());
+    }
+
+    std::filesystem::path toPath(const std::string &s) {
+        return std::u8string(s.begin(), s.end());
+    }
+
+    std::optional<Stamp> stamp(const std::filesystem::path &path) {
+        std::error_code ec;
+        auto mtime = std::filesystem::last_write_time(path, ec);
+        if (ec) {
+            return std::nullopt;
+        }
+        auto size = std::filesystem::file_size(path, ec);
+        if (ec) {
+            return std::nullopt;
+        }
+        return Stamp{toString(path), static_cast<int64_t>(mtime.time_since_epoch().count()), size};
+    }
+
+    std::filesystem::path location(const std::filesystem::path &shell_dir) {
+        std::filesystem::path dir;
+        if (getenv("XDG_CACHE_HOME") && *getenv("XDG_CACHE_HOME")) {
+            dir = getenv("XDG_CACHE_HOME");
+        }
+        else if (getenv("LOCALAPPDATA")) {
+            dir = getenv("LOCALAPPDATA");
+        }
+        else if (getenv("HOME")) {
+            dir = std::filesystem::path(getenv("HOME")) / ".cache";
+        }
+        else {
+            return {};
+        }
+        std::error_code ec;
+        auto canonical = std::filesystem::weakly_canonical(shell_dir, ec);
+        size_t hash = std::hash<std::string>()(((ec) ? (shell_dir) : (canonical)).string());
+        char name[32];
+        snprintf(name, sizeof(name), "shell-%016zx.bin", hash);
+        return dir / "ao" / name;
+    }
+
+    class Writer {
+        private:
+            std::string buffer_;
+        public:
+            template<typename T>
+            void put(T value) {
+                static_assert(std::is_trivially_copyable_v<T>);
+                buffer_.append(reinterpret_cast<const char *>(&value), sizeof(value));
+            }
+            void putString(std::string_view s) {
+                put<uint32_t>(s.size());
+                buffer_.append(s);
+            }
+            const std::string &data() const {
+                return buffer_;
+            }
+    };
+
+    class Reader {
+        private:
+            std::string_view data_;
+            bool ok_;
+        public:
+            Reader(std::string_view data) : data_(data), ok_(true) {}
+            bool ok() const {
+                return ok_;
+            }
+            template<typename T>
+            T get() {
+                static_assert(std::is_trivially_copyable_v<T>);
+                T value = {};
+                if (data_.size() < sizeof(T)) {
+                    ok_ = false;
+                    return value;
+                }
+                std::memcpy(&value, data_.data(), sizeof(T));
+                data_.remove_prefix(sizeof(T));
+                return value;
+            }
+            std::string getString() {
+                uint32_t n = get<uint32_t>();
+                if (!ok_ || data_.size() < n) {
+                    ok_ = false;
+                    return {};
+                }
+                std::string s(data_.substr(0, n));
+                data_.remove_prefix(n);
+                return s;
+            }
+            // 要素数(壊れたファイルで巨大な領域を確保しないように残りの大きさで抑える)
+            uint32_t getCount() {
+                uint32_t n = get<uint32_t>();
+                if (n > data_.size()) {
+                    ok_ = false;
+                    return 0;
+                }
+                return n;
+            }
+    };
+
+    void putStamps(Writer &w, const std::vector<Stamp> &stamps) {
+        w.put<uint32_t>(stamps.size());
+        for (auto &s : stamps) {
+            w.putString(s.path);
+            w.put(s.mtime);
+            w.put(s.size);
+        }
+    }
+
+    std::vector<Stamp> getStamps(Reader &r) {
+        std::vector<Stamp> stamps(r.getCount());
+        for (auto &s : stamps) {
+            s.path = r.getString();
+            s.mtime = r.get<int64_t>();
+            s.size = r.get<uint64_t>();
+        }
+        return stamps;
+    }
+
+    void putSurface(Writer &w, const Surface &surface) {
+        w.put<uint32_t>(surface.element.size());
+        for (auto &[k, e] : surface.element) {
+            w.put<int32_t>(k);
+            w.put<int32_t>(static_cast<int32_t>(e.method));
+            w.put<int32_t>(e.x);
+            w.put<int32_t>(e.y);
+            w.putString(toString(e.filename));
+            w.put<int32_t>(e.index.value_or(-1));
+        }
+        w.put<uint32_t>(surface.animation.size());
+        for (auto &[k, a] : surface.animation) {
+            w.put<int32_t>(k);
+            w.put<uint32_t>(a.interval.size());
+            for (auto i : a.interval) {
+                w.put<int32_t>(static_cast<int32_t>(i));
+            }
+            w.put<int32_t>(a.interval_factor);
+            w.put<uint32_t>(a.pattern.size());
+            for (auto &p : a.pattern) {
+                w.put<int32_t>(static_cast<int32_t>(p.method));
+                w.put<int32_t>(p.index);
+                w.put<int32_t>(p.id);
+                w.put<int32_t>(p.wait_min);
+                w.put<int32_t>(p.wait_max);
+                w.put<int32_t>(p.x);
+                w.put<int32_t>(p.y);
+                w.put<uint32_t>(p.ids.size());
+                for (auto id : p.ids) {
+                    w.put<int32_t>(id);
+                }
+            }
+            w.put<uint8_t>(a.exclusive.has_value());
+            if (a.exclusive) {
+                w.put<uint32_t>(a.exclusive->size());
+                for (auto id : a.exclusive.value()) {
+                    w.put<int32_t>(id);
+                }
+            }
+            w.put<uint8_t>(a.background);
+            w.put<uint8_t>(a.shared_index);
+        }
+        w.put<uint32_t>(surface.collision.size());
+        for (auto &[k, c] : surface.collision) {
+            w.put<int32_t>(k);
+            w.put<int32_t>(c.factor);
+            w.put<int32_t>(static_cast<int32_t>(c.type));
+            w.putString(c.id);
+            w.put<uint32_t>(c.point.size());
+            for (auto p : c.point) {
+                w.put<int32_t>(p);
+            }
+        }
+    }
+
+    Surface getSurface(Reader &r) {
+        Surface surface;
+        for (uint32_t n = r.getCount(); n > 0 && r.ok(); n--) {
+            int k = r.get<int32_t>();
+            Element e;
+            e.method = static_cast<Method>(r.get<int32_t>());
+            e.x = r.get<int32_t>();
+            e.y = r.get<int32_t>();
+            e.filename = toPath(r.getString());
+            int index = r.get<int32_t>();
+            if (index >= 0) {
+                e.index = index;
+            }
+            surface.element[k] = e;
+        }
+        for (uint32_t n = r.getCount(); n > 0 && r.ok(); n--) {
+            int k = r.get<int32_t>();
+            Animation a;
+            for (uint32_t m = r.getCount(); m > 0 && r.ok(); m--) {
+                a.interval.emplace(static_cast<Interval>(r.get<int32_t>()));
+            }
+            a.interval_factor = r.get<int32_t>();
+            a.pattern.resize(r.getCount());
+            for (auto &p : a.pattern) {
+                p.method = static_cast<Method>(r.get<int32_t>());
+                p.index = r.get<int32_t>();
+                p.id = r.get<int32_t>();
+                p.wait_min = r.get<int32_t>();
+                p.wait_max = r.get<int32_t>();
+                p.x = r.get<int32_t>();
+                p.y = r.get<int32_t>();
+                p.ids.resize(r.getCount());
+                for (auto &id : p.ids) {
+                    id = r.get<int32_t>();
+                }
+            }
+            if (r.get<uint8_t>()) {
+                std::vector<int> exclusive(r.getCount());
+                for (auto &id : exclusive) {
+                    id = r.get<int32_t>();
+                }
+                a.exclusive = std::move(exclusive);
+            }
+            a.background = r.get<uint8_t>();
+            a.shared_index = r.get<uint8_t>();
+            surface.animation[k] = std::move(a);
+        }
+        for (uint32_t n = r.getCount(); n > 0 && r.ok(); n--) {
+            int k = r.get<int32_t>();
+            Collision c;
+            c.factor = r.get<int32_t>();
+            c.type = static_cast<CollisionType>(r.get<int32_t>());
+            c.id = r.getString();
+            c.point.resize(r.getCount());
+            for (auto &p : c.point) {
+                p = r.get<int32_t>();
+            }
+            surface.collision[k] = std::move(c);
+        }
+        return surface;
+    }
+
+    void putLayer(Writer &w, const SurfaceLayer &layer) {
+        w.put<uint32_t>(layer.ids.ranges().size());
+        for (auto [first, last] : layer.ids.ranges()) {
+            w.put<int32_t>(first);
+            w.put<int32_t>(last);
+        }
+        w.put<uint8_t>(layer.append);
+        putSurface(w, *layer.surface);
+    }
+
+    SurfaceLayer getLayer(Reader &r) {
+        SurfaceLayer layer;
+        for (uint32_t n = r.getCount(); n > 0 && r.ok(); n--) {
+            int first = r.get<int32_t>();
+            int last = r.get<int32_t>();
+            layer.ids.add(first, last);
+        }
+        layer.append = r.get<uint8_t>();
+        layer.surface = std::make_shared<const Surface>(getSurface(r));
+        return layer;
+    }
+}
+
+namespace shell_cache {
+    bool load(const std::filesystem::path &shell_dir, const std::vector<std::filesystem::path> &listed, int &version, SurfaceTable &table) {
+        if (getenv("AO_DISABLE_SHELL_CACHE")) {
+            return false;
+        }
+        auto path = location(shell_dir);
+        if (path.empty() || !std::filesystem::exists(path)) {
+            return false;
+        }
+        MappedFile file(path);
+        Reader r(file.view());
+        char magic[4];
+        for (auto &c : magic) {
+            c = r.get<char>();
+        }
+        if (!r.ok() || std::memcmp(magic, kMagic, sizeof(magic)) != 0 || r.get<uint32_t>() != kFormatVersion) {
+            return false;
+        }
+        // ファイルが増えたり減ったりしていないか
+        auto stored = getStamps(r);
+        if (!r.ok() || stored.size() != listed.size()) {
+            return false;
+        }
+        for (size_t i = 0; i < listed.size(); i++) {
+            auto s = stamp(listed[i]);
+            if (!s || !(s.value() == stored[i])) {
+                return false;
+            }
+        }
+        for (auto &s : getStamps(r)) {
+            auto current = stamp(toPath(s.path));
+            if (!current || !(current.value() == s)) {
+                return false;
+            }
+        }
+        int v = r.get<int32_t>();
+        std::unordered_map<int, Surface> bases;
+        for (uint32_t n = r.getCount(); n > 0 && r.ok(); n--) {
+            int k = r.get<int32_t>();
+            bases[k] = getSurface(r);
+        }
+        std::vector<SurfaceLayer> layers;
+        for (uint32_t n = r.getCount(); n > 0 && r.ok(); n--) {
+            layers.push_back(getLayer(r));
+        }
+        if (!r.ok()) {
+            Logger::info("shell cache: broken", path);
+            return false;
+        }
+        version = v;
+        for (auto &[k, surface] : bases) {
+            table.base(k) = std::move(surface);
+        }
+        for (auto &layer : layers) {
+            table.addLayer(std::move(layer));
+        }
+        return true;
+    }
+
+    void store(const std::filesystem::path &shell_dir, const std::vector<std::filesystem::path> &listed, const std::vector<std::filesystem::path> &imported, int version, const SurfaceTable &table) {
+        if (getenv("AO_DISABLE_SHELL_CACHE")) {
+            return;
+        }
+        auto path = location(shell_dir);
+        if (path.empty()) {
+            return;
+        }
+        std::vector<Stamp> listed_stamps, imported_stamps;
+        for (auto &p : listed) {
+            auto s = stamp(p);
+            if (!s) {
+                return;
+            }
+            listed_stamps.push_back(s.value());
+        }
+        for (auto &p : imported) {
+            auto s = stamp(p);
+            if (!s) {
+                return;
+            }
+            imported_stamps.push_back(s.value());
+        }
+        Writer w;
+        for (auto c : kMagic) {
+            w.put(c);
+        }
+        w.put(kFormatVersion);
+        putStamps(w, listed_stamps);
+        putStamps(w, imported_stamps);
+        w.put<int32_t>(version);
+        w.put<uint32_t>(table.bases().size());
+        for (auto &[k, v] : table.bases()) {
+            w.put<int32_t>(k);
+            putSurface(w, v);
+        }
+        w.put<uint32_t>(table.layers().size());
+        for (auto &layer : table.layers()) {
+            putLayer(w, layer);
+        }
+        std::error_code ec;
+        std::filesystem::create_directories(path.parent_path(), ec);
+        // 書きかけのファイルを読まないように別名で書いてから置き換える
+        auto tmp = path;
+        tmp += ".tmp";
+        {
+            std::ofstream ofs(tmp, std::ios::binary);
+            ofs.write(w.data().data(), w.data().size());
+            if (!ofs) {
+                Logger::warn("shell cache: failed to write", tmp);
+                return;
+            }
+        }
+        std::filesystem::rename(tmp, path, ec);
+        if (ec) {
+            Logger::warn("shell cache: failed to write", path);
+        }
+    }
+}
@@ -0,0 +1,18 @@
+#ifndef SHELL_CACHE_H_
+#define SHELL_CACHE_H_
+
+#include <filesystem>
+#include <vector>
+
+#include "surface_table.h"
+
+// surfaces*.txtを解析した結果をバイナリで保存し、次回の起動で読み込む
+// 元になったファイルの更新日時と大きさが変わっていれば使わない
+namespace shell_cache {
+    // listed: シェルのディレクトリにあるsurface*.png/surfaces*.txt
+    // imported: 解析中に読み込んだファイル(アニメーション画像)
+    bool load(const std::filesystem::path &shell_dir, const std::vector<std::filesystem::path> &listed, int &version, SurfaceTable &table);
+    void store(const std::filesystem::path &shell_dir, const std::vector<std::filesystem::path> &listed, const std::vector<std::filesystem::path> &imported, int version, const SurfaceTable &table);
+}
+
+#endif // SHELL_CACHE_H_
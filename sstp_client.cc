@@ -0,0 +1,380 @@
+#include "sstp_client.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include "misc.h"
+
+#if defined(IS_WINDOWS)
+#include <ws2tcpip.h>
+#include <afunix.h>
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#undef max
+#undef min
+#else
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif // WIN32
+
+#if defined(USE_EPOLL)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif // USE_EPOLL
+
+#include "logger.h"
+#include "metrics.h"
+
+namespace {
+#ifndef IS_WINDOWS
+    inline int closesocket(int fd) {
+        return close(fd);
+    }
+    const auto SD_SEND = SHUT_WR;
+#endif
+
+    // 応答は大抵数百バイトだがスクリプトを返すこともある
+    constexpr size_t kBufferSize = 64 * 1024;
+
+    // sendは要求を受け付けてからコールバックを呼ぶまで(順番待ちを含む)
+    metrics::Histogram &round_trip = metrics::histogram("sstp.round_trip_us");
+    metrics::Histogram &sync_round_trip = metrics::histogram("sstp.sync_round_trip_us");
+    metrics::Counter &failures = metrics::counter("sstp.failures");
+    metrics::Gauge &pending_depth = metrics::gauge("sstp.pending");
+    metrics::Gauge &in_flight = metrics::gauge("sstp.in_flight");
+#if defined(USE_EPOLL)
+    constexpr int kMaxEvents = 16;
+#endif // USE_EPOLL
+
+    bool toAddress(const std::string &path, sockaddr_un &addr) {
+        if (path.empty() || path.length() >= sizeof(addr.sun_path)) {
+            return false;
+        }
+        memset(&addr, 0, sizeof(sockaddr_un));
+        addr.sun_family = AF_UNIX;
+        // null-terminatedも書き込ませる
+        strncpy(addr.sun_path, path.c_str(), path.length() + 1);
+        return true;
+    }
+}
+
+SSTPClient::SSTPClient(int max_in_flight, int timeout_ms)
+    : alive_(true), max_in_flight_(std::max(1, max_in_flight)),
+    timeout_(timeout_ms), buffer_(kBufferSize)
+#if defined(USE_EPOLL)
+    , epoll_fd_(-1), event_fd_(-1)
+#endif // USE_EPOLL
+{
+#if defined(USE_EPOLL)
+    epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epoll_fd_ == -1 || event_fd_ == -1) {
+        Logger::error("sstp: failed to create epoll:", strerror(errno));
+    }
+    else {
+        epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.fd = event_fd_;
+        epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, event_fd_, &ev);
+    }
+#endif // USE_EPOLL
+    th_ = std::make_unique<std::thread>(&SSTPClient::run, this);
+}
+
+SSTPClient::~SSTPClient() {
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        alive_ = false;
+    }
+    cond_.notify_one();
+#if defined(USE_EPOLL)
+    if (event_fd_ != -1) {
+        uint64_t one = 1;
+        write(event_fd_, &one, sizeof(one));
+    }
+#endif // USE_EPOLL
+    th_->join();
+#if defined(USE_EPOLL)
+    for (auto &[fd, _] : connections_) {
+        closesocket(fd);
+    }
+    if (event_fd_ != -1) {
+        close(event_fd_);
+    }
+    if (epoll_fd_ != -1) {
+        close(epoll_fd_);
+    }
+#endif // USE_EPOLL
+}
+
+void SSTPClient::send(const std::string &path, std::string request, Callback callback) {
+    auto begin = std::chrono::steady_clock::now();
+    Callback timed = [begin, callback = std::move(callback)](std::optional<std::string> res) {
+        round_trip.record(std::chrono::steady_clock::now() - begin);
+        if (!res) {
+            failures.add();
+        }
+        if (callback) {
+            callback(std::move(res));
+        }
+    };
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        pending_.push_back({path, std::move(request), std::move(timed)});
+        pending_depth.set(pending_.size());
+    }
+    cond_.notify_one();
+#if defined(USE_EPOLL)
+    if (event_fd_ != -1) {
+        uint64_t one = 1;
+        write(event_fd_, &one, sizeof(one));
+    }
+#endif // USE_EPOLL
+}
+
+std::optional<std::string> SSTPClient::sendSync(const std::string &path, const std::string &request) {
+    auto begin = std::chrono::steady_clock::now();
+    auto res = exchange(path, request);
+    sync_round_trip.record(std::chrono::steady_clock::now() - begin);
+    if (!res) {
+        failures.add();
+    }
+    return res;
+}
+
+std::optional<std::string> SSTPClient::exchange(const std::string &path, const std::string &request) {
+    sockaddr_un addr;
+    if (!toAddress(path, addr)) {
+        return std::nullopt;
+    }
+    auto soc = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (soc == -1) {
+        return std::nullopt;
+    }
+#if defined(IS_WINDOWS)
+    DWORD timeout = timeout_.count();
+#else
+    timeval timeout = {static_cast<time_t>(timeout_.count() / 1000), static_cast<suseconds_t>((timeout_.count() % 1000) * 1000)};
+#endif // WIN32
+    setsockopt(soc, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char *>(&timeout), sizeof(timeout));
+    if (connect(soc, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) == -1) {
+        closesocket(soc);
+        return std::nullopt;
+    }
+    if (static_cast<size_t>(::send(soc, request.c_str(), request.size(), 0)) != request.size()) {
+        closesocket(soc);
+        return std::nullopt;
+    }
+    shutdown(soc, SD_SEND);
+    // 他のスレッドからも呼ばれるのでバッファは共有しない
+    std::vector<char> buffer(kBufferSize);
+    std::string data;
+    while (true) {
+        int ret = recv(soc, buffer.data(), buffer.size(), 0);
+        if (ret == -1) {
+            closesocket(soc);
+            return std::nullopt;
+        }
+        if (ret == 0) {
+            closesocket(soc);
+            break;
+        }
+        data.append(buffer.data(), ret);
+    }
+    return data;
+}
+
+#if defined(USE_EPOLL)
+bool SSTPClient::open(Pending &p) {
+    sockaddr_un addr;
+    if (!toAddress(p.path, addr)) {
+        return false;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return false;
+    }
+    if (connect(fd, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) == -1 && errno != EINPROGRESS) {
+        Logger::warn("sstp: connect:", strerror(errno));
+        close(fd);
+        return false;
+    }
+    epoll_event ev = {};
+    ev.events = EPOLLOUT;
+    ev.data.fd = fd;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        close(fd);
+        return false;
+    }
+    connections_.emplace(fd, Connection{fd, std::move(p.request), 0, {}, std::chrono::steady_clock::now() + timeout_, std::move(p.callback)});
+    in_flight.set(connections_.size());
+    return true;
+}
+
+void SSTPClient::finish(int fd, bool ok) {
+    auto node = connections_.extract(fd);
+    if (node.empty()) {
+        return;
+    }
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+    close(fd);
+    in_flight.set(connections_.size());
+    auto &c = node.mapped();
+    if (c.callback) {
+        if (ok) {
+            c.callback(std::move(c.response));
+        }
+        else {
+            c.callback(std::nullopt);
+        }
+    }
+}
+
+void SSTPClient::onWritable(Connection &c) {
+    while (c.written < c.request.size()) {
+        ssize_t ret = ::send(c.fd, c.request.data() + c.written, c.request.size() - c.written, MSG_NOSIGNAL);
+        if (ret == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+            finish(c.fd, false);
+            return;
+        }
+        c.written += ret;
+    }
+    // SSTPは送り終わったことを相手に伝えてから応答を読む
+    shutdown(c.fd, SHUT_WR);
+    epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.fd = c.fd;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, c.fd, &ev);
+}
+
+void SSTPClient::onReadable(Connection &c) {
+    while (true) {
+        ssize_t ret = recv(c.fd, buffer_.data(), buffer_.size(), 0);
+        if (ret > 0) {
+            c.response.append(buffer_.data(), ret);
+            continue;
+        }
+        if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        finish(c.fd, ret == 0);
+        return;
+    }
+}
+
+void SSTPClient::expire() {
+    auto now = std::chrono::steady_clock::now();
+    std::vector<int> expired;
+    for (auto &[fd, c] : connections_) {
+        if (c.deadline <= now) {
+            expired.push_back(fd);
+        }
+    }
+    for (auto fd : expired) {
+        Logger::warn("sstp: timed out");
+        finish(fd, false);
+    }
+}
+
+int SSTPClient::nextTimeout() const {
+    if (connections_.empty()) {
+        return -1;
+    }
+    auto deadline = std::chrono::steady_clock::time_point::max();
+    for (auto &[_, c] : connections_) {
+        deadline = std::min(deadline, c.deadline);
+    }
+    auto now = std::chrono::steady_clock::now();
+    if (deadline <= now) {
+        return 0;
+    }
+    return std::chrono::ceil<std::chrono::milliseconds>(deadline - now).count();
+}
+
+void SSTPClient::runEpoll() {
+    epoll_event events[kMaxEvents];
+    while (true) {
+        std::vector<Pending> list;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            if (!alive_) {
+                break;
+            }
+            while (!pending_.empty() && connections_.size() + list.size() < static_cast<size_t>(max_in_flight_)) {
+                list.push_back(std::move(pending_.front()));
+                pending_.pop_front();
+            }
+            pending_depth.set(pending_.size());
+        }
+        for (auto &p : list) {
+            if (!open(p) && p.callback) {
+                p.callback(std::nullopt);
+            }
+        }
+        int n = epoll_wait(epoll_fd_, events, kMaxEvents, nextTimeout());
+        if (n == -1 && errno != EINTR) {
+            Logger::error("sstp: epoll_wait:", strerror(errno));
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd == event_fd_) {
+                uint64_t count;
+                read(event_fd_, &count, sizeof(count));
+                continue;
+            }
+            auto it = connections_.find(fd);
+            if (it == connections_.end()) {
+                continue;
+            }
+            auto &c = it->second;
+            if (c.written < c.request.size()) {
+                onWritable(c);
+            }
+            else {
+                onReadable(c);
+            }
+        }
+        expire();
+    }
+}
+#endif // USE_EPOLL
+
+void SSTPClient::runSerial() {
+    while (true) {
+        Pending p;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cond_.wait(lock, [this]() { return !pending_.empty() || !alive_; });
+            if (!alive_) {
+                break;
+            }
+            p = std::move(pending_.front());
+            pending_.pop_front();
+            pending_depth.set(pending_.size());
+        }
+        in_flight.set(1);
+        auto res = exchange(p.path, p.request);
+        in_flight.set(0);
+        if (p.callback) {
+            p.callback(std::move(res));
+        }
+    }
+}
+
+void SSTPClient::run() {
+#if defined(USE_EPOLL)
+    if (epoll_fd_ != -1 && event_fd_ != -1) {
+        runEpoll();
+        return;
+    }
+#endif // USE_EPOLL
+    // epollが使えなければ1つずつ送る
+    runSerial();
+}
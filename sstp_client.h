@@ -0,0 +1,83 @@
+#ifndef SSTP_CLIENT_H_
+#define SSTP_CLIENT_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__linux__)
+#define USE_EPOLL
+#endif // Linux
+
+// ベースウェアのSSTPサーバに要求を送る
+// 応答を待たずに複数の接続を同時に扱う(epollが無い環境では1つずつ送る)
+class SSTPClient {
+    public:
+        // 失敗や時間切れの時はstd::nullopt
+        using Callback = std::function<void(std::optional<std::string>)>;
+
+    private:
+        struct Pending {
+            std::string path;
+            std::string request;
+            Callback callback;
+        };
+
+#if defined(USE_EPOLL)
+        struct Connection {
+            int fd;
+            std::string request;
+            size_t written;
+            std::string response;
+            std::chrono::steady_clock::time_point deadline;
+            Callback callback;
+        };
+#endif // USE_EPOLL
+
+        bool alive_;
+        int max_in_flight_;
+        std::chrono::milliseconds timeout_;
+        std::mutex mutex_;
+        std::condition_variable cond_;
+        std::deque<Pending> pending_;
+        std::unique_ptr<std::thread> th_;
+        // 受信用のバッファは使い回す
+        std::vector<char> buffer_;
+#if defined(USE_EPOLL)
+        int epoll_fd_;
+        // 新しい要求が来たことを知らせる
+        int event_fd_;
+        std::unordered_map<int, Connection> connections_;
+
+        bool open(Pending &p);
+        void finish(int fd, bool ok);
+        void onWritable(Connection &c);
+        void onReadable(Connection &c);
+        void expire();
+        int nextTimeout() const;
+        void runEpoll();
+#endif // USE_EPOLL
+
+        // 1つの接続で送って応答を読み切る
+        std::optional<std::string> exchange(const std::string &path, const std::string &request);
+        void runSerial();
+        void run();
+
+    public:
+        SSTPClient(int max_in_flight, int timeout_ms);
+        ~SSTPClient();
+        // callbackはクライアントのスレッドから呼ばれる
+        void send(const std::string &path, std::string request, Callback callback);
+        // 応答が来るまで待つ
+        std::optional<std::string> sendSync(const std::string &path, const std::string &request);
+};
+
+#endif // SSTP_CLIENT_H_
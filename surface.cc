@@ -1,59 +1,190 @@
 #include "surface.h"
 
+#include <cassert>
+#include <cmath>
+
 #include "image_cache.h"
 #include "logger.h"
 
-std::unique_ptr<WrapTexture> Element::getTexture(SDL_Renderer *renderer, std::unique_ptr<TextureCache> &texture_cache, std::unique_ptr<ImageCache> &image_cache, int scale) const {
-    auto &src = texture_cache->get(filename, index, renderer, image_cache);
-    auto dst = std::make_unique<WrapTexture>(renderer, src->width(), src->height(), src->isUpconverted());
-    SDL_BlendMode mode = SDL_ComposeCustomBlendMode(SDL_BLENDFACTOR_SRC_ALPHA, SDL_BLENDFACTOR_ONE_MINUS_SRC_ALPHA, SDL_BLENDOPERATION_ADD, SDL_BLENDFACTOR_ONE, SDL_BLENDFACTOR_ONE, SDL_BLENDOPERATION_ADD);
+SDL_BlendMode toBlendMode(Method method) {
     switch (method) {
-        case Method::Base:
-        case Method::Add:
-        case Method::Overlay:
-            break;
         case Method::OverlayFast:
-            mode = SDL_ComposeCustomBlendMode(SDL_BLENDFACTOR_DST_ALPHA, SDL_BLENDFACTOR_ONE_MINUS_SRC_ALPHA, SDL_BLENDOPERATION_ADD, SDL_BLENDFACTOR_ONE, SDL_BLENDFACTOR_ONE, SDL_BLENDOPERATION_ADD);
-            break;
+            // 下地が不透明な部分にだけ重ねる
+            return SDL_ComposeCustomBlendMode(SDL_BLENDFACTOR_DST_ALPHA, SDL_BLENDFACTOR_ONE_MINUS_SRC_ALPHA, SDL_BLENDOPERATION_ADD, SDL_BLENDFACTOR_ZERO, SDL_BLENDFACTOR_ONE, SDL_BLENDOPERATION_ADD);
         case Method::OverlayMultiply:
-            // FIXME
-            mode = SDL_ComposeCustomBlendMode(SDL_BLENDFACTOR_ZERO, SDL_BLENDFACTOR_SRC_COLOR, SDL_BLENDOPERATION_ADD, SDL_BLENDFACTOR_ONE, SDL_BLENDFACTOR_ONE, SDL_BLENDOPERATION_ADD);
-            break;
+            // dst * src + dst * (1 - src_alpha)
+            return SDL_ComposeCustomBlendMode(SDL_BLENDFACTOR_DST_COLOR, SDL_BLENDFACTOR_ONE_MINUS_SRC_ALPHA, SDL_BLENDOPERATION_ADD, SDL_BLENDFACTOR_ZERO, SDL_BLENDFACTOR_ONE, SDL_BLENDOPERATION_ADD);
         case Method::Replace:
-            mode = SDL_ComposeCustomBlendMode(SDL_BLENDFACTOR_SRC_ALPHA, SDL_BLENDFACTOR_ZERO, SDL_BLENDOPERATION_ADD, SDL_BLENDFACTOR_ONE, SDL_BLENDFACTOR_ONE, SDL_BLENDOPERATION_ADD);
-            break;
+            return SDL_ComposeCustomBlendMode(SDL_BLENDFACTOR_ONE, SDL_BLENDFACTOR_ZERO, SDL_BLENDOPERATION_ADD, SDL_BLENDFACTOR_ONE, SDL_BLENDFACTOR_ZERO, SDL_BLENDOPERATION_ADD);
         case Method::Interpolate:
-            mode = SDL_ComposeCustomBlendMode(SDL_BLENDFACTOR_ONE_MINUS_DST_ALPHA, SDL_BLENDFACTOR_ONE_MINUS_SRC_ALPHA, SDL_BLENDOPERATION_ADD, SDL_BLENDFACTOR_ONE, SDL_BLENDFACTOR_ONE, SDL_BLENDOPERATION_ADD);
-            break;
+            // 下地が透明な部分にだけ描く
+            return SDL_ComposeCustomBlendMode(SDL_BLENDFACTOR_ONE_MINUS_DST_ALPHA, SDL_BLENDFACTOR_ONE, SDL_BLENDOPERATION_ADD, SDL_BLENDFACTOR_ONE_MINUS_DST_ALPHA, SDL_BLENDFACTOR_ONE, SDL_BLENDOPERATION_ADD);
         case Method::Reduce:
-            // FIXME
-            mode = SDL_ComposeCustomBlendMode(SDL_BLENDFACTOR_ZERO, SDL_BLENDFACTOR_SRC_ALPHA, SDL_BLENDOPERATION_ADD, SDL_BLENDFACTOR_ZERO, SDL_BLENDFACTOR_ONE, SDL_BLENDOPERATION_ADD);
-            break;
+            // 乗算済みなので色もalphaと同じ比率で減らす
+            return SDL_ComposeCustomBlendMode(SDL_BLENDFACTOR_ZERO, SDL_BLENDFACTOR_SRC_ALPHA, SDL_BLENDOPERATION_ADD, SDL_BLENDFACTOR_ZERO, SDL_BLENDFACTOR_SRC_ALPHA, SDL_BLENDOPERATION_ADD);
+        case Method::Base:
+        case Method::Overlay:
+        case Method::Add:
         default:
-            break;
+            return SDL_BLENDMODE_BLEND_PREMULTIPLIED;
+    }
+}
+
+WrapTexture *Element::getCachedTexture(SDL_Renderer *renderer, std::unique_ptr<TextureCache> &texture_cache, std::unique_ptr<ImageCache> &image_cache, int scale, int &w, int &h, bool &upconverted) const {
+    auto &src = texture_cache->get(filename, index, renderer, image_cache);
+    if (!src) {
+        return nullptr;
     }
+    w = src->width();
+    h = src->height();
+    upconverted = src->isUpconverted();
+    if (src->scale() != scale) {
+        // 倍率の違うテクスチャをGPUで拡縮する
+        // GPUで拡縮するモードでなければ、正確な倍率のものが出来るまでの間に合わせ
+        w = std::round(w * scale / static_cast<double>(src->scale()));
+        h = std::round(h * scale / static_cast<double>(src->scale()));
+        upconverted = upconverted && image_cache->useGPUScaling();
+        SDL_SetTextureScaleMode(src->texture(), SDL_SCALEMODE_LINEAR);
+    }
+    return src.get();
+}
+
+std::unique_ptr<WrapTexture> Element::getTexture(SDL_Renderer *renderer, std::unique_ptr<TextureCache> &texture_cache, std::unique_ptr<ImageCache> &image_cache, int scale) const {
+    int w, h;
+    bool upconverted;
+    auto *src = getCachedTexture(renderer, texture_cache, image_cache, scale, w, h, upconverted);
+    if (src == nullptr) {
+        std::unique_ptr<WrapTexture> invalid;
+        return invalid;
+    }
+    auto dst = std::make_unique<WrapTexture>(renderer, w, h, upconverted, scale);
     SDL_SetRenderTarget(renderer, dst->texture());
     SDL_SetRenderDrawColor(renderer, 0x00, 0x00, 0x00, 0x00);
     SDL_RenderClear(renderer);
-    SDL_SetTextureBlendMode(src->texture(), mode);
-    SDL_FRect r = { 0, 0, src->width(), src->height() };
-    SDL_RenderTexture(renderer, src->texture(), nullptr, &r);
+    // 合成方法は親で適用するのでここでは複製するだけ
+    SDL_SetTextureBlendMode(src->texture(), SDL_BLENDMODE_NONE);
+    SDL_FRect r = { 0, 0, w, h };
+    SDL_RenderTexture(renderer, src->texture(), src->source(), &r);
     SDL_SetRenderTarget(renderer, nullptr);
     return dst;
 }
 
 std::unique_ptr<WrapSurface> Element::getSurface(std::unique_ptr<ImageCache> &cache, int scale) const {
-    auto &info = cache->get(filename, index);
+    auto info = cache->get(filename, index);
     if (!info) {
-        Logger::log("invalid info");
+        Logger::warn("invalid info");
         std::unique_ptr<WrapSurface> invalid;
         return invalid;
     }
     WrapSurface src(info.value());
     auto dst = std::make_unique<WrapSurface>((x * scale) / 100 + src.width(), (y * scale) / 100 + src.height());
     SDL_ClearSurface(dst->surface(), 0, 0, 0, 0);
-    SDL_SetSurfaceBlendMode(src.surface(), SDL_BLENDMODE_BLEND);
+    SDL_SetSurfaceBlendMode(src.surface(), SDL_BLENDMODE_BLEND_PREMULTIPLIED);
     SDL_Rect r = { (x * scale) / 100, (y * scale) / 100, src.width(), src.height() };
     SDL_BlitSurface(src.surface(), nullptr, dst->surface(), &r);
     return dst;
 }
+
+bool Collision::contains(int x, int y) const {
+    if (type == CollisionType::Rect) {
+        if (point.size() != 4) {
+            Logger::warn("invalid collision type: rect");
+            return false;
+        }
+        int x1 = point[0];
+        int y1 = point[1];
+        int x2 = point[2];
+        int y2 = point[3];
+        if (x1 <= x && x2 >= x && y1 <= y && y2 >= y) {
+            return true;
+        }
+    }
+    else if (type == CollisionType::Ellipse) {
+        if (point.size() != 4) {
+            Logger::warn("invalid collision type: ellipse");
+            return false;
+        }
+        int x1 = point[0];
+        int y1 = point[1];
+        int x2 = point[2];
+        int y2 = point[3];
+        double xr = std::abs(x1 - x2);
+        double xo = (x1 + x2) / 2.0 - x;
+        double yr = std::abs(y1 - y2);
+        double yo = (y1 + y2) / 2.0 - y;
+        assert(xr);
+        assert(yr);
+        if (xo * xo / xr * xr + yo * yo / yr * yr) {
+            return true;
+        }
+    }
+    else if (type == CollisionType::Circle) {
+        if (point.size() != 3) {
+            Logger::warn("invalid collision type: circle");
+            return false;
+        }
+        int cx = point[0] - x;
+        int cy = point[1] - y;
+        int cr = point[2];
+        if (cx * cx + cy * cy <= cr * cr) {
+            return true;
+        }
+    }
+    else if (type == CollisionType::Polygon) {
+        if (point.size() % 2 == 1 && point.size() >= 6) {
+            Logger::warn("invalid collision type: polygon");
+            return false;
+        }
+        // 始点を末尾に足して閉じた辺の列にする
+        std::vector<int> points = point;
+        points.push_back(points[0]);
+        points.push_back(points[1]);
+        int count = 0;
+        while (points.size() >= 4) {
+            double x1 = points[0];
+            double y1 = points[1];
+            double x2 = points[2];
+            double y2 = points[3];
+            points.erase(points.begin());
+            points.erase(points.begin());
+            if (y1 == y2) {
+                continue;
+            }
+            if (y1 > y2) {
+                if (y == y1) {
+                    continue;
+                }
+                else if (y == y2 && x <= x2) {
+                    count++;
+                    continue;
+                }
+            }
+            else {
+                if (y == y1 && x < x1) {
+                    count++;
+                    continue;
+                }
+                else if (y == y2) {
+                    continue;
+                }
+            }
+            if (y < y1 && y < y2) {
+                continue;
+            }
+            else if (y > y1 && y > y2) {
+                continue;
+            }
+            double intersection_x = x1 + (y - y1) * (x2 - x1) / (y2 - y1);
+            if (intersection_x > x) {
+                count++;
+            }
+        }
+        if (count % 2 == 1) {
+            return true;
+        }
+    }
+    else if (type == CollisionType::Region) {
+        // TODO stub
+    }
+    return false;
+}
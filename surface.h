@@ -14,6 +14,9 @@
 
 class ImageCache;
 
+// 乗算済みアルファの画像を合成する時のブレンドモード
+SDL_BlendMode toBlendMode(Method method);
+
 struct Element {
     Method method;
     int x, y;
@@ -25,6 +28,8 @@ struct Element {
     }
     std::unique_ptr<WrapSurface> getSurface(std::unique_ptr<ImageCache> &cache, int scale) const;
     std::unique_ptr<WrapTexture> getTexture(SDL_Renderer *renderer, std::unique_ptr<TextureCache> &texture_cache, std::unique_ptr<ImageCache> &image_cache, int scale) const;
+    // キャッシュのテクスチャ(アトラスの一部のことがある)と、倍率を合わせた描画時の大きさを返す
+    WrapTexture *getCachedTexture(SDL_Renderer *renderer, std::unique_ptr<TextureCache> &texture_cache, std::unique_ptr<ImageCache> &image_cache, int scale, int &w, int &h, bool &upconverted) const;
 };
 
 template<>
@@ -59,6 +64,8 @@ struct Collision {
     CollisionType type;
     std::string id;
     std::vector<int> point;
+    // 座標はサーフェスの原寸のもの
+    bool contains(int x, int y) const;
 };
 
 struct Surface {
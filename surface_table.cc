@@ -0,0 +1,127 @@
+#include "surface_table.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+
+void IdRanges::add(int first, int last) {
+    if (first > last) {
+        return;
+    }
+    // 重なるか隣り合う区間をまとめる(INT_MAXで溢れないように64bitで比べる)
+    auto it = std::lower_bound(ranges_.begin(), ranges_.end(), first, [](const std::pair<int, int> &r, int v) {
+        return static_cast<int64_t>(r.second) + 1 < v;
+    });
+    auto end = it;
+    while (end != ranges_.end() && end->first <= static_cast<int64_t>(last) + 1) {
+        first = std::min(first, end->first);
+        last = std::max(last, end->second);
+        end++;
+    }
+    it = ranges_.erase(it, end);
+    ranges_.insert(it, {first, last});
+}
+
+void IdRanges::remove(const IdRanges &other) {
+    std::vector<std::pair<int, int>> ret;
+    auto o = other.ranges_.begin();
+    for (auto [first, last] : ranges_) {
+        while (o != other.ranges_.end() && o->second < first) {
+            o++;
+        }
+        int64_t current = first;
+        for (auto p = o; p != other.ranges_.end() && p->first <= last; p++) {
+            if (p->first > current) {
+                ret.emplace_back(current, p->first - 1);
+            }
+            current = std::max<int64_t>(current, static_cast<int64_t>(p->second) + 1);
+        }
+        if (current <= last) {
+            ret.emplace_back(current, last);
+        }
+    }
+    ranges_ = std::move(ret);
+}
+
+bool IdRanges::contains(int id) const {
+    auto it = std::upper_bound(ranges_.begin(), ranges_.end(), id, [](int v, const std::pair<int, int> &r) {
+        return v < r.first;
+    });
+    if (it == ranges_.begin()) {
+        return false;
+    }
+    it--;
+    return id <= it->second;
+}
+
+int SurfaceTable::import(const std::filesystem::path &path, const std::vector<int> &delays) {
+    if (imports_.contains(path)) {
+        return imports_.at(path).offset;
+    }
+    int max = 2;
+    for (auto &[_, v] : imports_) {
+        int size = v.offset + v.frames;
+        max = std::max(max, size);
+    }
+    imported_.push_back(path);
+    imports_[path] = {
+        .offset = max,
+        .frames = delays.size(),
+    };
+    for (int i = 0; i < static_cast<int>(delays.size()); i++) {
+        // 遅延モードでは登録前に無いものとして覚えていることがある
+        resolved_.erase(-(max + i));
+        base_[-(max + i)] = {
+            .element = {
+                {0, {
+                        .method = Method::Base,
+                        .x = 0, .y = 0,
+                        .filename = path,
+                        .index = i,
+                    }
+                },
+            },
+        };
+    }
+    return max;
+}
+
+const std::optional<Surface> &SurfaceTable::resolve(int id) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (resolved_.contains(id)) {
+        return resolved_.at(id);
+    }
+    std::optional<Surface> surface;
+    if (base_.contains(id)) {
+        surface = base_.at(id);
+    }
+    for (auto &layer : layers_) {
+        if (!layer.ids.contains(id)) {
+            continue;
+        }
+        // appendは既にあるものにしか重ねない
+        if (layer.append && !surface) {
+            continue;
+        }
+        if (!surface) {
+            surface.emplace();
+        }
+        if (!layer.surface) {
+            // loadの中でimportするとbase_は増えるがlayers_は変わらない
+            layer.surface = std::make_shared<const Surface>(layer.load(*this));
+        }
+        surface->merge(*layer.surface);
+    }
+    // unordered_mapの要素は挿入で動かないので参照を返してよい
+    return resolved_[id] = std::move(surface);
+}
+
+bool SurfaceTable::contains(int id) {
+    return resolve(id).has_value();
+}
+
+const Surface &SurfaceTable::at(int id) {
+    auto &surface = resolve(id);
+    assert(surface);
+    return surface.value();
+}
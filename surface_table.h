@@ -0,0 +1,87 @@
+#ifndef SURFACE_TABLE_H_
+#define SURFACE_TABLE_H_
+
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "surface.h"
+
+// サーフェスIDの集合を閉区間の列で持つ(昇順で重ならない)
+class IdRanges {
+    private:
+        std::vector<std::pair<int, int>> ranges_;
+    public:
+        void add(int first, int last);
+        void remove(const IdRanges &other);
+        bool contains(int id) const;
+        bool empty() const {
+            return ranges_.empty();
+        }
+        const std::vector<std::pair<int, int>> &ranges() const {
+            return ranges_;
+        }
+};
+
+class SurfaceTable;
+
+// surfaceブロック1つ分の定義
+// 対象のIDの数によらず実体は1つだけ持つ
+struct SurfaceLayer {
+    IdRanges ids;
+    bool append;
+    std::shared_ptr<const Surface> surface;
+    // surfaceが無ければ初めて使う時にこれで作る
+    std::function<Surface(SurfaceTable &)> load;
+};
+
+// 画像ファイルそのものやimportで作ったサーフェスの上に、
+// 定義順にレイヤーを重ねたものを初めて要求された時に組み立てる
+class SurfaceTable {
+    private:
+        struct ImportInfo {
+            int offset;
+            size_t frames;
+        };
+        std::unordered_map<int, Surface> base_;
+        std::vector<SurfaceLayer> layers_;
+        std::unordered_map<std::filesystem::path, ImportInfo> imports_;
+        std::vector<std::filesystem::path> imported_;
+        std::mutex mutex_;
+        // 存在しないIDはnullopt
+        std::unordered_map<int, std::optional<Surface>> resolved_;
+
+        const std::optional<Surface> &resolve(int id);
+    public:
+        SurfaceTable() {}
+        ~SurfaceTable() {}
+        Surface &base(int id) {
+            return base_[id];
+        }
+        void addLayer(SurfaceLayer layer) {
+            layers_.push_back(std::move(layer));
+        }
+        const std::unordered_map<int, Surface> &bases() const {
+            return base_;
+        }
+        const std::vector<SurfaceLayer> &layers() const {
+            return layers_;
+        }
+        // アニメーション画像の各フレームをサーフェスとして登録し、先頭のIDの符号を反転したものを返す
+        // 同じファイルは一度しか登録しない
+        int import(const std::filesystem::path &path, const std::vector<int> &delays);
+        // キャッシュの鮮度を確かめるために読み込んだアニメーション画像を覚えておく
+        const std::vector<std::filesystem::path> &imported() const {
+            return imported_;
+        }
+        bool contains(int id);
+        // containsで確かめてから呼ぶこと
+        const Surface &at(int id);
+};
+
+#endif // SURFACE_TABLE_H_
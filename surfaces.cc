@@ -1,43 +1,98 @@
 #include "surfaces.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
-#include <fstream>
-#include <iostream>
+#include <charconv>
 #include <optional>
+#include <sstream>
+#include <string_view>
+#include <thread>
 #include <unordered_map>
 
-#include <SDL3_image/SDL_image.h>
-
+#include "animation_source.h"
 #include "logger.h"
+#include "mapped_file.h"
+#include "shell_cache.h"
 #include "util.h"
 
 enum class State { Root, Descript, Surface, None };
 
 namespace {
-    std::string trimSpace(const std::string &str) {
-        int pos = 0;
-        for (int i = 0; i < str.length(); i++) {
-            if (str[i] == ' ' || str[i] == '\t') {
-                pos++;
+    std::string_view trimSpace(std::string_view str) {
+        while (!str.empty() && (str.front() == ' ' || str.front() == '\t')) {
+            str.remove_prefix(1);
+        }
+        while (!str.empty() && (str.back() == ' ' || str.back() == '\t')) {
+            str.remove_suffix(1);
+        }
+        return str;
+    }
+
+    // std::getlineで区切るのと同じ結果になるように切り出す
+    // 読み切った後は失敗してtokenを書き換えない
+    class Tokenizer {
+        private:
+            std::string_view rest_;
+            bool eof_;
+        public:
+            Tokenizer(std::string_view str) : rest_(str), eof_(false) {}
+            bool next(std::string_view &token, char delim) {
+                if (eof_) {
+                    return false;
+                }
+                auto pos = rest_.find(delim);
+                if (pos == std::string_view::npos) {
+                    token = rest_;
+                    eof_ = true;
+                    return !token.empty();
+                }
+                token = rest_.substr(0, pos);
+                rest_.remove_prefix(pos + 1);
+                return true;
             }
-            else {
-                break;
+            // 末尾まで
+            bool rest(std::string_view &token) {
+                if (eof_) {
+                    return false;
+                }
+                token = rest_;
+                eof_ = true;
+                return !token.empty();
             }
+    };
+
+    // istream >> intと同じく先頭の空白を読み飛ばし、読めなければ0にする
+    template<typename T>
+    void toInt(std::string_view str, T &value) {
+        while (!str.empty() && (str.front() == ' ' || str.front() == '\t')) {
+            str.remove_prefix(1);
         }
-        int n = str.length() - pos;
-        for (int i = str.length() - 1; i >= 0; i--) {
-            if (str[i] == ' ' || str[i] == '\t') {
-                n--;
-            }
-            else {
-                break;
+        if (!str.empty() && str.front() == '+') {
+            str.remove_prefix(1);
+        }
+        value = 0;
+        std::from_chars(str.data(), str.data() + str.size(), value);
+    }
+
+    template<typename T>
+    struct Keyword {
+        std::string_view name;
+        T value;
+    };
+
+    // 数が少ないので線形に探す
+    template<typename T, size_t N>
+    std::optional<T> lookup(const Keyword<T> (&table)[N], std::string_view name) {
+        for (auto &k : table) {
+            if (k.name == name) {
+                return k.value;
             }
         }
-        return str.substr(pos, n);
+        return std::nullopt;
     }
 
-    const std::unordered_map<std::string, Interval> s2interval = {
+    const Keyword<Interval> s2interval[] = {
         {"sometimes", Interval::Sometimes},
         {"rarely", Interval::Rarely},
         {"random", Interval::Random},
@@ -49,7 +104,7 @@ namespace {
         {"talk", Interval::Talk},
         {"bind", Interval::Bind},
     };
-    const std::unordered_map<std::string, Method> s2method = {
+    const Keyword<Method> s2method[] = {
         {"base", Method::Base},
         {"overlay", Method::Overlay},
         {"overlayfast", Method::OverlayFast},
@@ -70,7 +125,7 @@ namespace {
         {"parallelstop", Method::ParallelStop},
         {"import", Method::Import},
     };
-    const std::unordered_map<std::string, Method> s2method_synthesize = {
+    const Keyword<Method> s2method_synthesize[] = {
         {"base", Method::Base},
         {"overlay", Method::Overlay},
         {"overlayfast", Method::OverlayFast},
@@ -89,7 +144,7 @@ namespace {
         Method::Bind, Method::Add, Method::Reduce,
     };
 
-    const std::unordered_map<std::string, CollisionType> s2collision = {
+    const Keyword<CollisionType> s2collision[] = {
         {"rect", CollisionType::Rect},
         {"ellipse", CollisionType::Ellipse},
         {"circle", CollisionType::Circle},
@@ -97,57 +152,116 @@ namespace {
         {"region", CollisionType::Region}
     };
 
-    struct ImportInfo {
-        int offset;
+    std::filesystem::path toPath(const std::filesystem::path &dir, std::string_view name) {
+        std::u8string u(name.begin(), name.end());
+        return dir / u;
+    }
+
+}
+
+// surfaceブロック1つ分の解析結果
+struct Surfaces::Block {
+    // importしたフレームのサーフェスIDは全体の順番が決まるまで分からないので後で埋める
+    struct Fixup {
+        int animation;
+        size_t pattern;
+        size_t import;
+        int frame;
+    };
+    IdRanges ids;
+    bool append;
+    Surface surface;
+    std::vector<Fixup> fixups;
+    // 遅延モードでは中身を解析せず範囲と先頭の行番号だけ覚えておく
+    std::string_view body;
+    int line;
+};
+
+// ファイル1つ分の解析結果
+// ブロックはファイルに書かれた順に並べ、mergeで順番に反映する
+struct Surfaces::File {
+    struct Import {
+        std::filesystem::path path;
         std::vector<int> delays;
     };
+    std::optional<int> version;
+    std::vector<Import> imports;
+    // 読めなかったものはnullopt
+    std::unordered_map<std::filesystem::path, std::optional<size_t>> import_index;
+    std::vector<Block> blocks;
+    // 遅延モードでbodyが指す先
+    std::shared_ptr<MappedFile> source;
+    std::filesystem::path shell_dir;
+
+    std::optional<size_t> findImport(const std::filesystem::path &path) {
+        if (!import_index.contains(path)) {
+            // フレームの画素は描画時にImageCacheが必要な分だけデコードする
+            auto delays = AnimationSource::readDelays(path);
+            if (delays) {
+                Logger::log("surfaces.import:", delays->size());
+                import_index[path] = imports.size();
+                imports.push_back({path, std::move(delays.value())});
+            }
+            else {
+                import_index[path] = std::nullopt;
+            }
+        }
+        return import_index.at(path);
+    }
+};
 
-    std::unordered_map<std::filesystem::path, ImportInfo> path2import_info;
+namespace {
+    // CRを取り除いて前後の空白を詰めた1行を取り出す
+    // rawは元のデータの中での位置
+    bool nextLine(Tokenizer &lines, std::string_view &raw, std::string_view &line, std::string &scratch) {
+        if (!lines.next(raw, '\x0a')) {
+            return false;
+        }
+        line = raw;
+        // 行の途中にCRがある場合だけ取り除いたものを使う
+        if (line.find('\x0d') != std::string_view::npos) {
+            scratch = line;
+            std::erase(scratch, '\x0d');
+            line = scratch;
+        }
+        line = trimSpace(line);
+        return true;
+    }
 }
 
-void parseSurfaceID(const std::string &line, std::unordered_set<int> &inclusive, std::unordered_set<int> & exclusive) {
-    std::string tmp;
-    std::istringstream l1(line);
-    while (std::getline(l1, tmp, ',')) {
+void parseSurfaceID(std::string_view line, IdRanges &inclusive, IdRanges &exclusive) {
+    std::string_view tmp;
+    Tokenizer l1(line);
+    while (l1.next(tmp, ',')) {
         bool in = true;
-        if (tmp[0] == '!') {
-            tmp = tmp.substr(1);
+        if (tmp.starts_with('!')) {
+            tmp.remove_prefix(1);
             in = false;
         }
-        if (tmp.find('-') != std::string::npos) {
-            std::istringstream l2(tmp);
-            int begin, end;
-            std::getline(l2, tmp, '-');
-            util::to_x(tmp, begin);
-            std::getline(l2, tmp, '-');
-            util::to_x(tmp, end);
-            if (begin > end) {
-                continue;
-            }
-            for (int i = begin; i <= end; i++) {
-                if (in) {
-                    inclusive.emplace(i);
-                }
-                else {
-                    exclusive.emplace(i);
-                }
-            }
+        int begin, end;
+        if (tmp.find('-') != std::string_view::npos) {
+            Tokenizer l2(tmp);
+            l2.next(tmp, '-');
+            toInt(tmp, begin);
+            l2.next(tmp, '-');
+            toInt(tmp, end);
         }
         else {
-            int id;
-            util::to_x(tmp, id);
-            if (in) {
-                inclusive.emplace(id);
-            }
-            else {
-                exclusive.emplace(id);
-            }
+            toInt(tmp, begin);
+            end = begin;
+        }
+        if (in) {
+            inclusive.add(begin, end);
+        }
+        else {
+            exclusive.add(begin, end);
         }
     }
 }
 
-Surfaces::Surfaces(const std::filesystem::path &ayu_dir) {
+Surfaces::Surfaces(const std::filesystem::path &ayu_dir) : version_(0), table_(std::make_shared<SurfaceTable>()) {
     std::vector<std::filesystem::path> list;
+    std::vector<std::pair<int, std::filesystem::path>> png;
     assert(std::filesystem::is_directory(ayu_dir));
     for (const auto &e : std::filesystem::directory_iterator(ayu_dir)) {
         if (e.is_regular_file()) {
@@ -165,8 +279,8 @@ Surfaces::Surfaces(const std::filesystem::path &ayu_dir) {
                 }
                 if (valid) {
                     int n;
-                    util::to_x(s, n);
-                    addSurface(n, e.path());
+                    toInt(s, n);
+                    png.emplace_back(n, e.path());
                 }
             }
             else if (path.starts_with("surfaces") && path.ends_with(".txt")) {
@@ -175,72 +289,387 @@ Surfaces::Surfaces(const std::filesystem::path &ayu_dir) {
         }
     }
     std::sort(list.begin(), list.end(), std::less<std::filesystem::path>());
-    for (auto &p : list) {
-        parse(p);
+    std::sort(png.begin(), png.end());
+    std::vector<std::filesystem::path> listed;
+    for (auto &[_, p] : png) {
+        listed.push_back(p);
+    }
+    listed.insert(listed.end(), list.begin(), list.end());
+    // 遅延モードでは解析し終えたものが無いのでキャッシュを使わない
+    bool lazy = getenv("AO_LAZY_SURFACES");
+    if (!lazy && shell_cache::load(ayu_dir, listed, version_, *table_)) {
+        Logger::info("surfaces: loaded from cache");
+        return;
+    }
+    for (auto &[n, p] : png) {
+        addSurface(n, p);
+    }
+    // 解析はファイルごとに並行して行い、反映は名前順に行う
+    std::vector<File> files(list.size());
+    std::atomic<size_t> index = 0;
+    auto work = [&]() {
+        for (size_t i = index++; i < list.size(); i = index++) {
+            parseFile(list[i], files[i], lazy);
+        }
+    };
+    int threads = std::min<int>(std::max(1u, std::thread::hardware_concurrency()), list.size());
+    std::vector<std::thread> workers;
+    for (int i = 1; i < threads; i++) {
+        workers.emplace_back(work);
+    }
+    work();
+    for (auto &th : workers) {
+        th.join();
+    }
+    for (auto &file : files) {
+        merge(file);
+    }
+    if (!lazy) {
+        shell_cache::store(ayu_dir, listed, table_->imported(), version_, *table_);
     }
 }
 
-void Surfaces::importAnimatedSurface(const std::filesystem::path &path) {
-    if (path2import_info.contains(path)) {
-        return;
+void Surfaces::link(Block &block, const std::vector<int> &offsets) {
+    for (auto &f : block.fixups) {
+        block.surface.animation[f.animation].pattern[f.pattern].id = -(offsets[f.import] + f.frame);
     }
-    IMG_Animation *anim = IMG_LoadAnimation(path.string().c_str());
-    if (anim == nullptr) {
-        return;
+}
+
+Surface Surfaces::load(std::string_view body, int line_count, const std::filesystem::path &shell_dir, SurfaceTable &table) {
+    File file;
+    Block block;
+    Tokenizer lines(body);
+    std::string_view raw, line;
+    std::string scratch;
+    for (; nextLine(lines, raw, line, scratch); line_count++) {
+        parseSurfaceLine(line, line_count, shell_dir, file, block);
     }
-    int max = 2;
-    for (auto &[_, v] : path2import_info) {
-        int size = v.offset + v.delays.size();
-        max = std::max(max, size);
+    std::vector<int> offsets;
+    for (auto &import : file.imports) {
+        offsets.push_back(table.import(import.path, import.delays));
     }
-    std::vector<int> delays;
-    Logger::log("surfaces.import:", anim->count);
-    delays.reserve(anim->count);
-    for (int i = 0; i < anim->count; i++) {
-        delays.push_back(anim->delays[i]);
+    link(block, offsets);
+    return std::move(block.surface);
+}
+
+void Surfaces::merge(File &file) {
+    if (file.version) {
+        version_ = file.version.value();
     }
-    path2import_info[path] = {
-        .offset = max,
-        .delays = delays,
-    };
-    IMG_FreeAnimation(anim);
-    for (int i = 0; i < delays.size(); i++) {
-        surfaces_[-(max + i)] = {
-            .element = {
-                {0, {
-                        .method = Method::Base,
-                        .x = 0, .y = 0,
-                        .filename = path,
-                        .index = i,
-                    }
+    std::vector<int> offsets;
+    for (auto &import : file.imports) {
+        offsets.push_back(table_->import(import.path, import.delays));
+    }
+    for (auto &block : file.blocks) {
+        // IDごとに複製せず、要求された時にSurfaceTableで重ねる
+        if (block.ids.empty()) {
+            continue;
+        }
+        if (file.source) {
+            auto source = file.source;
+            auto body = block.body;
+            auto line = block.line;
+            auto shell_dir = file.shell_dir;
+            table_->addLayer({
+                .ids = std::move(block.ids),
+                .append = block.append,
+                .surface = nullptr,
+                .load = [source, body, line, shell_dir](SurfaceTable &table) {
+                    return load(body, line, shell_dir, table);
                 },
-            },
-        };
+            });
+            continue;
+        }
+        link(block, offsets);
+        table_->addLayer({
+            .ids = std::move(block.ids),
+            .append = block.append,
+            .surface = std::make_shared<const Surface>(std::move(block.surface)),
+        });
     }
 }
 
 void Surfaces::parse(const std::filesystem::path &path) {
+    File file;
+    parseFile(path, file, false);
+    merge(file);
+}
+
+void Surfaces::parseSurfaceLine(std::string_view line, int line_count, const std::filesystem::path &shell_dir, File &file, Block &block) {
+    if (line.starts_with("element")) {
+        Element element;
+        std::string_view tmp;
+        Tokenizer l(line.substr(7));
+        int id;
+        l.next(tmp, ',');
+        toInt(tmp, id);
+        l.next(tmp, ',');
+        auto method = lookup(s2method_synthesize, tmp);
+        if (!method) {
+            Logger::warn("Error(", line_count, "): invalid method in element");
+            return;
+        }
+        element.method = method.value();
+        l.next(tmp, ',');
+        element.filename = toPath(shell_dir, tmp);
+        l.next(tmp, ',');
+        toInt(tmp, element.x);
+        l.next(tmp, ',');
+        toInt(tmp, element.y);
+        block.surface.element[id] = element;
+    }
+    else if (line.starts_with("animation")) {
+        std::string_view tmp;
+        Tokenizer l(line.substr(9));
+        l.next(tmp, '.');
+        int id;
+        toInt(tmp, id);
+        l.next(tmp, ',');
+        if (tmp == "interval") {
+            if (block.surface.animation.contains(id)) {
+                Logger::warn("Error(", line_count, "): invalid method in animation");
+                return;
+            }
+            Animation animation;
+            l.next(tmp, ',');
+            Tokenizer l2(tmp);
+            while (l2.next(tmp, '+')) {
+                auto interval = lookup(s2interval, tmp);
+                if (!interval) {
+                    Logger::warn("Error(", line_count, "): invalid interval in animation");
+                    return;
+                }
+                animation.interval.emplace(interval.value());
+            }
+            l.next(tmp, ',');
+            toInt(tmp, animation.interval_factor);
+            if (animation.interval_factor < 1) {
+                animation.interval_factor = 1;
+            }
+            block.surface.animation[id] = animation;
+        }
+        else if (tmp.starts_with("pattern")) {
+            if (!block.surface.animation.contains(id)) {
+                Logger::warn("Error(", line_count, "): animation id not found");
+                return;
+            }
+            int n;
+            toInt(tmp.substr(7), n);
+            Pattern p;
+            p.index = n;
+            l.next(tmp, ',');
+            if (block.surface.animation[id].interval.size() == 1 && block.surface.animation[id].interval.contains(Interval::Bind) && !lookup(s2method_synthesize, tmp)) {
+                Logger::warn("Error(", line_count, "): invalid method in bind");
+                return;
+            }
+            auto method = lookup(s2method, tmp);
+            if (!method) {
+                Logger::warn("Error(", line_count, "): invalid method");
+                return;
+            }
+            p.method = method.value();
+            if (synthesize.contains(p.method)) {
+                l.next(tmp, ',');
+                toInt(tmp, p.id);
+                l.next(tmp, ',');
+                if (tmp.find('-') != std::string_view::npos) {
+                    Tokenizer l2(tmp);
+                    l2.next(tmp, '-');
+                    toInt(tmp, p.wait_min);
+                    l2.next(tmp, '-');
+                    toInt(tmp, p.wait_max);
+                }
+                else {
+                    toInt(tmp, p.wait_min);
+                    p.wait_max = p.wait_min;
+                }
+                l.next(tmp, ',');
+                toInt(tmp, p.x);
+                l.next(tmp, ',');
+                toInt(tmp, p.y);
+            }
+            else if (p.method == Method::Move) {
+                // TODO stub
+            }
+            else if (p.method == Method::Insert ||
+                    p.method == Method::Start ||
+                    p.method == Method::Stop) {
+                int id;
+                l.next(tmp, ',');
+                toInt(tmp, id);
+                p.ids.push_back(id);
+                p.wait_min = p.wait_max = 0;
+            }
+            else if (p.method == Method::AlternativeStart ||
+                    p.method == Method::AlternativeStop ||
+                    p.method == Method::ParallelStart ||
+                    p.method == Method::ParallelStop) {
+                // 末尾まで読み込みたい
+                l.rest(tmp);
+                if (!tmp.starts_with("(") || !tmp.ends_with(")")) {
+                    // TODO error;
+                    return;
+                }
+                tmp = tmp.substr(1, tmp.size() - 2);
+                Tokenizer l2(tmp);
+                while (l2.next(tmp, ',')) {
+                    int id;
+                    toInt(tmp, id);
+                    p.ids.push_back(id);
+                }
+                if (p.ids.size() == 0) {
+                    // TODO error
+                    return;
+                }
+                p.wait_min = p.wait_max = 0;
+            }
+            else if (p.method == Method::Import) {
+                std::filesystem::path filename;
+                int wait, x, y;
+                l.next(tmp, ',');
+                filename = toPath(shell_dir, tmp);
+                auto import = file.findImport(filename);
+                if (!import) {
+                    Logger::warn("failed to import:", filename);
+                    return;
+                }
+                auto &info = file.imports[import.value()];
+                // TODO wait-minmax
+                l.next(tmp, ',');
+                toInt(tmp, wait);
+                l.next(tmp, ',');
+                toInt(tmp, x);
+                l.next(tmp, ',');
+                toInt(tmp, y);
+                for (int i = 0; i < info.delays.size(); i++) {
+                    Logger::log("surfaces.import", i);
+                    block.fixups.push_back({id, block.surface.animation[id].pattern.size(), import.value(), i});
+                    block.surface.animation[id].pattern.push_back({
+                        .index = n,
+                        .id = 0,
+                        .wait_min = wait,
+                        .wait_max = wait,
+                        .x = x,
+                        .y = y,
+                    });
+                    wait = info.delays[i];
+                }
+                // Pattern pはpush_backしない
+                return;
+            }
+            else {
+                // unreachable
+                assert(false);
+            }
+            int last_index = -1;
+            if (block.surface.animation[id].pattern.size() > 0) {
+                last_index = block.surface.animation[id].pattern.back().index;
+            }
+            last_index++;
+            if (last_index > n) {
+                //block.surface.animation[id].pattern[n] = p;
+            }
+            else {
+                while (last_index < n) {
+                    block.surface.animation[id].pattern.push_back({
+                        .method = Method::Overlay,
+                        .index = last_index++,
+                        .id = -1,
+                        .wait_min = 0, .wait_max = 0,
+                        .x = 0, .y = 0, .ids = {}});
+                }
+                block.surface.animation[id].pattern.push_back(p);
+            }
+        }
+    }
+    else if (line.starts_with("collisionex")) {
+        int id;
+        Collision collision;
+        std::string_view tmp;
+        Tokenizer l(line.substr(11));
+        collision.factor = line_count;
+        collision.type = CollisionType::Rect;
+        l.next(tmp, ',');
+        toInt(tmp, id);
+        l.next(tmp, ',');
+        collision.id = tmp;
+        l.next(tmp, ',');
+        auto type = lookup(s2collision, tmp);
+        if (!type) {
+            // TODO error
+            return;
+        }
+        collision.type = type.value();
+        while (l.next(tmp, ',')) {
+            int point;
+            toInt(tmp, point);
+            collision.point.push_back(point);
+        }
+        if (block.surface.collision.contains(id)) {
+            // TODO error
+        }
+        else {
+            block.surface.collision[id] = collision;
+        }
+    }
+    else if (line.starts_with("collision")) {
+        int id;
+        Collision collision;
+        std::string_view tmp;
+        Tokenizer l(line.substr(9));
+        collision.factor = line_count;
+        collision.type = CollisionType::Rect;
+        l.next(tmp, ',');
+        toInt(tmp, id);
+        for (int i = 0; i < 4; i++) {
+            int point;
+            l.next(tmp, ',');
+            toInt(tmp, point);
+            collision.point.push_back(point);
+        }
+        l.next(tmp, ',');
+        collision.id = tmp;
+        if (block.surface.collision.contains(id)) {
+            // TODO error
+        }
+        else {
+            block.surface.collision[id] = collision;
+        }
+    }
+    else if (line.starts_with("sakura.balloon.offset")) {
+        // TODO stub
+    }
+    else if (line.starts_with("kero.balloon.offset")) {
+        // TODO stub
+    }
+    else if (line.starts_with("balloon")) {
+        // TODO stub
+    }
+    else if (line.starts_with("point")) {
+        // TODO stub
+    }
+}
+
+void Surfaces::parseFile(const std::filesystem::path &path, File &result, bool lazy) {
     std::filesystem::path shell_dir = path.parent_path();
-    std::ifstream ifs(path);
-    std::string data;
-    std::getline(ifs, data, '\0');
-    std::erase_if(data, [](char c) { return c == '\x0d'; });
-    data = trimSpace(data);
+    auto file = std::make_shared<MappedFile>(path);
+    std::string_view data = trimSpace(file->view());
     std::string charset = "UTF-8";
     if (data.starts_with("\xef\xbb\xbf")) {
-        data = data.substr(3);
+        data.remove_prefix(3);
     }
-    std::istringstream iss(data);
-    std::string line;
+    std::string_view raw, line;
+    std::string scratch;
+    Tokenizer lines(data);
     bool once = true;
     State state = State::Root;
     State next = State::None;
-    std::optional<Surface> surface;
-    std::unordered_set<int> inclusive;
-    std::unordered_set<int> exclusive;
-    bool append;
-    for (int line_count = 1; std::getline(iss, line, '\x0a'); line_count++) {
-        line = trimSpace(line);
+    std::optional<Block> block;
+    IdRanges inclusive;
+    IdRanges exclusive;
+    const char *body = nullptr;
+    int body_line = 0;
+    for (int line_count = 1; nextLine(lines, raw, line, scratch); line_count++) {
         if (once && line.starts_with("charset,")) {
             // TODO
         }
@@ -251,11 +680,11 @@ void Surfaces::parse(const std::filesystem::path &path) {
                     next = State::Descript;
                 }
                 else if (line.starts_with("surface.append")) {
-                    inclusive.clear();
-                    exclusive.clear();
-                    append = true;
+                    inclusive = {};
+                    exclusive = {};
                     next = State::Surface;
-                    surface = std::make_optional<Surface>();
+                    block = Block{.append = true};
+                    body = nullptr;
                     parseSurfaceID(line.substr(14), inclusive, exclusive);
                     if (line.ends_with("{")) {
                         state = next;
@@ -263,11 +692,11 @@ void Surfaces::parse(const std::filesystem::path &path) {
                     }
                 }
                 else if (line.starts_with("surface")) {
-                    inclusive.clear();
-                    exclusive.clear();
-                    append = false;
+                    inclusive = {};
+                    exclusive = {};
                     next = State::Surface;
-                    surface = std::make_optional<Surface>();
+                    block = Block{.append = false};
+                    body = nullptr;
                     parseSurfaceID(line.substr(7), inclusive, exclusive);
                     if (line.ends_with("{")) {
                         state = next;
@@ -290,7 +719,9 @@ void Surfaces::parse(const std::filesystem::path &path) {
                 break;
             case State::Descript:
                 if (line.starts_with("version,")) {
-                    util::to_x(line.substr(8), version_);
+                    int version;
+                    toInt(line.substr(8), version);
+                    result.version = version;
                 }
                 else if (line == "}") {
                     state = State::Root;
@@ -300,266 +731,25 @@ void Surfaces::parse(const std::filesystem::path &path) {
                 }
                 break;
             case State::Surface:
-                if (line.starts_with("element")) {
-                    Element element;
-                    std::string tmp;
-                    std::istringstream l(line.substr(7));
-                    int id;
-                    std::getline(l, tmp, ',');
-                    util::to_x(tmp, id);
-                    std::getline(l, tmp, ',');
-                    if (!s2method_synthesize.contains(tmp)) {
-                        Logger::log("Error(", line_count, "): invalid method in element");
-                        continue;
-                    }
-                    element.method = s2method_synthesize.at(tmp);
-                    std::getline(l, tmp, ',');
-                    std::u8string u(tmp.begin(), tmp.end());
-                    element.filename = shell_dir / u;
-                    std::getline(l, tmp, ',');
-                    util::to_x(tmp, element.x);
-                    std::getline(l, tmp, ',');
-                    util::to_x(tmp, element.y);
-                    surface->element[id] = element;
-                }
-                else if (line.starts_with("animation")) {
-                    std::string tmp;
-                    std::istringstream l(line.substr(9));
-                    std::getline(l, tmp, '.');
-                    int id;
-                    util::to_x(tmp, id);
-                    std::getline(l, tmp, ',');
-                    if (tmp == "interval") {
-                        if (surface->animation.contains(id)) {
-                            Logger::log("Error(", line_count, "): invalid method in animation");
-                            continue;
-                        }
-                        Animation animation;
-                        std::getline(l, tmp, ',');
-                        std::istringstream l2(tmp);
-                        while (std::getline(l2, tmp, '+')) {
-                            if (!s2interval.contains(tmp)) {
-                                Logger::log("Error(", line_count, "): invalid interval in animation");
-                                continue;
-                            }
-                            animation.interval.emplace(s2interval.at(tmp));
-                        }
-                        std::getline(l, tmp, ',');
-                        util::to_x(tmp, animation.interval_factor);
-                        if (animation.interval_factor < 1) {
-                            animation.interval_factor = 1;
-                        }
-                        surface->animation[id] = animation;
-                    }
-                    else if (tmp.starts_with("pattern")) {
-                        if (!surface->animation.contains(id)) {
-                            Logger::log("Error(", line_count, "): animation id not found");
-                            continue;
-                        }
-                        int n;
-                        util::to_x(tmp.substr(7), n);
-                        Pattern p;
-                        p.index = n;
-                        std::getline(l, tmp, ',');
-                        if (surface->animation[id].interval.size() == 1 && surface->animation[id].interval.contains(Interval::Bind) && !s2method_synthesize.contains(tmp)) {
-                            Logger::log("Error(", line_count, "): invalid method in bind");
-                            continue;
-                        }
-                        if (!s2method.contains(tmp)) {
-                            Logger::log("Error(", line_count, "): invalid method");
-                            continue;
-                        }
-                        p.method = s2method.at(tmp);
-                        if (synthesize.contains(p.method)) {
-                            std::getline(l, tmp, ',');
-                            util::to_x(tmp, p.id);
-                            std::getline(l, tmp, ',');
-                            if (tmp.find('-') != std::string::npos) {
-                                std::istringstream l2(tmp);
-                                std::getline(l2, tmp, '-');
-                                util::to_x(tmp, p.wait_min);
-                                std::getline(l2, tmp, '-');
-                                util::to_x(tmp, p.wait_max);
-                            }
-                            else {
-                                util::to_x(tmp, p.wait_min);
-                                p.wait_max = p.wait_min;
-                            }
-                            std::getline(l, tmp, ',');
-                            util::to_x(tmp, p.x);
-                            std::getline(l, tmp, ',');
-                            util::to_x(tmp, p.y);
-                        }
-                        else if (p.method == Method::Move) {
-                            // TODO stub
-                        }
-                        else if (p.method == Method::Insert ||
-                                p.method == Method::Start ||
-                                p.method == Method::Stop) {
-                            int id;
-                            std::getline(l, tmp, ',');
-                            util::to_x(tmp, id);
-                            p.ids.push_back(id);
-                            p.wait_min = p.wait_max = 0;
-                        }
-                        else if (p.method == Method::AlternativeStart ||
-                                p.method == Method::AlternativeStop ||
-                                p.method == Method::ParallelStart ||
-                                p.method == Method::ParallelStop) {
-                            // 末尾まで読み込みたい
-                            std::getline(l, tmp, '\0');
-                            if (!tmp.starts_with("(") || !tmp.ends_with(")")) {
-                                // TODO error;
-                                continue;
-                            }
-                            tmp = tmp.substr(1, tmp.length() - 2);
-                            std::istringstream l2(tmp);
-                            while (std::getline(l2, tmp, ',')) {
-                                int id;
-                                util::to_x(tmp, id);
-                                p.ids.push_back(id);
-                            }
-                            if (p.ids.size() == 0) {
-                                // TODO error
-                                continue;
-                            }
-                            p.wait_min = p.wait_max = 0;
-                        }
-                        else if (p.method == Method::Import) {
-                            std::filesystem::path filename;
-                            int wait, x, y;
-                            std::getline(l, tmp, ',');
-                            std::u8string u(tmp.begin(), tmp.end());
-                            filename = shell_dir / u;
-                            importAnimatedSurface(filename);
-                            if (!path2import_info.contains(filename)) {
-                                Logger::log("failed to import:", filename);
-                                continue;
-                            }
-                            auto &info = path2import_info.at(filename);
-                            // TODO wait-minmax
-                            std::getline(l, tmp, ',');
-                            util::to_x(tmp, wait);
-                            std::getline(l, tmp, ',');
-                            util::to_x(tmp, x);
-                            std::getline(l, tmp, ',');
-                            util::to_x(tmp, y);
-                            for (int i = 0; i < info.delays.size(); i++) {
-                                Logger::log("surfaces.import", i);
-                                surface->animation[id].pattern.push_back({
-                                    .index = n,
-                                    .id = -(info.offset + i),
-                                    .wait_min = wait,
-                                    .wait_max = wait,
-                                    .x = x,
-                                    .y = y,
-                                });
-                                wait = info.delays[i];
-                            }
-                            // Pattern pはpush_backしない
-                            continue;
-                        }
-                        else {
-                            // unreachable
-                            assert(false);
-                        }
-                        int last_index = -1;
-                        if (surface->animation[id].pattern.size() > 0) {
-                            last_index = surface->animation[id].pattern.back().index;
-                        }
-                        last_index++;
-                        if (last_index > n) {
-                            //surface->animation[id].pattern[n] = p;
-                        }
-                        else {
-                            while (last_index < n) {
-                                surface->animation[id].pattern.push_back({
-                                    .method = Method::Overlay,
-                                    .index = last_index++,
-                                    .id = -1,
-                                    .wait_min = 0, .wait_max = 0,
-                                    .x = 0, .y = 0, .ids = {}});
-                            }
-                            surface->animation[id].pattern.push_back(p);
-                        }
-                    }
-                }
-                else if (line.starts_with("collisionex")) {
-                    int id;
-                    Collision collision;
-                    std::string tmp;
-                    std::istringstream l(line.substr(11));
-                    collision.factor = line_count;
-                    collision.type = CollisionType::Rect;
-                    std::getline(l, tmp, ',');
-                    util::to_x(tmp, id);
-                    std::getline(l, tmp, ',');
-                    collision.id = tmp;
-                    std::getline(l, tmp, ',');
-                    if (!s2collision.contains(tmp)) {
-                        // TODO error
-                        continue;
-                    }
-                    collision.type = s2collision.at(tmp);
-                    while (std::getline(l, tmp, ',')) {
-                        int point;
-                        util::to_x(tmp, point);
-                        collision.point.push_back(point);
-                    }
-                    if (surface->collision.contains(id)) {
-                        // TODO error
-                    }
-                    else {
-                        surface->collision[id] = collision;
+                if (line == "}") {
+                    state = State::Root;
+                    inclusive.remove(exclusive);
+                    block->ids = std::move(inclusive);
+                    if (lazy && body) {
+                        block->body = std::string_view(body, raw.data() - body);
+                        block->line = body_line;
                     }
+                    result.blocks.push_back(std::move(block.value()));
                 }
-                else if (line.starts_with("collision")) {
-                    int id;
-                    Collision collision;
-                    std::string tmp;
-                    std::istringstream l(line.substr(9));
-                    collision.factor = line_count;
-                    collision.type = CollisionType::Rect;
-                    std::getline(l, tmp, ',');
-                    util::to_x(tmp, id);
-                    for (int i = 0; i < 4; i++) {
-                        int point;
-                        std::getline(l, tmp, ',');
-                        util::to_x(tmp, point);
-                        collision.point.push_back(point);
-                    }
-                    std::getline(l, tmp, ',');
-                    collision.id = tmp;
-                    if (surface->collision.contains(id)) {
-                        // TODO error
-                    }
-                    else {
-                        surface->collision[id] = collision;
+                else if (lazy) {
+                    // 中身は初めて使う時に解析する
+                    if (!body) {
+                        body = raw.data();
+                        body_line = line_count;
                     }
                 }
-                else if (line.starts_with("sakura.balloon.offset")) {
-                    // TODO stub
-                }
-                else if (line.starts_with("kero.balloon.offset")) {
-                    // TODO stub
-                }
-                else if (line.starts_with("balloon")) {
-                    // TODO stub
-                }
-                else if (line.starts_with("point")) {
-                    // TODO stub
-                }
-                else if (line == "}") {
-                    state = State::Root;
-                    for (auto e : inclusive) {
-                        if (exclusive.contains(e)) {
-                            continue;
-                        }
-                        if (append && !surfaces_.contains(e)) {
-                            continue;
-                        }
-                        surfaces_[e].merge(*surface);
-                    }
+                else {
+                    parseSurfaceLine(line, line_count, shell_dir, result, block.value());
                 }
                 break;
             default:
@@ -568,28 +758,46 @@ void Surfaces::parse(const std::filesystem::path &path) {
         }
     }
     if (state != State::Root) {
-        Logger::log("Error: invalid state");
+        Logger::warn("Error: invalid state");
+    }
+    if (lazy) {
+        result.source = file;
+        result.shell_dir = shell_dir;
     }
 }
 
 std::unique_ptr<Seriko> Surfaces::getSeriko() const {
-    return std::make_unique<Seriko>(surfaces_);
+    return std::make_unique<Seriko>(table_);
 }
 
 void Surfaces::dump() const {
-    for (auto &[k, v] : surfaces_) {
-        Logger::log("surface: ", k);
-        for (auto &[k, e] : v.element) {
+    auto dumpSurface = [](const Surface &surface) {
+        for (auto &[k, e] : surface.element) {
             Logger::log("  element", k, e.filename);
         }
-        for (auto &[k, a] : v.animation) {
+        for (auto &[k, a] : surface.animation) {
             Logger::log("  animation: ", k);
             for (auto &p : a.pattern) {
                 Logger::log("    pattern:", p.id);
             }
         }
-        for (auto &[k, c] : v.collision) {
+        for (auto &[k, c] : surface.collision) {
             Logger::log("  collision: ", k);
         }
+    };
+    for (auto &[k, v] : table_->bases()) {
+        Logger::log("surface: ", k);
+        dumpSurface(v);
+    }
+    for (auto &layer : table_->layers()) {
+        std::string ids;
+        for (auto [first, last] : layer.ids.ranges()) {
+            ids += (ids.empty()) ? ("") : (",");
+            ids += (first == last) ? (std::to_string(first)) : (std::to_string(first) + "-" + std::to_string(last));
+        }
+        Logger::log((layer.append) ? ("surface.append: ") : ("surface: "), ids);
+        if (layer.surface) {
+            dumpSurface(*layer.surface);
+        }
     }
 }
@@ -2,27 +2,38 @@
 #define SURFACES_H_
 
 #include <filesystem>
+#include <memory>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <vector>
 
 #include "seriko.h"
 #include "surface.h"
+#include "surface_table.h"
 
 class Seriko;
 
 class Surfaces {
     private:
         int version_;
-        std::unordered_map<int, Surface> surfaces_;
+        std::shared_ptr<SurfaceTable> table_;
         std::unordered_map<std::string, std::vector<int>> alias_;
 
-        void importAnimatedSurface(const std::filesystem::path &path);
+        struct Block;
+        struct File;
+        static void parseFile(const std::filesystem::path &path, File &result, bool lazy);
+        static void parseSurfaceLine(std::string_view line, int line_count, const std::filesystem::path &shell_dir, File &file, Block &block);
+        // importしたフレームのサーフェスIDを埋める
+        static void link(Block &block, const std::vector<int> &offsets);
+        // 遅延モードで後から1ブロック分を解析する
+        static Surface load(std::string_view body, int line_count, const std::filesystem::path &shell_dir, SurfaceTable &table);
+        void merge(File &file);
     public:
         Surfaces(const std::filesystem::path &ayu_dir);
         ~Surfaces() {}
         void addSurface(int n, const std::filesystem::path path) {
-            surfaces_[n].element[0] = {
+            table_->base(n).element[0] = {
                 .method = Method::Base,
                 .x = 0, .y = 0,
                 .filename = path
@@ -1,14 +1,39 @@
 #include "texture.h"
 
+#include <algorithm>
 #include <cassert>
+#include <utility>
 
 #include "image_cache.h"
+#include "metrics.h"
 
 namespace {
     std::unique_ptr<WrapTexture> invalid_texture;
+    const int kMaxScales = 3;
+
+    // アトラスの1ページの大きさ
+    const int kAtlasSize = 2048;
+    // これより大きい画像は単独のテクスチャにする
+    const int kMaxAtlasItem = 512;
+    const int kMaxAtlasPages = 4;
+    // 拡縮時に隣の画像が滲まないように透明な枠を付ける
+    const int kAtlasPadding = 1;
+
+    // ウィンドウ毎のキャッシュを合わせた値
+    metrics::Counter &hits = metrics::counter("texture_cache.hits");
+    metrics::Counter &misses = metrics::counter("texture_cache.misses");
+    metrics::Counter &evictions = metrics::counter("texture_cache.evictions");
+    metrics::Gauge &resident_bytes = metrics::gauge("texture_cache.resident_bytes");
+
+    int64_t bytesOf(const std::unique_ptr<WrapTexture> &texture) {
+        if (!texture || texture->texture() == nullptr) {
+            return 0;
+        }
+        return static_cast<int64_t>(texture->width()) * texture->height() * 4;
+    }
 }
 
-WrapSurface::WrapSurface(int w, int h) : is_upconverted_(false) {
+WrapSurface::WrapSurface(int w, int h, bool is_upconverted) : is_upconverted_(is_upconverted) {
     surface_ = SDL_CreateSurface(w, h, SDL_PIXELFORMAT_ABGR8888);
 }
 
@@ -16,6 +41,10 @@ WrapSurface::WrapSurface(ImageInfo &info) : is_upconverted_(info.isUpconverted()
     surface_ = SDL_CreateSurfaceFrom(info.width(), info.height(), SDL_PIXELFORMAT_ABGR8888, info.get().data(), info.width() * 4);
 }
 
+WrapSurface::WrapSurface(int w, int h, std::shared_ptr<std::vector<unsigned char>> pixels, bool is_upconverted) : is_upconverted_(is_upconverted), pixels_(std::move(pixels)) {
+    surface_ = SDL_CreateSurfaceFrom(w, h, SDL_PIXELFORMAT_ABGR8888, pixels_->data(), w * 4);
+}
+
 WrapSurface::~WrapSurface() {
     if (surface_ != nullptr) {
         SDL_DestroySurface(surface_);
@@ -23,38 +52,224 @@ WrapSurface::~WrapSurface() {
 }
 
 
-WrapTexture::WrapTexture(SDL_Renderer *renderer, int w, int h, bool is_upconverted) : is_upconverted_(is_upconverted) {
+WrapTexture::WrapTexture(SDL_Renderer *renderer, int w, int h, bool is_upconverted, int scale) : owned_(true), rect_({0, 0, 0, 0}), is_upconverted_(is_upconverted), scale_(scale) {
     texture_ = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ABGR8888, SDL_TEXTUREACCESS_TARGET, w, h);
 }
 
-WrapTexture::WrapTexture(SDL_Renderer *renderer, SDL_Surface *surface, bool is_upconverted) : is_upconverted_(is_upconverted) {
+WrapTexture::WrapTexture(SDL_Renderer *renderer, SDL_Surface *surface, bool is_upconverted, int scale) : owned_(true), rect_({0, 0, 0, 0}), is_upconverted_(is_upconverted), scale_(scale) {
     texture_ = SDL_CreateTextureFromSurface(renderer, surface);
 }
 
+WrapTexture::WrapTexture(SDL_Texture *atlas, const SDL_Rect &rect, bool is_upconverted, int scale) : texture_(atlas), owned_(false), is_upconverted_(is_upconverted), scale_(scale) {
+    SDL_RectToFRect(&rect, &rect_);
+}
+
+#if defined(USE_GPU_COMPOSITOR)
+WrapTexture::WrapTexture(SDL_Renderer *renderer, std::shared_ptr<SDL_GPUTexture> texture, int w, int h, bool is_upconverted, int scale) : owned_(true), rect_({0, 0, 0, 0}), is_upconverted_(is_upconverted), scale_(scale), gpu_texture_(std::move(texture)) {
+    SDL_PropertiesID props = SDL_CreateProperties();
+    // R8G8B8A8_UNORMと同じ並び
+    SDL_SetNumberProperty(props, SDL_PROP_TEXTURE_CREATE_FORMAT_NUMBER, SDL_PIXELFORMAT_ABGR8888);
+    SDL_SetNumberProperty(props, SDL_PROP_TEXTURE_CREATE_ACCESS_NUMBER, SDL_TEXTUREACCESS_STATIC);
+    SDL_SetNumberProperty(props, SDL_PROP_TEXTURE_CREATE_WIDTH_NUMBER, w);
+    SDL_SetNumberProperty(props, SDL_PROP_TEXTURE_CREATE_HEIGHT_NUMBER, h);
+    SDL_SetPointerProperty(props, SDL_PROP_TEXTURE_CREATE_GPU_TEXTURE_POINTER, gpu_texture_.get());
+    texture_ = SDL_CreateTextureWithProperties(renderer, props);
+    SDL_DestroyProperties(props);
+}
+#endif // USE_GPU_COMPOSITOR
+
 WrapTexture::~WrapTexture() {
-    if (texture_ != nullptr) {
+    if (owned_ && texture_ != nullptr) {
         SDL_DestroyTexture(texture_);
     }
 }
 
-TextureCache::TextureCache() {}
+TextureCache::TextureCache() : counter_(0), bytes_(0) {}
 
 TextureCache::~TextureCache() {
     cache_.clear();
+    resident_bytes.add(-bytes_);
 }
 
 std::unique_ptr<WrapTexture> &TextureCache::get(const std::filesystem::path &path, std::optional<int> index, SDL_Renderer *renderer, std::unique_ptr<ImageCache> &image_cache) {
-    auto &info = image_cache->get(path, index);
+    auto info = image_cache->getNearest(path, index);
     if (!info) {
         return invalid_texture;
     }
     ImagePath key = {path, index};
-    if (cache_.contains(key)) {
-        if (cache_.at(key)->isUpconverted() || cache_.at(key)->isUpconverted() == info->isUpconverted()) {
-            return cache_.at(key);
+    auto &textures = cache_[key];
+    counter_++;
+    if (textures.contains(info->scale())) {
+        auto &t = textures.at(info->scale());
+        if (t.texture->isUpconverted() || t.texture->isUpconverted() == info->isUpconverted()) {
+            t.used = counter_;
+            hits.add();
+            return t.texture;
+        }
+    }
+    misses.add();
+    if (textures.contains(info->scale())) {
+        retired_.push_back(std::move(textures.at(info->scale())));
+    }
+    int page = -1, shelf = -1;
+    auto texture = pack(renderer, info.value(), page, shelf);
+    if (!texture) {
+        WrapSurface surface(info.value());
+        texture = std::make_unique<WrapTexture>(renderer, surface.surface(), surface.isUpconverted(), info->scale());
+        bytes_ += bytesOf(texture);
+        resident_bytes.add(bytesOf(texture));
+    }
+    textures[info->scale()] = {std::move(texture), counter_, page, shelf};
+    while (textures.size() > kMaxScales) {
+        auto oldest = textures.begin();
+        for (auto it = textures.begin(); it != textures.end(); it++) {
+            if (it->second.used < oldest->second.used) {
+                oldest = it;
+            }
+        }
+        retired_.push_back(std::move(oldest->second));
+        textures.erase(oldest);
+        evictions.add();
+    }
+    return textures.at(info->scale()).texture;
+}
+
+std::unique_ptr<WrapTexture> TextureCache::pack(SDL_Renderer *renderer, ImageInfo &info, int &page, int &shelf) {
+    std::unique_ptr<WrapTexture> invalid;
+    if (info.width() > kMaxAtlasItem || info.height() > kMaxAtlasItem) {
+        return invalid;
+    }
+    int w = info.width() + 2 * kAtlasPadding;
+    int h = info.height() + 2 * kAtlasPadding;
+    // 高さの無駄が一番少ない棚に置く(shelf packing)
+    int found = -1;
+    size_t best = 0;
+    for (size_t i = 0; i < pages_.size(); i++) {
+        auto &shelves = pages_[i]->shelves;
+        for (size_t j = 0; j < shelves.size(); j++) {
+            auto &s = shelves[j];
+            if (h <= s.height && s.x + w <= kAtlasSize && (found == -1 || s.height < pages_[found]->shelves[best].height)) {
+                found = i;
+                best = j;
+            }
+        }
+    }
+    if (found == -1) {
+        for (size_t i = 0; i < pages_.size(); i++) {
+            if (pages_[i]->bottom + h <= kAtlasSize) {
+                found = i;
+                break;
+            }
         }
+        if (found == -1) {
+            if (pages_.size() >= static_cast<size_t>(kMaxAtlasPages)) {
+                return invalid;
+            }
+            SDL_Texture *texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ABGR8888, SDL_TEXTUREACCESS_STATIC, kAtlasSize, kAtlasSize);
+            if (texture == nullptr) {
+                return invalid;
+            }
+            auto p = std::make_unique<AtlasPage>();
+            p->texture = texture;
+            p->bottom = 0;
+            p->live = 0;
+            pages_.push_back(std::move(p));
+            bytes_ += static_cast<int64_t>(kAtlasSize) * kAtlasSize * 4;
+            resident_bytes.add(static_cast<int64_t>(kAtlasSize) * kAtlasSize * 4);
+            found = pages_.size() - 1;
+        }
+        auto &p = pages_[found];
+        p->shelves.push_back({p->bottom, h, 0, 0});
+        p->bottom += h;
+        best = p->shelves.size() - 1;
+    }
+    auto &p = pages_[found];
+    if (p->shelves[best].live == 0 && p->shelves[best].height > h) {
+        // 空いた棚は必要な高さだけ使い、残りは別の棚にする(一番下なら返す)
+        Shelf rest = {p->shelves[best].y + h, p->shelves[best].height - h, 0, 0};
+        p->shelves[best].height = h;
+        if (best + 1 == p->shelves.size()) {
+            p->bottom = rest.y;
+        }
+        else {
+            p->shelves.insert(p->shelves.begin() + best + 1, rest);
+        }
+    }
+    auto &s = p->shelves[best];
+    // 枠ごと書き込むのでページの前の内容は残らない
+    std::vector<unsigned char> data(w * h * 4, 0);
+    auto &src = info.get();
+    for (int y = 0; y < info.height(); y++) {
+        std::copy(src.begin() + 4 * y * info.width(), src.begin() + 4 * (y + 1) * info.width(), data.begin() + 4 * ((y + kAtlasPadding) * w + kAtlasPadding));
+    }
+    SDL_Rect area = {s.x, s.y, w, h};
+    if (!SDL_UpdateTexture(p->texture, &area, data.data(), w * 4)) {
+        return invalid;
+    }
+    s.x += w;
+    s.live++;
+    p->live++;
+    page = found;
+    shelf = s.y;
+    SDL_Rect rect = {area.x + kAtlasPadding, area.y + kAtlasPadding, info.width(), info.height()};
+    return std::make_unique<WrapTexture>(p->texture, rect, info.isUpconverted(), info.scale());
+}
+
+void TextureCache::collect() {
+    int64_t freed = 0;
+    for (auto &t : retired_) {
+        if (t.page < 0) {
+            freed += bytesOf(t.texture);
+        }
+        release(t.page, t.shelf);
+    }
+    retired_.clear();
+    bytes_ -= freed;
+    resident_bytes.add(-freed);
+}
+
+void TextureCache::clear() {
+    retired_.clear();
+    cache_.clear();
+    pages_.clear();
+    resident_bytes.add(-bytes_);
+    bytes_ = 0;
+}
+
+void TextureCache::release(int page, int shelf) {
+    if (page < 0 || static_cast<size_t>(page) >= pages_.size()) {
+        return;
+    }
+    auto &p = pages_[page];
+    p->live--;
+    // 空になったページは最初から詰め直す
+    if (p->live <= 0) {
+        p->live = 0;
+        p->shelves.clear();
+        p->bottom = 0;
+        return;
+    }
+    auto &shelves = p->shelves;
+    auto it = std::find_if(shelves.begin(), shelves.end(), [shelf](const Shelf &s) {
+        return s.y == shelf;
+    });
+    if (it == shelves.end() || --it->live > 0) {
+        return;
+    }
+    // 空いた棚は左から詰め直し、隣の空いた棚とまとめて高い画像も置けるようにする
+    it->x = 0;
+    it->live = 0;
+    if (it + 1 != shelves.end() && (it + 1)->live == 0) {
+        it->height += (it + 1)->height;
+        shelves.erase(it + 1);
+    }
+    if (it != shelves.begin() && (it - 1)->live == 0) {
+        (it - 1)->height += it->height;
+        it = shelves.erase(it) - 1;
+    }
+    // 一番下の棚が空いたら、その分は高さの違う棚にも使えるようにする
+    if (it + 1 == shelves.end()) {
+        p->bottom = it->y;
+        shelves.erase(it);
     }
-    WrapSurface surface(info.value());
-    cache_[key] = std::make_unique<WrapTexture>(renderer, surface.surface(), surface.isUpconverted());
-    return cache_.at(key);
 }
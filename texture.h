@@ -2,23 +2,37 @@
 #define TEXTURE_H_
 
 #include <cassert>
+#include <cstdint>
 #include <filesystem>
+#include <map>
 #include <memory>
 #include <optional>
 #include <unordered_map>
+#include <vector>
 
+#include <SDL3/SDL_gpu.h>
 #include <SDL3/SDL_render.h>
 #include <SDL3/SDL_surface.h>
+#include <SDL3/SDL_version.h>
 
 #include "image_cache.h"
 
+// 合成器がGPUに作った画像を同じデバイスのレンダラでそのまま表示する
+#if SDL_VERSION_ATLEAST(3, 4, 0)
+#define USE_GPU_COMPOSITOR
+#endif
+
 class WrapSurface {
     private:
         SDL_Surface *surface_;
         bool is_upconverted_;
+        // surface_の画素を借りている場合の持ち主(surface_より後に解放する)
+        std::shared_ptr<std::vector<unsigned char>> pixels_;
     public:
-        WrapSurface(int w, int h);
+        WrapSurface(int w, int h, bool is_upconverted = false);
         WrapSurface(ImageInfo &info);
+        // pixels(w * h * 4以上)を画素として使う
+        WrapSurface(int w, int h, std::shared_ptr<std::vector<unsigned char>> pixels, bool is_upconverted);
         ~WrapSurface();
         SDL_Surface *surface() {
             return surface_;
@@ -39,38 +53,89 @@ class WrapSurface {
 class WrapTexture {
     private:
         SDL_Texture *texture_;
+        // falseならアトラスの一部でtexture_は借り物
+        bool owned_;
+        SDL_FRect rect_;
         bool is_upconverted_;
+        int scale_;
+        // texture_より後に解放する
+        std::shared_ptr<SDL_GPUTexture> gpu_texture_;
     public:
-        WrapTexture(SDL_Renderer *renderer, int w, int h, bool is_upconverted);
-        WrapTexture(SDL_Renderer *renderer, SDL_Surface *surface, bool is_upconverted);
+        WrapTexture(SDL_Renderer *renderer, int w, int h, bool is_upconverted, int scale = 100);
+        WrapTexture(SDL_Renderer *renderer, SDL_Surface *surface, bool is_upconverted, int scale = 100);
+        WrapTexture(SDL_Texture *atlas, const SDL_Rect &rect, bool is_upconverted, int scale = 100);
+#if defined(USE_GPU_COMPOSITOR)
+        // GPUのテクスチャをコピーせずに包む(rendererは同じデバイスで作ったもの)
+        WrapTexture(SDL_Renderer *renderer, std::shared_ptr<SDL_GPUTexture> texture, int w, int h, bool is_upconverted, int scale = 100);
+#endif // USE_GPU_COMPOSITOR
         ~WrapTexture();
         SDL_Texture *texture() {
             return texture_;
         }
+        // 描画元の範囲(テクスチャ全体ならnullptr)
+        const SDL_FRect *source() const {
+            return (owned_) ? (nullptr) : (&rect_);
+        }
         int width() const {
             assert(texture_);
-            return texture_->w;
+            return (owned_) ? (texture_->w) : (static_cast<int>(rect_.w));
         }
         int height() const {
             assert(texture_);
-            return texture_->h;
+            return (owned_) ? (texture_->h) : (static_cast<int>(rect_.h));
         }
         bool isUpconverted() const {
             return is_upconverted_;
         }
+        int scale() const {
+            return scale_;
+        }
 };
 
 class TextureCache {
     private:
-        SDL_Renderer *renderer_;
-        std::unordered_map<ImagePath, std::unique_ptr<WrapTexture>> cache_;
+        struct ScaledTexture {
+            std::unique_ptr<WrapTexture> texture;
+            unsigned long long used;
+            // 載せているアトラスのページ(-1なら単独のテクスチャ)と棚のy
+            int page;
+            int shelf;
+        };
+        struct Shelf {
+            int y, height, x;
+            // 載っている画像の数(0になったら空の棚として使い直す)
+            int live;
+        };
+        // 小さい画像をまとめて載せるテクスチャ
+        struct AtlasPage {
+            SDL_Texture *texture;
+            // yの順に並べる
+            std::vector<Shelf> shelves;
+            int bottom;
+            // 載っている画像の数
+            int live;
+            ~AtlasPage() {
+                SDL_DestroyTexture(texture);
+            }
+        };
+        unsigned long long counter_;
+        // 単独のテクスチャとアトラスのページが使っているおおよそのVRAM
+        int64_t bytes_;
+        // cache_とretired_より先に破棄されないようにここに置く
+        std::vector<std::unique_ptr<AtlasPage>> pages_;
+        // 画像毎に最近使った倍率のテクスチャを保持する
+        std::unordered_map<ImagePath, std::map<int, ScaledTexture>> cache_;
+        // 合成中に他の要素から参照されているかもしれないので、差し替えたテクスチャはcollectまで残す
+        std::vector<ScaledTexture> retired_;
+
+        std::unique_ptr<WrapTexture> pack(SDL_Renderer *renderer, ImageInfo &info, int &page, int &shelf);
+        void release(int page, int shelf);
     public:
         TextureCache();
         ~TextureCache();
         std::unique_ptr<WrapTexture> &get(const std::filesystem::path &path, const std::optional<int> index, SDL_Renderer *renderer, std::unique_ptr<ImageCache> &cache);
-        void clear() {
-            cache_.clear();
-        }
+        void collect();
+        void clear();
 };
 
 #endif // TEXTURE_H_
@@ -0,0 +1,117 @@
+#include "trace.h"
+
+#if defined(USE_TRACE)
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "logger.h"
+
+namespace {
+    // スレッド毎に覚えておく数の上限(超えた分は捨てる)
+    const size_t kMaxEvents = 1 << 20;
+
+    struct Event {
+        const char *name;
+        // マイクロ秒
+        int64_t begin;
+        int64_t duration;
+    };
+
+    // 書き出す時以外は持ち主のスレッドしか触らないのでロックは競合しない
+    struct Buffer {
+        std::mutex mutex;
+        int tid;
+        std::vector<Event> events;
+        uint64_t dropped = 0;
+    };
+
+    std::atomic<bool> active(false);
+    std::atomic<int64_t> origin(0);
+    std::mutex registry_mutex;
+    std::vector<std::shared_ptr<Buffer>> buffers;
+
+    int64_t now() {
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    Buffer &local() {
+        thread_local std::shared_ptr<Buffer> buffer = []() {
+            auto b = std::make_shared<Buffer>();
+            std::unique_lock<std::mutex> lock(registry_mutex);
+            b->tid = buffers.size() + 1;
+            buffers.push_back(b);
+            return b;
+        }();
+        return *buffer;
+    }
+}
+
+namespace trace {
+    void start() {
+        origin = now();
+        active = true;
+    }
+
+    bool enabled() {
+        return active;
+    }
+
+    bool dump(const std::filesystem::path &path) {
+        std::vector<std::shared_ptr<Buffer>> list;
+        {
+            std::unique_lock<std::mutex> lock(registry_mutex);
+            list = buffers;
+        }
+        std::ofstream ofs(path);
+        if (!ofs) {
+            Logger::error("trace: failed to open", path);
+            return false;
+        }
+        int64_t base = origin;
+        bool first = true;
+        uint64_t count = 0, dropped = 0;
+        ofs << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+        for (auto &b : list) {
+            std::vector<Event> events;
+            {
+                std::unique_lock<std::mutex> lock(b->mutex);
+                events = b->events;
+                dropped += b->dropped;
+            }
+            for (auto &e : events) {
+                ofs << ((first) ? ("\n") : (",\n"));
+                first = false;
+                // 名前はリテラルなのでエスケープしない
+                ofs << "{\"name\":\"" << e.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << b->tid
+                    << ",\"ts\":" << e.begin - base << ",\"dur\":" << e.duration << "}";
+            }
+            count += events.size();
+        }
+        ofs << "\n]}\n";
+        Logger::info("trace:", count, "events,", dropped, "dropped, written to", path);
+        return ofs.good();
+    }
+
+    Zone::Zone(const char *name) : name_(name), begin_((active) ? (now()) : (-1)) {}
+
+    Zone::~Zone() {
+        if (begin_ < 0) {
+            return;
+        }
+        int64_t end = now();
+        auto &b = local();
+        std::unique_lock<std::mutex> lock(b.mutex);
+        if (b.events.size() >= kMaxEvents) {
+            b.dropped++;
+            return;
+        }
+        b.events.push_back({name_, begin_, end - begin_});
+    }
+}
+
+#endif // USE_TRACE
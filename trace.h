@@ -0,0 +1,41 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+// USE_TRACEを定義してビルドした時だけ有効になる計測区間
+// TRACE_ZONE("名前")を置いたスコープの開始から終了までを記録し、
+// Chromeのchrome://tracingやPerfettoで読めるJSONに書き出す
+// 名前は文字列リテラルを渡すこと(ポインタのまま覚えておく)
+
+#if defined(USE_TRACE)
+
+#include <cstdint>
+#include <filesystem>
+
+namespace trace {
+    // 記録を始める(それまでのZoneは何もしない)
+    void start();
+    bool enabled();
+    // それまでの記録を書き出す
+    bool dump(const std::filesystem::path &path);
+
+    class Zone {
+        private:
+            const char *name_;
+            int64_t begin_;
+        public:
+            Zone(const char *name);
+            ~Zone();
+    };
+}
+
+#define TRACE_CONCAT_IMPL(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_IMPL(a, b)
+#define TRACE_ZONE(name) trace::Zone TRACE_CONCAT(trace_zone_, __LINE__)(name)
+
+#else
+
+#define TRACE_ZONE(name) do {} while (false)
+
+#endif // USE_TRACE
+
+#endif // TRACE_H_
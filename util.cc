@@ -27,6 +27,10 @@ namespace util {
         return dist(mt);
     }
 
+    void seedRandom(unsigned int seed) {
+        mt.seed(seed);
+    }
+
     std::string side2str(int side) {
         if (side == 0) {
             return "sakura";
@@ -154,7 +158,7 @@ namespace util {
             size_t out_length = converted.length();
             SDL_iconv_t cd = SDL_iconv_open("UTF-8", charset.c_str());
             if (reinterpret_cast<size_t>(cd) == SDL_ICONV_ERROR) {
-                Logger::log("iconv_open error");
+                Logger::warn("iconv_open error");
                 return buffer;
             }
             auto err = SDL_iconv(cd, &in, &in_length, &out, &out_length);
@@ -163,7 +167,7 @@ namespace util {
                 continue;
             }
             else if (err < 0) {
-                Logger::log("iconv error");
+                Logger::warn("iconv error");
                 return buffer;
             }
             else {
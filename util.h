@@ -7,8 +7,6 @@
 
 #include <SDL3/SDL_video.h>
 
-constexpr int BUFFER_SIZE = 1024;
-
 namespace util {
     template<typename T>
     void to_x(std::string s, T &value) {
@@ -25,6 +23,8 @@ namespace util {
 
     double random();
     int random(int a, int b);
+    // 再生ツールで毎回同じ乱数列にする
+    void seedRandom(unsigned int seed);
 
     std::string side2str(int side);
 
@@ -9,6 +9,7 @@
 #include "logger.h"
 #include "misc.h"
 #include "sstp.h"
+#include "trace.h"
 
 #define MOUSE_BUTTON_LEFT 1
 #define MOUSE_BUTTON_MIDDLE 2
@@ -60,7 +61,8 @@ Window::Window(Character *parent, SDL_DisplayID id)
     : window_(nullptr), size_({0, 0}),
     position_({0, 0}), parent_(parent),
     adjust_(false), counter_(0), offset_({0, 0}), renderer_(nullptr),
-    redrawn_(false), changed_(false) {
+    redrawn_(false), changed_(false),
+    draw_time_(metrics::histogram("window." + std::to_string(parent->side()) + "." + std::to_string(id) + ".draw_us")) {
     if (util::isWayland() && id > 0) {
         SDL_Rect r;
         SDL_GetDisplayBounds(id, &r);
@@ -91,7 +93,18 @@ Window::Window(Character *parent, SDL_DisplayID id)
     else {
         window_ = SDL_CreateWindow(parent_->name().c_str(), 200, 200, SDL_WINDOW_TRANSPARENT | SDL_WINDOW_BORDERLESS | SDL_WINDOW_INPUT_FOCUS | SDL_WINDOW_MOUSE_FOCUS);
     }
-    renderer_ = SDL_CreateRenderer(window_, nullptr);
+#if defined(USE_GPU_COMPOSITOR)
+    // 合成器の結果をそのまま表示できるように同じデバイスで描画する
+    if (SDL_GPUDevice *device = parent_->gpuDevice()) {
+        renderer_ = SDL_CreateGPURenderer(device, window_);
+        if (renderer_ == nullptr) {
+            Logger::warn("failed to create gpu renderer: ", SDL_GetError());
+        }
+    }
+#endif // USE_GPU_COMPOSITOR
+    if (renderer_ == nullptr) {
+        renderer_ = SDL_CreateRenderer(window_, nullptr);
+    }
     SDL_SetRenderVSync(renderer_, 1);
     texture_cache_ = std::make_unique<TextureCache>();
 #if defined(IS__NIX)
@@ -152,22 +165,75 @@ void Window::position(int x, int y) {
     }
 }
 
-void Window::draw(std::unique_ptr<ImageCache> &image_cache, Offset offset, std::unique_ptr<WrapSurface> &surface, const ElementWithChildren &element, const bool changed) {
+void Window::draw(std::unique_ptr<ImageCache> &image_cache, Offset offset, std::unique_ptr<WrapSurface> &surface, const std::unique_ptr<WrapSurface> &shape, const std::shared_ptr<SDL_GPUTexture> &texture, const ElementWithChildren &element, const bool changed, const bool composited) {
+    TRACE_ZONE("Window::draw");
     if (current_element_ == element && offset_ == offset && current_texture_ && current_texture_->isUpconverted() && !changed && !changed_) {
         redrawn_ = false;
         return;
     }
+    metrics::Timer timer(draw_time_);
     changed_ = false;
     auto m = getMonitorRect();
     SDL_SetRenderTarget(renderer_, nullptr);
     SDL_SetRenderDrawColor(renderer_, 0x00, 0x00, 0x00, 0x00);
     SDL_RenderClear(renderer_);
-    current_texture_ = element.getTexture(renderer_, texture_cache_, image_cache, scale());
-    if (current_texture_) {
+    bool gpu_scaled = image_cache->useGPUScaling() && scale() != 100;
+    if (composited) {
+        current_texture_.reset();
+        if (surface) {
+            int s = (gpu_scaled) ? (100) : (scale());
+#if defined(USE_GPU_COMPOSITOR)
+            if (texture) {
+                // GPUで合成したものは転送せずにそのまま使う
+                current_texture_ = std::make_unique<WrapTexture>(renderer_, texture, surface->width(), surface->height(), surface->isUpconverted(), s);
+            }
+            else
+#endif // USE_GPU_COMPOSITOR
+            {
+                current_texture_ = std::make_unique<WrapTexture>(renderer_, surface->surface(), surface->isUpconverted(), s);
+            }
+            if (current_texture_->texture() == nullptr) {
+                Logger::error("failed to create texture: ", SDL_GetError());
+                current_texture_.reset();
+            }
+        }
+    }
+    else {
+        current_texture_ = element.getTexture(renderer_, texture_cache_, image_cache, scale());
+        texture_cache_->collect();
+    }
+    WrapTexture *display = current_texture_.get();
+    if (composited && gpu_scaled && current_texture_) {
+        // 原寸で合成したものをGPUで拡縮する
+        int w = std::round(current_texture_->width() * scale() / 100.0);
+        int h = std::round(current_texture_->height() * scale() / 100.0);
+        if (!scaled_texture_ || scaled_texture_->width() != w || scaled_texture_->height() != h) {
+            scaled_texture_ = std::make_unique<WrapTexture>(renderer_, w, h, current_texture_->isUpconverted(), scale());
+            if (scaled_texture_->texture() == nullptr) {
+                Logger::error("failed to create texture: ", SDL_GetError());
+                scaled_texture_.reset();
+            }
+        }
+        display = scaled_texture_.get();
+        if (display != nullptr) {
+            SDL_SetRenderTarget(renderer_, display->texture());
+            SDL_RenderClear(renderer_);
+            SDL_SetTextureBlendMode(current_texture_->texture(), SDL_BLENDMODE_NONE);
+            SDL_SetTextureScaleMode(current_texture_->texture(), SDL_SCALEMODE_LINEAR);
+            SDL_RenderTexture(renderer_, current_texture_->texture(), nullptr, nullptr);
+            SDL_SetRenderTarget(renderer_, nullptr);
+        }
+    }
+    else {
+        scaled_texture_.reset();
+    }
+    // 形状は表示するものと同じ大きさの画像から取る(GPUで拡縮するモードではワーカーが作ったもの)
+    WrapSurface *shape_surface = (gpu_scaled) ? (shape.get()) : (surface.get());
+    if (display != nullptr) {
         if (!util::isWayland()) {
-            SDL_SetWindowSize(window_, current_texture_->width(), current_texture_->height());
+            SDL_SetWindowSize(window_, display->width(), display->height());
         }
-        parent_->setSize(current_texture_->width(), current_texture_->height());
+        parent_->setSize(display->width(), display->height());
         while (adjust_) {
             int side = parent_->side();
             int origin_x = m.x + m.width;
@@ -180,24 +246,24 @@ void Window::draw(std::unique_ptr<ImageCache> &image_cache, Offset offset, std::
                     origin_x = o->x;
                 }
             }
-            origin_x -= current_texture_->width();
+            origin_x -= display->width();
             if (origin_x < m.x) {
                 origin_x = m.x;
             }
             int origin_y = m.y + m.height;
-            origin_y -= current_texture_->height();
+            origin_y -= display->height();
             parent_->setOffset(origin_x, origin_y);
             offset = {origin_x, origin_y};
 
             adjust_ = false;
         }
         SDL_SetRenderTarget(renderer_, nullptr);
-        SDL_BlendMode mode = SDL_ComposeCustomBlendMode(SDL_BLENDFACTOR_ONE, SDL_BLENDFACTOR_ONE_MINUS_SRC_ALPHA, SDL_BLENDOPERATION_ADD, SDL_BLENDFACTOR_ONE, SDL_BLENDFACTOR_ONE, SDL_BLENDOPERATION_ADD);
-        SDL_SetTextureBlendMode(current_texture_->texture(), mode);
-        SDL_FRect r = { offset.x - m.x, offset.y - m.y, current_texture_->width(), current_texture_->height() };
-        SDL_RenderTexture(renderer_, current_texture_->texture(), nullptr, &r);
+        SDL_SetTextureBlendMode(display->texture(), SDL_BLENDMODE_BLEND_PREMULTIPLIED);
+        SDL_FRect r = { static_cast<float>(offset.x - m.x), static_cast<float>(offset.y - m.y), static_cast<float>(display->width()), static_cast<float>(display->height()) };
+        SDL_RenderTexture(renderer_, display->texture(), nullptr, &r);
     }
-    if (surface) {
+    if (shape_surface) {
+        TRACE_ZONE("Window::shape");
         std::vector<int> shape;
 #if defined(IS__NIX)
         bool is_wayland = util::isWayland();
@@ -208,11 +274,11 @@ void Window::draw(std::unique_ptr<ImageCache> &image_cache, Offset offset, std::
         }
 #endif // Linux/Unix
         {
-            SDL_LockSurface(surface->surface());
-            for (int y = 0; y < surface->height(); y++) {
-                for (int x = 0; x < surface->width(); x++) {
-                    unsigned char *p = static_cast<unsigned char *>(surface->surface()->pixels);
-                    int index = y * surface->width() + x;
+            SDL_LockSurface(shape_surface->surface());
+            for (int y = 0; y < shape_surface->height(); y++) {
+                for (int x = 0; x < shape_surface->width(); x++) {
+                    unsigned char *p = static_cast<unsigned char *>(shape_surface->surface()->pixels);
+                    int index = y * shape_surface->width() + x;
                     if (p[4 * index + 3]) {
                         shape.push_back(index);
 #if defined(IS__NIX)
@@ -230,12 +296,12 @@ void Window::draw(std::unique_ptr<ImageCache> &image_cache, Offset offset, std::
                 }
 #if defined(IS__NIX)
                 if (x_begin != -1 && is_wayland) {
-                    wl_region_add(region, offset.x - m.x + x_begin, offset.y - m.y + y, surface->width() - x_begin, 1);
+                    wl_region_add(region, offset.x - m.x + x_begin, offset.y - m.y + y, shape_surface->width() - x_begin, 1);
                     x_begin = -1;
                 }
 #endif // Linux/Unix
             }
-            SDL_UnlockSurface(surface->surface());
+            SDL_UnlockSurface(shape_surface->surface());
         }
         if (!shape_ || shape_ != shape || offset_ != offset) {
 #if defined(IS__NIX)
@@ -246,7 +312,7 @@ void Window::draw(std::unique_ptr<ImageCache> &image_cache, Offset offset, std::
             else
 #endif // Linux/Unix
             {
-                SDL_SetWindowShape(window_, surface->surface());
+                SDL_SetWindowShape(window_, shape_surface->surface());
             }
             shape_ = shape;
         }
@@ -321,6 +387,10 @@ void Window::clearCache() {
     texture_cache_->clear();
 }
 
+void Window::prefetch(std::unique_ptr<ImageCache> &image_cache, const ImagePath &path) {
+    texture_cache_->get(path.path, path.index, renderer_, image_cache);
+}
+
 void Window::raise() {
     SDL_RaiseWindow(window_);
 }
@@ -355,6 +425,14 @@ void Window::motion(const SDL_MouseMotionEvent &event) {
             SDL_Cursor *cursor = SDL_CreateSystemCursor(SDL_SYSTEM_CURSOR_POINTER);
             SDL_SetCursor(cursor);
         }
+        if (util::isWayland()) {
+            Offset offset = parent_->getOffset();
+            xi = xi - offset.x;
+            yi = yi - offset.y;
+        }
+        std::vector<std::string> args = {util::to_s(xi), util::to_s(yi), util::to_s(0), util::to_s(parent_->side()), name};
+        Request req = {"NOTIFY", "OnMouseMove", args};
+        parent_->enqueueDirectSSTP({req});
     }
     if (!parent_->drag().has_value() && mouse_state_[MOUSE_BUTTON_LEFT].press) {
         if (util::isWayland()) {
@@ -515,7 +593,26 @@ void Window::wheel(const SDL_MouseWheelEvent &event) {
     if (event.windowID != SDL_GetWindowID(window_)) {
         return;
     }
-    // TODO stub
+    int x = event.mouse_x, y = event.mouse_y;
+    if (util::isWayland()) {
+        auto r = getMonitorRect();
+        x = x + r.x;
+        y = y + r.y;
+    }
+    auto name = parent_->getHitBoxName(x, y);
+    if (util::isWayland()) {
+        Offset offset = parent_->getOffset();
+        x = x - offset.x;
+        y = y - offset.y;
+    }
+    // 1ノッチを120とする
+    int delta = std::round(event.y * 120);
+    if (event.direction == SDL_MOUSEWHEEL_FLIPPED) {
+        delta = -delta;
+    }
+    std::vector<std::string> args = {util::to_s(x), util::to_s(y), util::to_s(delta), util::to_s(parent_->side()), name};
+    Request req = {"NOTIFY", "OnMouseWheel", args};
+    parent_->enqueueDirectSSTP({req});
 }
 
 void Window::maximized(const SDL_WindowEvent &event) {
@@ -11,6 +11,7 @@
 #include <unordered_map>
 #include <vector>
 
+#include <SDL3/SDL_gpu.h>
 #include <SDL3/SDL_render.h>
 #include <SDL3/SDL_video.h>
 
@@ -21,6 +22,7 @@
 #include "element.h"
 #include "image_cache.h"
 #include "logger.h"
+#include "metrics.h"
 #include "misc.h"
 #include "util.h"
 
@@ -51,8 +53,12 @@ class Window {
         std::unique_ptr<TextureCache> texture_cache_;
         ElementWithChildren current_element_;
         std::unique_ptr<WrapTexture> current_texture_;
+        // GPUで拡縮するモードで合成済みの画像を拡縮して描く先(大きさが変わるまで使い回す)
+        std::unique_ptr<WrapTexture> scaled_texture_;
         bool redrawn_;
         bool changed_;
+        // 描き直した時に合成と表示にかかった時間
+        metrics::Histogram &draw_time_;
 #if defined(IS__NIX)
         wl_registry *reg_;
         wl_compositor *compositor_;
@@ -76,7 +82,10 @@ class Window {
         void position(int x, int y);
         void focus(int focused);
 
-        void draw(std::unique_ptr<ImageCache> &image_cache, Offset offset, std::unique_ptr<WrapSurface> &surface, const ElementWithChildren &element, const bool changed);
+        // composited: 合成済みの画像(textureが無ければsurface)をそのまま表示する
+        // textureはGPUで合成したもので、surfaceにはアルファだけが入っている
+        // GPUで拡縮するモードではsurfaceは原寸なので、形状は表示する大きさにしたshapeから取る
+        void draw(std::unique_ptr<ImageCache> &image_cache, Offset offset, std::unique_ptr<WrapSurface> &surface, const std::unique_ptr<WrapSurface> &shape, const std::shared_ptr<SDL_GPUTexture> &texture, const ElementWithChildren &element, const bool changed, const bool composited);
         bool swapBuffers();
 
         void setPosition(int x, int y) {
@@ -113,6 +122,8 @@ class Window {
         double distance(int x, int y) const;
 
         void clearCache();
+        // 読み込み済みの画像のテクスチャを先に作っておく
+        void prefetch(std::unique_ptr<ImageCache> &image_cache, const ImagePath &path);
 
         void raise();
         void key(const SDL_KeyboardEvent &event);